@@ -4,6 +4,12 @@ CONFIG += c++14
 SOURCES += main.cpp \
     scenerenderer.cpp \
     kdtree.cpp \
+    spatialindex.cpp \
+    hashgrid.cpp \
+    mortonorder.cpp \
+    neighborhoodgraph.cpp \
+    vertexfileloader.cpp \
+    pointcloudfile.cpp \
     SVD.cpp
 
 RESOURCES += qml.qrc
@@ -33,8 +39,16 @@ HEADERS += \
     utils.h \
     scenerenderer.h \
     vertexfileloader.h \
+    pointcloudfile.h \
     scenerendererqmlwrapper.h \
+    spatialindex.h \
     kdtree.h \
+    kdtreend.h \
+    kdtreebuild.h \
+    hashgrid.h \
+    mortonorder.h \
+    neighborhoodgraph.h \
+    mappablearray.h \
     vertexarrayobject.h \
     vertex.h \
     Matrix.h \
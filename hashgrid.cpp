@@ -0,0 +1,343 @@
+#include "hashgrid.h"
+#include "kdtreebuild.h"
+#include <QDebug>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <omp.h>
+
+/*!
+ * \brief hash table slot of a cell
+ * \details Fibonacci hashing, the upper bits of the product are the best mixed ones
+ */
+inline size_t hashSlot(quint64 key, int shift) { return (key * 0x9E3779B97F4A7C15ull) >> shift; }
+
+const int HashGrid::MAX_CELLS_PER_AXIS;
+const quint64 HashGrid::EMPTY_KEY;
+const int HashGrid::SCAN_BLOCK_SIZE;
+
+void HashGrid::build(std::vector<Vertex>& vertices, bool parallel)
+{
+    m_vertexArrayPointer = vertices.data();
+    const PointIndex numPoints = vertices.size();
+
+    m_cells.clear();
+    m_hashShift = 64;
+    m_numCells = 0;
+    m_x.clear();
+    m_y.clear();
+    m_z.clear();
+    m_indices.clear();
+    m_cellSize = m_requestedCellSize;
+    std::fill(m_gridSize, m_gridSize + 3, 0);
+
+    if(numPoints == 0) return;
+
+    float minX = std::numeric_limits<float>::max(), minY = minX, minZ = minX;
+    float maxX = -minX, maxY = -minX, maxZ = -minX;
+    #pragma omp parallel for if(parallel) reduction(min:minX, minY, minZ) reduction(max:maxX, maxY, maxZ)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        const QVector3D& p = vertices[i].position;
+        minX = std::min(minX, p.x()); maxX = std::max(maxX, p.x());
+        minY = std::min(minY, p.y()); maxY = std::max(maxY, p.y());
+        minZ = std::min(minZ, p.z()); maxZ = std::max(maxZ, p.z());
+    }
+    m_origin = QVector3D(minX, minY, minZ);
+
+    // cells are enlarged if the cloud is too large for the requested size, cell coordinates have to fit into their bits
+    const float extent[3] = {maxX - minX, maxY - minY, maxZ - minZ};
+    const float maxExtent = *std::max_element(extent, extent + 3);
+    m_cellSize = std::max(m_requestedCellSize, maxExtent / (MAX_CELLS_PER_AXIS - 1));
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        m_gridSize[axis] = (int) std::min<double>( std::floor(extent[axis] / m_cellSize), MAX_CELLS_PER_AXIS - 1 ) + 1;
+    }
+
+    // sorting by key makes the points of every cell contiguous, ties are ordered by offset
+    std::vector< std::pair<quint64, PointIndex> > keys(numPoints);
+    #pragma omp parallel for if(parallel)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        const QVector3D& p = vertices[i].position;
+        keys[i].first = cellKey( cellCoordinate(p.x(), 0), cellCoordinate(p.y(), 1), cellCoordinate(p.z(), 2) );
+        keys[i].second = i;
+    }
+    sortElements(keys.begin(), keys.end(), parallel);
+
+    m_x.resize(numPoints);
+    m_y.resize(numPoints);
+    m_z.resize(numPoints);
+    m_indices.resize(numPoints);
+
+    PointIndex numCells = 1;
+    #pragma omp parallel for if(parallel) reduction(+:numCells)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        const QVector3D& p = vertices[ keys[i].second ].position;
+        m_x[i] = p.x();
+        m_y[i] = p.y();
+        m_z[i] = p.z();
+        m_indices[i] = keys[i].second;
+
+        if(i > 0 && keys[i].first != keys[i - 1].first) ++numCells;
+    }
+    m_numCells = numCells;
+
+    // at most half of the slots are used, which keeps probe sequences short
+    size_t numSlots = 2;
+    m_hashShift = 63;
+    while(numSlots < 2 * (size_t) m_numCells)
+    {
+        numSlots <<= 1;
+        --m_hashShift;
+    }
+    m_cells.assign(numSlots, Cell());
+
+    for(PointIndex begin = 0; begin < numPoints; )
+    {
+        const quint64 key = keys[begin].first;
+        PointIndex end = begin + 1;
+        while(end < numPoints && keys[end].first == key) ++end;
+
+        size_t slot = hashSlot(key, m_hashShift);
+        while(m_cells[slot].key != EMPTY_KEY) slot = (slot + 1) & (numSlots - 1);
+
+        m_cells[slot].key = key;
+        m_cells[slot].begin = begin;
+        m_cells[slot].end = end;
+        begin = end;
+    }
+}
+
+void HashGrid::pointsInBox(const QVector3D& min, const QVector3D& max, std::vector<PointIndex>& indices) const
+{
+    indices.clear();
+
+    int lower[3], upper[3];
+    if( !cellRange(min, max, lower, upper) ) return;
+
+    auto visitCell = [&](const Cell& cell, const int*) { scanCellBox(cell, min, max, indices); return true; };
+    forEachCell(lower, upper, visitCell);
+}
+
+void HashGrid::pointsInSphere(const QVector3D& center, const float distance, std::vector<PointIndex>& indices) const
+{
+    indices.clear();
+    appendPointsInSphere(center, distance, indices);
+}
+
+void HashGrid::appendPointsInSphere(const QVector3D& center, const float distance, std::vector<PointIndex>& indices) const
+{
+    const QVector3D extent(distance, distance, distance);
+    int lower[3], upper[3];
+    if( !cellRange(center - extent, center + extent, lower, upper) ) return;
+
+    // cells of the bounding cube that do not touch the sphere, e.g. its corners, are skipped
+    const float sqrDistance = distance * distance;
+    auto visitCell = [&](const Cell& cell, const int* coordinates)
+    {
+        if(cellSqrDistance(center, coordinates) <= sqrDistance) scanCellSphere(cell, center, sqrDistance, indices);
+        return true;
+    };
+    forEachCell(lower, upper, visitCell);
+}
+
+Vertex* HashGrid::nearestPoint(const QVector3D& point) const
+{
+    if(m_cells.empty()) return 0;
+
+    int center[3];
+    int maxShell = 0;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        center[axis] = cellCoordinate(point[axis], axis);
+        maxShell = std::max(maxShell, std::max(center[axis], m_gridSize[axis] - 1 - center[axis]));
+    }
+
+    float nearestSqrDistance = std::numeric_limits<float>::max();
+    PointIndex nearest = -1;
+
+    auto visitCell = [&](const int* coordinates)
+    {
+        if(cellSqrDistance(point, coordinates) >= nearestSqrDistance) return;
+
+        const Cell* cell = findCell( cellKey(coordinates[0], coordinates[1], coordinates[2]) );
+        if(cell) nearestInCell(*cell, point, nearestSqrDistance, nearest);
+    };
+
+    // shell k holds all cells whose coordinates differ from center by exactly k along at least one axis
+    for(int shell = 0; shell <= maxShell; ++shell)
+    {
+        // a shell with more cells than are occupied is not searched cell by cell, the remaining occupied cells are
+        // scanned directly instead, which finishes the search
+        const double side = 2.0 * shell + 1;
+        const double shellCells = shell == 0 ? 1 : side * side * side - (side - 2) * (side - 2) * (side - 2);
+        if(shellCells > m_numCells)
+        {
+            for(const Cell& cell : m_cells)
+            {
+                if(cell.key == EMPTY_KEY) continue;
+
+                int coordinates[3];
+                cellCoordinates(cell.key, coordinates);
+                const int cellShell = std::max( std::abs(coordinates[0] - center[0]),
+                                                std::max( std::abs(coordinates[1] - center[1]), std::abs(coordinates[2] - center[2]) ) );
+                if(cellShell >= shell && cellSqrDistance(point, coordinates) < nearestSqrDistance)
+                    nearestInCell(cell, point, nearestSqrDistance, nearest);
+            }
+            break;
+        }
+
+        int coordinates[3];
+        const int lowerZ = std::max(0, center[2] - shell), upperZ = std::min(m_gridSize[2] - 1, center[2] + shell);
+        const int lowerY = std::max(0, center[1] - shell), upperY = std::min(m_gridSize[1] - 1, center[1] + shell);
+        for(coordinates[2] = lowerZ; coordinates[2] <= upperZ; ++coordinates[2])
+        {
+            for(coordinates[1] = lowerY; coordinates[1] <= upperY; ++coordinates[1])
+            {
+                const bool isShellFace = std::abs(coordinates[2] - center[2]) == shell ||
+                                         std::abs(coordinates[1] - center[1]) == shell;
+                if(isShellFace)
+                {
+                    const int upperX = std::min(m_gridSize[0] - 1, center[0] + shell);
+                    for(coordinates[0] = std::max(0, center[0] - shell); coordinates[0] <= upperX; ++coordinates[0])
+                        visitCell(coordinates);
+                    continue;
+                }
+
+                // inside the shell only the two cells on its x faces belong to it
+                coordinates[0] = center[0] - shell;
+                if(coordinates[0] >= 0) visitCell(coordinates);
+                coordinates[0] = center[0] + shell;
+                if(coordinates[0] < m_gridSize[0]) visitCell(coordinates);
+            }
+        }
+
+        // all points beyond this shell are at least shell cell sizes away from point
+        const float shellDistance = shell * m_cellSize;
+        if(nearest >= 0 && nearestSqrDistance <= shellDistance * shellDistance) break;
+    }
+
+    return nearest < 0 ? 0 : m_vertexArrayPointer + m_indices[nearest];
+}
+
+int HashGrid::cellCoordinate(float value, int axis) const
+{
+    const double coordinate = std::floor( ((double) value - m_origin[axis]) / m_cellSize );
+    return (int) std::max( 0.0, std::min(coordinate, (double) m_gridSize[axis] - 1) );
+}
+
+bool HashGrid::cellRange(const QVector3D& min, const QVector3D& max, int* lower, int* upper) const
+{
+    if(m_cells.empty()) return false;
+
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        if(max[axis] < m_origin[axis] || min[axis] > m_origin[axis] + m_gridSize[axis] * m_cellSize) return false;
+
+        lower[axis] = cellCoordinate(min[axis], axis);
+        upper[axis] = cellCoordinate(max[axis], axis);
+    }
+    return true;
+}
+
+const HashGrid::Cell* HashGrid::findCell(quint64 key) const
+{
+    if(m_cells.empty()) return 0;
+
+    const size_t mask = m_cells.size() - 1;
+    for(size_t slot = hashSlot(key, m_hashShift); ; slot = (slot + 1) & mask)
+    {
+        const Cell& cell = m_cells[slot];
+        if(cell.key == key) return &cell;
+        if(cell.key == EMPTY_KEY) return 0;
+    }
+}
+
+float HashGrid::cellSqrDistance(const QVector3D& point, const int* cell) const
+{
+    // computed in double precision like HashGrid::cellCoordinate, so points are never outside of their cell
+    double sqrDistance = 0;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        const double lower = m_origin[axis] + cell[axis] * (double) m_cellSize;
+        const double offset = std::max( 0.0, std::max(lower - point[axis], point[axis] - (lower + m_cellSize)) );
+        sqrDistance += offset * offset;
+    }
+    return (float) sqrDistance;
+}
+
+void HashGrid::scanCellBox(const Cell& cell, const QVector3D& min, const QVector3D& max, std::vector<PointIndex>& indices) const
+{
+    const float minX = min.x(), minY = min.y(), minZ = min.z();
+    const float maxX = max.x(), maxY = max.y(), maxZ = max.z();
+
+    // cells are not limited in size, hence they are tested in blocks
+    int inside[SCAN_BLOCK_SIZE];
+    for(PointIndex block = cell.begin; block < cell.end; block += SCAN_BLOCK_SIZE)
+    {
+        const int numPoints = (int) std::min<PointIndex>(SCAN_BLOCK_SIZE, cell.end - block);
+        const float* x = m_x.data() + block;
+        const float* y = m_y.data() + block;
+        const float* z = m_z.data() + block;
+
+        // branch-free test of the whole block, vectorized by the compiler
+        #pragma omp simd
+        for(int i = 0; i < numPoints; ++i)
+        {
+            inside[i] = (x[i] >= minX) & (x[i] <= maxX) &
+                        (y[i] >= minY) & (y[i] <= maxY) &
+                        (z[i] >= minZ) & (z[i] <= maxZ);
+        }
+
+        for(int i = 0; i < numPoints; ++i)
+            if(inside[i]) indices.push_back( m_indices[block + i] );
+    }
+}
+
+void HashGrid::scanCellSphere(const Cell& cell, const QVector3D& center, const float sqrDistance, std::vector<PointIndex>& indices) const
+{
+    const float cx = center.x(), cy = center.y(), cz = center.z();
+
+    // cells are not limited in size, hence they are tested in blocks
+    int inside[SCAN_BLOCK_SIZE];
+    for(PointIndex block = cell.begin; block < cell.end; block += SCAN_BLOCK_SIZE)
+    {
+        const int numPoints = (int) std::min<PointIndex>(SCAN_BLOCK_SIZE, cell.end - block);
+        const float* x = m_x.data() + block;
+        const float* y = m_y.data() + block;
+        const float* z = m_z.data() + block;
+
+        // branch-free test of the whole block, vectorized by the compiler
+        #pragma omp simd
+        for(int i = 0; i < numPoints; ++i)
+        {
+            const float dx = x[i] - cx;
+            const float dy = y[i] - cy;
+            const float dz = z[i] - cz;
+            inside[i] = dx*dx + dy*dy + dz*dz <= sqrDistance;
+        }
+
+        for(int i = 0; i < numPoints; ++i)
+            if(inside[i]) indices.push_back( m_indices[block + i] );
+    }
+}
+
+void HashGrid::nearestInCell(const Cell& cell, const QVector3D& point, float& nearestSqrDistance, PointIndex& nearest) const
+{
+    const float px = point.x(), py = point.y(), pz = point.z();
+    for(PointIndex i = cell.begin; i < cell.end; ++i)
+    {
+        const float dx = m_x[i] - px;
+        const float dy = m_y[i] - py;
+        const float dz = m_z[i] - pz;
+        const float sqrDistance = dx*dx + dy*dy + dz*dz;
+        if(sqrDistance < nearestSqrDistance)
+        {
+            nearestSqrDistance = sqrDistance;
+            nearest = i;
+        }
+    }
+}
@@ -0,0 +1,314 @@
+#ifndef HASHGRID_H
+#define HASHGRID_H
+
+#include <QVector3D>
+#include <QtGlobal>
+#include <vector>
+#include <algorithm>
+
+#include "vertex.h"
+#include "spatialindex.h"
+
+/*!
+ * \brief The HashGrid class
+ * \details uniform voxel grid over the bounding box of a point cloud, an alternative to KdTree for fixed radius
+ * queries. Only occupied cells are stored, in an open addressing hash table keyed by the packed cell coordinates.
+ * Like the KdTree, the grid keeps its own packed copy of all point coordinates, sorted by cell so the points of
+ * a cell are contiguous. With the cell size set to the query radius, a sphere query visits at most 27 cells and
+ * needs no tree traversal, building takes a single sort. Query results are offsets of points in the vertex array
+ * passed to HashGrid::build. All const member functions are thread-safe.
+ */
+class HashGrid : public SpatialIndex
+{
+public:
+    HashGrid() {} //!< constructor - nothing actually happens here, the grid must be built with HashGrid::build
+
+    /*!
+     * \brief build grid
+     * \details deletes the current grid, sorts all points into cells of HashGrid::cellSize and builds the cell table
+     * \param vertices point cloud
+     * \param parallel compute cell keys and sort on all OpenMP threads
+     */
+    void build(std::vector<Vertex>& vertices, bool parallel = false) override;
+
+    /*!
+     * \brief set cell size
+     * \details edge length of the cubic cells, takes effect with the next call of HashGrid::build.
+     * Sphere queries are fastest for a cell size close to their radius
+     * \param cellSize must be positive
+     */
+    void setCellSize(float cellSize) { if(cellSize > 0) m_requestedCellSize = cellSize; }
+
+    /*!
+     * \brief cell size
+     * \details the grid has at most MAX_CELLS_PER_AXIS cells along each axis, for large clouds the cell size of
+     * a built grid can hence exceed the requested one
+     * \return cell size of the built grid, the requested cell size if the grid has not been built yet
+     */
+    float cellSize() const { return m_cellSize > 0 ? m_cellSize : m_requestedCellSize; }
+
+    /*!
+     * \brief number of points
+     * \return number of points in the grid
+     */
+    PointIndex size() const { return m_indices.size(); }
+
+    /*!
+     * \brief number of occupied cells
+     */
+    PointIndex cellCount() const { return m_numCells; }
+
+    /*!
+     * \brief average cell occupancy
+     * \return mean number of points per occupied cell, 0 for an empty grid
+     */
+    float averageCellOccupancy() const { return m_numCells == 0 ? 0 : (float) size() / m_numCells; }
+
+    void pointsInBox(const QVector3D& min, const QVector3D& max, std::vector<PointIndex>& indices) const override;
+    void pointsInSphere(const QVector3D& center, const float distance, std::vector<PointIndex>& indices) const override;
+
+    /*!
+     * \brief nearestPoint
+     * \details exact nearest neighbor - searches shells of cells around the cell of point until no closer
+     * point can lie beyond the current shell
+     * \param point
+     * \return nearest neighbor of point, 0 if the grid is empty
+     */
+    Vertex* nearestPoint(const QVector3D& point) const override;
+
+    /*!
+     * \brief visit all points in a sphere
+     * \details calls visit for every point within the sphere as soon as it is found, like KdTree::visitPointsInSphere
+     * \param center center of the sphere
+     * \param distance radius of the sphere
+     * \param visit callable bool(PointIndex index, const QVector3D& position, float sqrDistance) - returning false
+     * stops the query
+     * \return false if visit stopped the query
+     */
+    template<typename Visitor>
+    bool visitPointsInSphere(const QVector3D& center, const float distance, Visitor visit) const;
+
+    /*!
+     * \brief visit all points in a box
+     * \details like KdTree::visitPointsInBox, the squared distance passed to visit is measured to the center of the cuboid
+     * \param min minimum xyz boundaries for search box
+     * \param max maximum xyz boundaries for search box
+     * \param visit callable bool(PointIndex index, const QVector3D& position, float sqrDistance)
+     * \return false if visit stopped the query
+     */
+    template<typename Visitor>
+    bool visitPointsInBox(const QVector3D& min, const QVector3D& max, Visitor visit) const;
+
+    static const int MAX_CELLS_PER_AXIS = 1 << 21; //!< cell coordinates are packed into 21 bits per axis
+
+protected:
+    void appendPointsInSphere(const QVector3D& center, const float distance, std::vector<PointIndex>& indices) const override;
+
+private:
+    /*!
+     * \brief The Cell struct
+     * \details slot of the cell hash table, an occupied cell refers to a range of the packed coordinate arrays
+     */
+    struct Cell
+    {
+        quint64 key = EMPTY_KEY; //!< packed cell coordinates, EMPTY_KEY for unused slots
+        PointIndex begin = 0; //!< offset of first point of this cell in the packed coordinate arrays
+        PointIndex end = 0; //!< offset behind last point of this cell in the packed coordinate arrays
+    };
+
+    /*!
+     * \brief pack cell coordinates
+     * \param x
+     * \param y
+     * \param z
+     * \return hash table key of the cell
+     */
+    static quint64 cellKey(int x, int y, int z) { return (quint64) x | ((quint64) y << 21) | ((quint64) z << 42); }
+
+    /*!
+     * \brief unpack cell coordinates
+     * \param key hash table key of a cell
+     * \param cell receives x, y and z coordinate of the cell
+     */
+    static void cellCoordinates(quint64 key, int* cell)
+    {
+        cell[0] = key & (MAX_CELLS_PER_AXIS - 1);
+        cell[1] = (key >> 21) & (MAX_CELLS_PER_AXIS - 1);
+        cell[2] = key >> 42;
+    }
+
+    /*!
+     * \brief cell coordinate of a position
+     * \param value position along axis
+     * \param axis
+     * \return coordinate of the cell holding value, clamped to the grid
+     */
+    int cellCoordinate(float value, int axis) const;
+
+    /*!
+     * \brief cell range of a box
+     * \details computes the cells overlapping a cuboid, clamped to the grid
+     * \param min
+     * \param max
+     * \param lower receives the smallest cell coordinates
+     * \param upper receives the largest cell coordinates
+     * \return false if the cuboid does not overlap the grid
+     */
+    bool cellRange(const QVector3D& min, const QVector3D& max, int* lower, int* upper) const;
+
+    /*!
+     * \brief find cell
+     * \param key packed cell coordinates
+     * \return the occupied cell, 0 if there are no points in this cell
+     */
+    const Cell* findCell(quint64 key) const;
+
+    /*!
+     * \brief visit cells
+     * \details calls visitCell with every occupied cell within [lower, upper] and its coordinates. If the range holds
+     * more cells than are occupied, the occupied cells are iterated instead of looking up every cell of the range
+     * \param lower smallest cell coordinates
+     * \param upper largest cell coordinates
+     * \param visitCell returns false to stop visiting cells
+     * \return false if visitCell stopped
+     */
+    template<typename CellVisitor>
+    bool forEachCell(const int* lower, const int* upper, CellVisitor& visitCell) const;
+
+    /*!
+     * \brief squared distance to a cell
+     * \param point
+     * \param cell cell coordinates
+     * \return squared distance from point to the cell, 0 if the cell contains point
+     */
+    float cellSqrDistance(const QVector3D& point, const int* cell) const;
+
+    /*!
+     * \brief box test for a cell
+     * \details tests all points of a cell against the cuboid using the packed coordinate arrays
+     * \param cell
+     * \param min
+     * \param max
+     * \param indices offsets of points inside the cuboid are appended here
+     */
+    void scanCellBox(const Cell& cell, const QVector3D& min, const QVector3D& max, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief sphere test for a cell
+     * \details tests all points of a cell against the sphere using the packed coordinate arrays
+     * \param cell
+     * \param center
+     * \param sqrDistance squared radius of the sphere
+     * \param indices offsets of points inside the sphere are appended here
+     */
+    void scanCellSphere(const Cell& cell, const QVector3D& center, const float sqrDistance, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief nearest point of a cell
+     * \param cell
+     * \param point
+     * \param nearestSqrDistance squared distance of the current nearest point, updated if a closer point is found
+     * \param nearest offset of the current nearest point in the packed coordinate arrays, updated as well
+     */
+    void nearestInCell(const Cell& cell, const QVector3D& point, float& nearestSqrDistance, PointIndex& nearest) const;
+
+    static const quint64 EMPTY_KEY = ~0ull; //!< key of unused hash table slots, no cell coordinates pack to it
+    static const int SCAN_BLOCK_SIZE = 64; //!< number of points tested at once when scanning a cell
+
+    std::vector<Cell> m_cells; //!< hash table of occupied cells, its size is a power of two
+    int m_hashShift = 64; //!< right shift that maps a hashed key to a slot of m_cells
+    PointIndex m_numCells = 0; //!< number of occupied cells
+
+    QVector3D m_origin; //!< minimum corner of the grid
+    float m_cellSize = 0; //!< cell size of the built grid
+    float m_requestedCellSize = 1; //!< cell size set with HashGrid::setCellSize
+    int m_gridSize[3] = {0, 0, 0}; //!< number of cells along each axis
+
+    std::vector<float> m_x; //!< packed x coordinates of all points sorted by cell
+    std::vector<float> m_y; //!< packed y coordinates of all points sorted by cell
+    std::vector<float> m_z; //!< packed z coordinates of all points sorted by cell
+    std::vector<PointIndex> m_indices; //!< offsets of all points from m_vertexArrayPointer sorted by cell
+
+    Vertex* m_vertexArrayPointer = 0; //!< pointer to point data
+};
+
+template<typename Visitor>
+bool HashGrid::visitPointsInSphere(const QVector3D& center, const float distance, Visitor visit) const
+{
+    const QVector3D extent(distance, distance, distance);
+    int lower[3], upper[3];
+    if( !cellRange(center - extent, center + extent, lower, upper) ) return true;
+
+    const float sqrDistance = distance * distance;
+    auto visitCell = [&](const Cell& cell, const int* coordinates)
+    {
+        if(cellSqrDistance(center, coordinates) > sqrDistance) return true;
+
+        for(PointIndex i = cell.begin; i < cell.end; ++i)
+        {
+            const QVector3D position(m_x[i], m_y[i], m_z[i]);
+            const float pointSqrDistance = (position - center).lengthSquared();
+            if(pointSqrDistance <= sqrDistance && !visit(m_indices[i], position, pointSqrDistance)) return false;
+        }
+        return true;
+    };
+    return forEachCell(lower, upper, visitCell);
+}
+
+template<typename Visitor>
+bool HashGrid::visitPointsInBox(const QVector3D& min, const QVector3D& max, Visitor visit) const
+{
+    int lower[3], upper[3];
+    if( !cellRange(min, max, lower, upper) ) return true;
+
+    const QVector3D center = (min + max) / 2;
+    auto visitCell = [&](const Cell& cell, const int*)
+    {
+        for(PointIndex i = cell.begin; i < cell.end; ++i)
+        {
+            const QVector3D position(m_x[i], m_y[i], m_z[i]);
+            if( inRange(position, min, max) && !visit(m_indices[i], position, (position - center).lengthSquared()) ) return false;
+        }
+        return true;
+    };
+    return forEachCell(lower, upper, visitCell);
+}
+
+template<typename CellVisitor>
+bool HashGrid::forEachCell(const int* lower, const int* upper, CellVisitor& visitCell) const
+{
+    const double rangeCells = (double) (upper[0] - lower[0] + 1) * (upper[1] - lower[1] + 1) * (upper[2] - lower[2] + 1);
+    if(rangeCells > m_numCells)
+    {
+        for(const Cell& cell : m_cells)
+        {
+            if(cell.key == EMPTY_KEY) continue;
+
+            int coordinates[3];
+            cellCoordinates(cell.key, coordinates);
+            if(coordinates[0] >= lower[0] && coordinates[0] <= upper[0] &&
+               coordinates[1] >= lower[1] && coordinates[1] <= upper[1] &&
+               coordinates[2] >= lower[2] && coordinates[2] <= upper[2])
+            {
+                if( !visitCell(cell, coordinates) ) return false;
+            }
+        }
+        return true;
+    }
+
+    int coordinates[3];
+    for(coordinates[2] = lower[2]; coordinates[2] <= upper[2]; ++coordinates[2])
+    {
+        for(coordinates[1] = lower[1]; coordinates[1] <= upper[1]; ++coordinates[1])
+        {
+            for(coordinates[0] = lower[0]; coordinates[0] <= upper[0]; ++coordinates[0])
+            {
+                const Cell* cell = findCell( cellKey(coordinates[0], coordinates[1], coordinates[2]) );
+                if(cell && !visitCell(*cell, coordinates)) return false;
+            }
+        }
+    }
+    return true;
+}
+
+#endif // HASHGRID_H
@@ -1,213 +1,1519 @@
 #include "kdtree.h"
+#include "kdtreebuild.h"
 #include <QDebug>
+#include <QFile>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <omp.h>
 
-void KdTree::build(QVector<Vertex>& vertices)
+const uint KdTree::MAX_LEAF_SIZE;
+const uint KdTree::TASK_CUTOFF;
+const int KdTree::NODE_AXIS;
+const char KdTree::FILE_MAGIC[8] = {'I', '3', 'D', 'K', 'D', 'T', 'R', 'E'};
+const quint32 KdTree::FILE_VERSION;
+const qint64 KdTree::FILE_ALIGNMENT;
+
+void KdTree::build(std::vector<Vertex>& vertices, bool parallel)
+{
+    m_vertexArrayPointer = vertices.data();
+    const PointIndex numPoints = vertices.size();
+
+    m_nodes.clear();
+    m_roots.clear();
+    m_rootBounds.clear();
+    m_x.clear();
+    m_y.clear();
+    m_z.clear();
+    m_indices.clear();
+    m_mappedFile.reset();
+    m_removed.assign(numPoints, false);
+    m_numRemoved = 0;
+    m_splitPolicy = m_requestedSplitPolicy;
+
+    m_buildPoints.resize(numPoints);
+    #pragma omp parallel for if(parallel)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        m_buildPoints[i].position = vertices[i].position;
+        m_buildPoints[i].index = i;
+    }
+
+    buildSubtree(parallel);
+}
+
+void KdTree::insert(std::vector<Vertex>& vertices, PointIndex first, PointIndex last)
 {
-    delete m_tree;
-    m_tree = buildKdTree(vertices.begin(), vertices.end(), 0);
     m_vertexArrayPointer = vertices.data();
+    if(last < 0) last = vertices.size();
+    if(first >= last) return;
+
+    detach();
+    if((PointIndex) m_removed.size() < last) m_removed.resize(last, false);
+
+    m_buildPoints.clear();
+    for(PointIndex i = first; i < last; ++i)
+        m_buildPoints.push_back( {vertices[i].position, i} );
+
+    // merge all trailing subtrees that are not larger than the points collected so far,
+    // which keeps the subtree sizes decreasing roughly geometrically
+    PointIndex numPoints = m_buildPoints.size();
+    uint firstMerged = m_roots.size();
+    while(firstMerged > 0)
+    {
+        const KdTreeNode& root = m_nodes[ m_roots[firstMerged - 1] ];
+        if(root.end - root.begin > numPoints) break;
+
+        numPoints += root.end - root.begin;
+        --firstMerged;
+    }
+    collectSubtrees(firstMerged);
+
+    buildSubtree(m_buildPoints.size() > TASK_CUTOFF);
+}
+
+void KdTree::remove(PointIndex index, bool rebalance)
+{
+    if(index < 0 || index >= (PointIndex) m_removed.size() || m_removed[index]) return;
+
+    countRemoved(index);
+    m_removed[index] = true;
+    ++m_numRemoved;
+
+    // rebuild once the removed points dominate, they still cost time in every query
+    if(rebalance && 2 * m_numRemoved > (PointIndex) m_indices.size())
+    {
+        collectSubtrees(0);
+        buildSubtree(m_buildPoints.size() > TASK_CUTOFF);
+    }
+}
+
+void KdTree::countRemoved(PointIndex index)
+{
+    // removing only reads the tree, which must not detach a mapped tree, least of all from several threads
+    const MappableArray<KdTreeNode>& nodes = m_nodes;
+    const MappableArray<PointIndex>& indices = m_indices;
+
+    if(m_numRemoved == 0)
+    {
+        m_removedInNode.assign(nodes.size(), 0);
+        m_treeOffsets.assign(m_removed.size(), -1);
+        #pragma omp parallel for
+        for(PointIndex i = 0; i < (PointIndex) indices.size(); ++i) m_treeOffsets[ indices[i] ] = i;
+    }
+
+    const PointIndex offset = m_treeOffsets[index];
+    if(offset < 0) return;
+
+    // the subtree holding the point is the last one starting in front of it, its nodes split the range in the middle
+    auto root = std::upper_bound(m_roots.begin(), m_roots.end(), offset,
+                                 [&nodes](PointIndex value, PointIndex root) { return value < nodes[root].begin; });
+    PointIndex nodeIndex = *(root - 1);
+    while(true)
+    {
+        ++m_removedInNode[nodeIndex];
+        const KdTreeNode& node = nodes[nodeIndex];
+        if(node.rightChild == 0) break;
+        nodeIndex = offset < nodes[nodeIndex + 1].end ? nodeIndex + 1 : node.rightChild;
+    }
+}
+
+void KdTree::updateRemovedCounts(PointIndex firstPoint)
+{
+    if(m_numRemoved == 0)
+    {
+        std::vector<PointIndex>().swap(m_removedInNode);
+        std::vector<PointIndex>().swap(m_treeOffsets);
+        return;
+    }
+
+    // points of the new subtree have been removed from their old places before, so none of them is removed
+    const MappableArray<PointIndex>& indices = m_indices;
+    m_removedInNode.resize(m_nodes.size(), 0);
+    m_treeOffsets.resize(m_removed.size(), -1);
+    for(PointIndex i = firstPoint; i < (PointIndex) indices.size(); ++i) m_treeOffsets[ indices[i] ] = i;
+}
+
+void KdTree::compact(std::vector<Vertex>& vertices)
+{
+    detach();
+    m_vertexArrayPointer = vertices.data();
+
+    // new offset of every vertex is its rank among the vertices that have not been removed
+    std::vector<PointIndex> newIndices(m_removed.size());
+    PointIndex numVertices = 0;
+    for(size_t i = 0; i < m_removed.size(); ++i)
+    {
+        newIndices[i] = numVertices;
+        if(!m_removed[i]) ++numVertices;
+    }
+
+    // node ranges are mapped through the number of remaining points in front of them
+    std::vector<PointIndex> pointsBefore(m_indices.size() + 1);
+    PointIndex numPoints = 0;
+    for(size_t i = 0; i < m_indices.size(); ++i)
+    {
+        pointsBefore[i] = numPoints;
+        if(m_removed[ m_indices[i] ]) continue;
+
+        m_x[numPoints] = m_x[i];
+        m_y[numPoints] = m_y[i];
+        m_z[numPoints] = m_z[i];
+        m_indices[numPoints] = newIndices[ m_indices[i] ];
+        ++numPoints;
+    }
+    pointsBefore[m_indices.size()] = numPoints;
+
+    for(KdTreeNode& node : m_nodes)
+    {
+        node.begin = pointsBefore[node.begin];
+        node.end = pointsBefore[node.end];
+    }
+
+    m_x.resize(numPoints);
+    m_y.resize(numPoints);
+    m_z.resize(numPoints);
+    m_indices.resize(numPoints);
+
+    m_removed.assign(vertices.size(), false);
+    m_numRemoved = 0;
+    updateRemovedCounts(numPoints);
+}
+
+/*!
+ * \brief aligned file offset
+ * \return smallest multiple of alignment that is not less than offset
+ */
+static qint64 alignedOffset(qint64 offset, qint64 alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+/*!
+ * \brief write a file section
+ * \return true if all bytes have been written at offset
+ */
+static bool writeSection(QFile& file, qint64 offset, const void* data, qint64 size)
+{
+    return file.seek(offset) && file.write( (const char*) data, size ) == size;
+}
+
+bool KdTree::save(const QString& fileName, const std::vector<Vertex>& vertices, const std::vector<PointIndex>& vertexOrder,
+                  VertexOrdering vertexOrdering) const
+{
+    if(m_numRemoved > 0)
+    {
+        qWarning() << "KdTree::save(): removed points have to be dropped with KdTree::compact first";
+        return false;
+    }
+    if( !vertexOrder.empty() && vertexOrder.size() != vertices.size() )
+    {
+        qWarning() << "KdTree::save(): vertex order does not match the vertices";
+        return false;
+    }
+
+    FileHeader header;
+    std::memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+    header.version = FILE_VERSION;
+    header.leafSize = m_leafSize;
+    header.nodeSize = sizeof(KdTreeNode);
+    header.vertexSize = sizeof(Vertex);
+    header.splitPolicy = m_splitPolicy;
+    header.vertexOrdering = vertexOrdering;
+
+    header.numNodes = m_nodes.size();
+    header.numRoots = m_roots.size();
+    header.numPoints = m_indices.size();
+    header.numVertices = vertices.size();
+    header.numVertexOrder = vertexOrder.size();
+
+    // arrays follow the header one after another, aligned so that they can be used in place once mapped
+    qint64 fileSize = sizeof(FileHeader);
+    auto appendSection = [&](qint64 size)
+    {
+        const qint64 offset = alignedOffset(fileSize, FILE_ALIGNMENT);
+        fileSize = offset + size;
+        return offset;
+    };
+    header.nodeOffset = appendSection( header.numNodes * sizeof(KdTreeNode) );
+    header.rootOffset = appendSection( header.numRoots * sizeof(PointIndex) );
+    header.rootBoundsOffset = appendSection( header.numRoots * sizeof(CellBounds) );
+    header.xOffset = appendSection( header.numPoints * sizeof(float) );
+    header.yOffset = appendSection( header.numPoints * sizeof(float) );
+    header.zOffset = appendSection( header.numPoints * sizeof(float) );
+    header.indexOffset = appendSection( header.numPoints * sizeof(PointIndex) );
+    header.vertexOffset = appendSection( header.numVertices * sizeof(Vertex) );
+    header.vertexOrderOffset = appendSection( header.numVertexOrder * sizeof(PointIndex) );
+
+    QFile file(fileName);
+    if( !file.open(QIODevice::WriteOnly) )
+    {
+        qWarning() << "KdTree::save(): could not open file " << fileName;
+        return false;
+    }
+
+    // the header is written last, so an incomplete file is never taken for a valid one
+    bool success = file.resize(fileSize) &&
+                   writeSection(file, header.nodeOffset, m_nodes.data(), header.numNodes * sizeof(KdTreeNode)) &&
+                   writeSection(file, header.rootOffset, m_roots.data(), header.numRoots * sizeof(PointIndex)) &&
+                   writeSection(file, header.rootBoundsOffset, m_rootBounds.data(), header.numRoots * sizeof(CellBounds)) &&
+                   writeSection(file, header.xOffset, m_x.data(), header.numPoints * sizeof(float)) &&
+                   writeSection(file, header.yOffset, m_y.data(), header.numPoints * sizeof(float)) &&
+                   writeSection(file, header.zOffset, m_z.data(), header.numPoints * sizeof(float)) &&
+                   writeSection(file, header.indexOffset, m_indices.data(), header.numPoints * sizeof(PointIndex)) &&
+                   writeSection(file, header.vertexOffset, vertices.data(), header.numVertices * sizeof(Vertex)) &&
+                   writeSection(file, header.vertexOrderOffset, vertexOrder.data(), header.numVertexOrder * sizeof(PointIndex)) &&
+                   writeSection(file, 0, &header, sizeof(FileHeader));
+
+    if( !success ) qWarning() << "KdTree::save(): could not write file " << fileName;
+    return success;
+}
+
+bool KdTree::load(const QString& fileName, std::vector<Vertex>& vertices, std::vector<PointIndex>* vertexOrder,
+                  VertexOrdering vertexOrdering)
+{
+    std::shared_ptr<QFile> file = std::make_shared<QFile>(fileName);
+    if( !file->open(QIODevice::ReadOnly) ) return false;
+
+    const qint64 fileSize = file->size();
+    if(fileSize < (qint64) sizeof(FileHeader)) return false;
+
+    // the whole file is mapped, pages are only read when queries touch them
+    const uchar* memory = file->map(0, fileSize);
+    if( !memory )
+    {
+        qWarning() << "KdTree::load(): could not map file " << fileName;
+        return false;
+    }
+
+    FileHeader header;
+    std::memcpy(&header, memory, sizeof(FileHeader));
+
+    auto isValidSection = [&](qint64 offset, qint64 count, qint64 size)
+    {
+        return count >= 0 && offset >= (qint64) sizeof(FileHeader) && offset % FILE_ALIGNMENT == 0 &&
+               offset + count * size <= fileSize;
+    };
+    const bool isValid = std::memcmp(header.magic, FILE_MAGIC, sizeof(header.magic)) == 0 &&
+                         header.version == FILE_VERSION &&
+                         header.nodeSize == sizeof(KdTreeNode) &&
+                         header.vertexSize == sizeof(Vertex) &&
+                         header.leafSize >= 1 && header.leafSize <= MAX_LEAF_SIZE &&
+                         header.splitPolicy <= LargestExtentSplit &&
+                         header.vertexOrdering <= MortonCurveOrder &&
+                         isValidSection(header.nodeOffset, header.numNodes, sizeof(KdTreeNode)) &&
+                         isValidSection(header.rootOffset, header.numRoots, sizeof(PointIndex)) &&
+                         isValidSection(header.rootBoundsOffset, header.numRoots, sizeof(CellBounds)) &&
+                         isValidSection(header.xOffset, header.numPoints, sizeof(float)) &&
+                         isValidSection(header.yOffset, header.numPoints, sizeof(float)) &&
+                         isValidSection(header.zOffset, header.numPoints, sizeof(float)) &&
+                         isValidSection(header.indexOffset, header.numPoints, sizeof(PointIndex)) &&
+                         isValidSection(header.vertexOffset, header.numVertices, sizeof(Vertex)) &&
+                         (header.numVertexOrder == 0 || header.numVertexOrder == header.numVertices) &&
+                         isValidSection(header.vertexOrderOffset, header.numVertexOrder, sizeof(PointIndex)) &&
+                         isValidTree(header, memory);
+    if( !isValid )
+    {
+        qWarning() << "KdTree::load(): " << fileName << " is not a valid KdTree file";
+        return false;
+    }
+    if(header.vertexOrdering != (quint32) vertexOrdering)
+    {
+        qDebug() << "KdTree::load(): vertices of " << fileName << " are ordered differently, the file is not used";
+        return false;
+    }
+
+    m_nodes.map( (const KdTreeNode*) (memory + header.nodeOffset), header.numNodes );
+    m_x.map( (const float*) (memory + header.xOffset), header.numPoints );
+    m_y.map( (const float*) (memory + header.yOffset), header.numPoints );
+    m_z.map( (const float*) (memory + header.zOffset), header.numPoints );
+    m_indices.map( (const PointIndex*) (memory + header.indexOffset), header.numPoints );
+
+    const PointIndex* roots = (const PointIndex*) (memory + header.rootOffset);
+    m_roots.assign(roots, roots + header.numRoots);
+    const CellBounds* rootBounds = (const CellBounds*) (memory + header.rootBoundsOffset);
+    m_rootBounds.assign(rootBounds, rootBounds + header.numRoots);
+
+    // vertices are modified by filters, hence they are copied
+    const Vertex* fileVertices = (const Vertex*) (memory + header.vertexOffset);
+    vertices.assign(fileVertices, fileVertices + header.numVertices);
+    if(vertexOrder)
+    {
+        const PointIndex* fileVertexOrder = (const PointIndex*) (memory + header.vertexOrderOffset);
+        vertexOrder->assign(fileVertexOrder, fileVertexOrder + header.numVertexOrder);
+    }
+
+    m_removed.assign(header.numVertices, false);
+    m_numRemoved = 0;
+    updateRemovedCounts(header.numPoints);
+    m_leafSize = header.leafSize;
+    m_splitPolicy = (SplitPolicy) header.splitPolicy;
+    m_vertexArrayPointer = vertices.data();
+    m_mappedFile = file;
+    return true;
+}
+
+bool KdTree::isValidTree(const FileHeader& header, const uchar* memory)
+{
+    const PointIndex numNodes = header.numNodes;
+    const PointIndex numPoints = header.numPoints;
+    const PointIndex numVertices = header.numVertices;
+
+    const PointIndex* roots = (const PointIndex*) (memory + header.rootOffset);
+    for(PointIndex i = 0; i < header.numRoots; ++i)
+    {
+        if(roots[i] < 0 || roots[i] >= numNodes) return false;
+    }
+
+    const KdTreeNode* nodes = (const KdTreeNode*) (memory + header.nodeOffset);
+    bool isValid = true;
+    #pragma omp parallel for reduction(&&:isValid)
+    for(PointIndex i = 0; i < numNodes; ++i)
+    {
+        const KdTreeNode& node = nodes[i];
+        isValid = isValid && node.begin >= 0 && node.begin <= node.end && node.end <= numPoints;
+
+        // the left child directly follows an inner node, the right child follows the left subtree
+        if(node.rightChild != 0) isValid = isValid && node.rightChild > i + 1 && node.rightChild < numNodes &&
+                                           node.axis >= 0 && node.axis < 3;
+    }
+
+    const PointIndex* indices = (const PointIndex*) (memory + header.indexOffset);
+    #pragma omp parallel for reduction(&&:isValid)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        isValid = isValid && indices[i] >= 0 && indices[i] < numVertices;
+    }
+    return isValid;
 }
 
-void KdTree::pointsInBox(const QVector3D& min, const QVector3D& max, QVector<int>& indices)
+void KdTree::detach()
 {
-    if(!m_tree || !m_vertexArrayPointer) return;
+    if( !m_mappedFile ) return;
+
+    m_nodes.detach();
+    m_x.detach();
+    m_y.detach();
+    m_z.detach();
+    m_indices.detach();
+    m_mappedFile.reset();
+}
+
+void KdTree::collectSubtrees(uint first)
+{
+    if(first >= m_roots.size()) return;
+    detach();
+
+    const PointIndex firstPoint = m_nodes[ m_roots[first] ].begin;
+    for(PointIndex i = firstPoint; i < (PointIndex) m_indices.size(); ++i)
+    {
+        // removed points are dropped here, their flags stay set until KdTree::compact
+        if(m_removed[ m_indices[i] ]) --m_numRemoved;
+        else m_buildPoints.push_back( {QVector3D(m_x[i], m_y[i], m_z[i]), m_indices[i]} );
+    }
+
+    m_x.resize(firstPoint);
+    m_y.resize(firstPoint);
+    m_z.resize(firstPoint);
+    m_indices.resize(firstPoint);
+    m_nodes.resize(m_roots[first]);
+    if(m_numRemoved > 0) m_removedInNode.resize(m_roots[first]);
+    m_roots.resize(first);
+    m_rootBounds.resize(first);
+}
+
+void KdTree::buildSubtree(bool parallel)
+{
+    const PointIndex numPoints = m_buildPoints.size();
+    if(numPoints == 0) return;
+
+    // the bounding box of the subtree is the cell of its root
+    float minX = std::numeric_limits<float>::max(), minY = minX, minZ = minX;
+    float maxX = -minX, maxY = -minX, maxZ = -minX;
+    #pragma omp parallel for if(parallel) reduction(min:minX, minY, minZ) reduction(max:maxX, maxY, maxZ)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        const QVector3D& p = m_buildPoints[i].position;
+        minX = std::min(minX, p.x()); maxX = std::max(maxX, p.x());
+        minY = std::min(minY, p.y()); maxY = std::max(maxY, p.y());
+        minZ = std::min(minZ, p.z()); maxZ = std::max(maxZ, p.z());
+    }
+    m_rootBounds.push_back( {{minX, minY, minZ}, {maxX, maxY, maxZ}} );
+
+    const PointIndex rootIndex = m_nodes.size();
+    const PointIndex firstPoint = m_indices.size();
+    if(m_splitPolicy == MedianSplit)
+    {
+        // the node count is known in advance, so the subtree is appended with a single allocation
+        m_nodes.resize( rootIndex + kdNodeCount(numPoints, m_leafSize) );
+
+        auto split = [this](auto axis, const KdSubtree& s, bool parallelPartition, PointIndex& rightChild)
+        {
+            const PointIndex centerPos = splitNode<decltype(axis)::value>(s.begin, s.end, s.nodeIndex, parallelPartition);
+            rightChild = m_nodes[s.nodeIndex].rightChild;
+            return centerPos;
+        };
+        const KdSubtree root{0, numPoints, rootIndex};
+        if( parallel ) buildKdSubtreesParallel<0, 3>( {root}, split, TASK_CUTOFF );
+        else buildKdSubtree<0, 3>(root, split, TASK_CUTOFF, false);
+    }
+    else
+    {
+        std::vector<KdTreeNode> nodes;
+        #pragma omp parallel if(parallel)
+        #pragma omp single
+        buildUnbalanced(0, numPoints, m_rootBounds.back(), nodes, parallel);
+
+        m_nodes.resize(rootIndex + nodes.size());
+        for(size_t i = 0; i < nodes.size(); ++i)
+        {
+            m_nodes[rootIndex + i] = nodes[i];
+            if(nodes[i].rightChild != 0) m_nodes[rootIndex + i].rightChild += rootIndex;
+        }
+    }
+
+    // point ranges were built relative to m_buildPoints
+    for(PointIndex i = rootIndex; i < (PointIndex) m_nodes.size(); ++i)
+    {
+        m_nodes[i].begin += firstPoint;
+        m_nodes[i].end += firstPoint;
+    }
+
+    // split the reordered points into packed coordinate arrays for the leaf scans
+    m_x.resize(firstPoint + numPoints);
+    m_y.resize(firstPoint + numPoints);
+    m_z.resize(firstPoint + numPoints);
+    m_indices.resize(firstPoint + numPoints);
+    #pragma omp parallel for if(parallel)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        m_x[firstPoint + i] = m_buildPoints[i].position.x();
+        m_y[firstPoint + i] = m_buildPoints[i].position.y();
+        m_z[firstPoint + i] = m_buildPoints[i].position.z();
+        m_indices[firstPoint + i] = m_buildPoints[i].index;
+    }
+    std::vector<BuildPoint>().swap(m_buildPoints);
+
+    m_roots.push_back(rootIndex);
+    updateRemovedCounts(firstPoint);
+}
+
+void KdTree::pointsInBox(const QVector3D& min, const QVector3D& max, std::vector<PointIndex>& indices) const
+{
+    if(m_roots.empty()) return;
 
     indices.clear();
-    rangeQuery(min, max, indices, m_tree, 0);
-    // index of pointers in array is pointeradress - pointeradress of first pointer since memory is linear
-    for(int& index : indices) index = (int) ((Vertex*) index - m_vertexArrayPointer);
+    recordQuery();
+    auto scanLeaf = [&](const KdTreeNode& leaf) { scanLeafBox(leaf, min, max, indices); return true; };
+    for(PointIndex root : m_roots)
+        withRootAxis([&](auto axis) { return rangeQuery<decltype(axis)::value>(min, max, root, scanLeaf); });
 }
 
-void KdTree::pointsInSphere(const QVector3D& center, const float distance, QVector<int>& indices)
+void KdTree::pointsInSphere(const QVector3D& center, const float distance, std::vector<PointIndex>& indices) const
 {
-    if(!m_tree || !m_vertexArrayPointer) return;
+    if(m_roots.empty()) return;
 
     indices.clear();
-    QVector3D min = center - QVector3D(distance, distance, distance);
-    QVector3D max = center + QVector3D(distance, distance, distance);
-    rangeQuery(min, max, indices, m_tree, 0);
-    for(int& index : indices)
-        index = (int) ((Vertex*) index - m_vertexArrayPointer);
-
-    int i=0;
-    while(i < indices.length())
-    {
-        int index = indices[i];
-        if( center.distanceToPoint(m_vertexArrayPointer[index]) > distance )
-            indices.removeAt(i);
+    appendPointsInSphere(center, distance, indices);
+}
+
+void KdTree::appendPointsInSphere(const QVector3D& center, const float distance, std::vector<PointIndex>& indices) const
+{
+    recordQuery();
+    const float sqrDistance = distance * distance;
+    auto scanLeaf = [&](const KdTreeNode& leaf) { scanLeafSphere(leaf, center, sqrDistance, indices); return true; };
+
+    // the root cells are unbounded, hence their distance to the sphere center is zero along all axes
+    for(PointIndex root : m_roots)
+    {
+        float cellOffsets[3] = {0, 0, 0};
+        withRootAxis([&](auto axis)
+        {
+            return sphereQuery<decltype(axis)::value>(center, sqrDistance, root, 0, cellOffsets, scanLeaf);
+        });
+    }
+}
+
+PointIndex KdTree::countInSphere(const QVector3D& center, const float distance) const
+{
+    recordQuery();
+    const float sqrDistance = distance * distance;
+    auto isDisjoint = [&](const float* lower, const float* upper)
+    {
+        float sqrDistanceToCell = 0;
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            const float offset = std::max( 0.0f, std::max(lower[axis] - center[axis], center[axis] - upper[axis]) );
+            sqrDistanceToCell += offset * offset;
+        }
+        return sqrDistanceToCell > sqrDistance;
+    };
+    auto isContained = [&](const float* lower, const float* upper)
+    {
+        // the farthest corner of the cell decides
+        float sqrDistanceToCorner = 0;
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            const float offset = std::max( std::abs(center[axis] - lower[axis]), std::abs(upper[axis] - center[axis]) );
+            sqrDistanceToCorner += offset * offset;
+        }
+        return sqrDistanceToCorner <= sqrDistance;
+    };
+    auto countLeaf = [&](const KdTreeNode& leaf) { return countLeafSphere(leaf, center, sqrDistance); };
+
+    PointIndex count = 0;
+    for(size_t r = 0; r < m_roots.size(); ++r)
+    {
+        CellBounds cell = m_rootBounds[r];
+        count += withRootAxis([&](auto axis)
+        {
+            return countQuery<decltype(axis)::value>(m_roots[r], cell, isDisjoint, isContained, countLeaf);
+        });
+    }
+    return count;
+}
+
+PointIndex KdTree::countInBox(const QVector3D& min, const QVector3D& max) const
+{
+    recordQuery();
+    auto isDisjoint = [&](const float* lower, const float* upper)
+    {
+        for(int axis = 0; axis < 3; ++axis)
+            if(upper[axis] < min[axis] || lower[axis] > max[axis]) return true;
+        return false;
+    };
+    auto isContained = [&](const float* lower, const float* upper)
+    {
+        for(int axis = 0; axis < 3; ++axis)
+            if(lower[axis] < min[axis] || upper[axis] > max[axis]) return false;
+        return true;
+    };
+    auto countLeaf = [&](const KdTreeNode& leaf) { return countLeafBox(leaf, min, max); };
+
+    PointIndex count = 0;
+    for(size_t r = 0; r < m_roots.size(); ++r)
+    {
+        CellBounds cell = m_rootBounds[r];
+        count += withRootAxis([&](auto axis)
+        {
+            return countQuery<decltype(axis)::value>(m_roots[r], cell, isDisjoint, isContained, countLeaf);
+        });
+    }
+    return count;
+}
+
+template<int Axis, typename DisjointTest, typename ContainedTest, typename LeafCount>
+PointIndex KdTree::countQuery(PointIndex nodeIndex, CellBounds& cell,
+                              DisjointTest& isDisjoint, ContainedTest& isContained, LeafCount& countLeaf) const
+{
+    recordNode();
+    if( isDisjoint(cell.lower, cell.upper) ) return 0;
+
+    const KdTreeNode& node = m_nodes[nodeIndex];
+    if( isContained(cell.lower, cell.upper) ) return subtreeCount(nodeIndex);
+    if(node.rightChild == 0)
+    {
+        recordLeaf(node);
+        return countLeaf(node);
+    }
+
+    // the children split the cell of node at the median
+    PointIndex count = 0;
+    const int axis = splitAxis<Axis>(node);
+
+    const float upper = cell.upper[axis];
+    cell.upper[axis] = node.median;
+    count += countQuery<nextAxis(Axis)>(nodeIndex + 1, cell, isDisjoint, isContained, countLeaf);
+    cell.upper[axis] = upper;
+
+    const float lower = cell.lower[axis];
+    cell.lower[axis] = node.median;
+    count += countQuery<nextAxis(Axis)>(node.rightChild, cell, isDisjoint, isContained, countLeaf);
+    cell.lower[axis] = lower;
+
+    return count;
+}
+
+template<int Axis, typename NodeVisitor>
+void KdTree::cellQuery(PointIndex nodeIndex, CellBounds& cell, const QVector3D& nearPoint, NodeVisitor& visitNode) const
+{
+    const KdTreeNode& node = m_nodes[nodeIndex];
+    recordNode();
+    if( !visitNode(node, cell) || node.rightChild == 0 ) return;
+
+    // the children split the cell of node at the median
+    const int axis = splitAxis<Axis>(node);
+    const bool upperFirst = nearPoint[axis] > node.median;
+    for(int i = 0; i < 2; ++i)
+    {
+        if((i == 0) == upperFirst)
+        {
+            const float lower = cell.lower[axis];
+            cell.lower[axis] = node.median;
+            cellQuery<nextAxis(Axis)>(node.rightChild, cell, nearPoint, visitNode);
+            cell.lower[axis] = lower;
+        }
         else
-            ++i;
+        {
+            const float upper = cell.upper[axis];
+            cell.upper[axis] = node.median;
+            cellQuery<nextAxis(Axis)>(nodeIndex + 1, cell, nearPoint, visitNode);
+            cell.upper[axis] = upper;
+        }
+    }
+}
+
+PointIndex KdTree::firstPointOnRay(const QVector3D& origin, const QVector3D& direction, const float radius, float* rayDistance) const
+{
+    const float length = direction.length();
+    if(m_roots.empty() || length == 0) return -1;
+    recordQuery();
+
+    const QVector3D unitDirection = direction / length;
+    const float sqrRadius = radius * radius;
+
+    PointIndex hit = -1;
+    float hitDistance = std::numeric_limits<float>::infinity();
+    auto visitNode = [&](const KdTreeNode& node, const CellBounds& cell)
+    {
+        // children are visited front to back, so a cell entered behind the current hit can not hold a closer one
+        if(rayEntryDistance(cell, origin, unitDirection, radius) >= hitDistance) return false;
+        if(node.rightChild != 0) return true;
+
+        float rayDistances[MAX_LEAF_SIZE];
+        leafRayDistances(node, origin, unitDirection, sqrRadius, rayDistances);
+        for(PointIndex i = 0; i < node.end - node.begin; ++i)
+        {
+            if(rayDistances[i] < hitDistance)
+            {
+                hitDistance = rayDistances[i];
+                hit = node.begin + i;
+            }
+        }
+        return false;
+    };
+
+    for(size_t r = 0; r < m_roots.size(); ++r)
+    {
+        CellBounds cell = m_rootBounds[r];
+        withRootAxis([&](auto axis) { cellQuery<decltype(axis)::value>(m_roots[r], cell, origin, visitNode); });
+    }
+
+    if(hit < 0) return -1;
+    if(rayDistance) *rayDistance = hitDistance;
+    return m_indices[hit];
+}
+
+void KdTree::pointsOnRay(const QVector3D& origin, const QVector3D& direction, const float radius, std::vector<PointIndex>& indices) const
+{
+    indices.clear();
+    const float length = direction.length();
+    if(m_roots.empty() || length == 0) return;
+    recordQuery();
+
+    const QVector3D unitDirection = direction / length;
+    const float sqrRadius = radius * radius;
+
+    std::vector<std::pair<float, PointIndex>> hits;
+    auto visitNode = [&](const KdTreeNode& node, const CellBounds& cell)
+    {
+        if(rayEntryDistance(cell, origin, unitDirection, radius) == std::numeric_limits<float>::infinity()) return false;
+        if(node.rightChild != 0) return true;
+
+        float rayDistances[MAX_LEAF_SIZE];
+        leafRayDistances(node, origin, unitDirection, sqrRadius, rayDistances);
+        for(PointIndex i = 0; i < node.end - node.begin; ++i)
+        {
+            if(rayDistances[i] != std::numeric_limits<float>::infinity())
+                hits.push_back( {rayDistances[i], m_indices[node.begin + i]} );
+        }
+        return false;
+    };
+
+    for(size_t r = 0; r < m_roots.size(); ++r)
+    {
+        CellBounds cell = m_rootBounds[r];
+        withRootAxis([&](auto axis) { cellQuery<decltype(axis)::value>(m_roots[r], cell, origin, visitNode); });
     }
+
+    std::sort(hits.begin(), hits.end());
+    indices.reserve(hits.size());
+    for(const auto& hit : hits) indices.push_back(hit.second);
 }
 
-KdTree::KdTreeNode* KdTree::buildKdTree(Vertex* begin, Vertex* end, const uint depth)
+void KdTree::pointsInPolytope(const std::vector<QVector4D>& planes, std::vector<PointIndex>& indices) const
 {
-    unsigned int currentDimension = depth % 3;
-    unsigned int numPoints = (end - begin);
+    indices.clear();
+    recordQuery();
 
-    float median = 0;
-    unsigned int centerPos = numPoints/2;
+    auto visitNode = [&](const KdTreeNode& node, const CellBounds& cell)
+    {
+        bool isContained = true;
+        for(const QVector4D& plane : planes)
+        {
+            // the cell corners farthest along and against the plane normal decide
+            float front = plane.w(), back = plane.w();
+            for(int axis = 0; axis < 3; ++axis)
+            {
+                const float normal = plane[axis];
+                front += normal * (normal >= 0 ? cell.upper[axis] : cell.lower[axis]);
+                back += normal * (normal >= 0 ? cell.lower[axis] : cell.upper[axis]);
+            }
+            if(front < 0) return false;
+            if(back < 0) isContained = false;
+        }
 
-    if(currentDimension == 0)
+        if(isContained) appendSubtree(node, indices);
+        else if(node.rightChild == 0) scanLeafPolytope(node, planes, indices);
+        else return true;
+        return false;
+    };
+
+    for(size_t r = 0; r < m_roots.size(); ++r)
     {
-        std::nth_element( begin, begin + centerPos, end, sortByX );
-        median = (begin + centerPos)->position.x();
+        CellBounds cell = m_rootBounds[r];
+        withRootAxis([&](auto axis) { cellQuery<decltype(axis)::value>(m_roots[r], cell, QVector3D(), visitNode); });
     }
-    else if(currentDimension == 1)
+}
+
+void KdTree::pointsInFrustum(const QMatrix4x4& viewProjection, std::vector<PointIndex>& indices) const
+{
+    // a point is inside if its clip coordinates satisfy -w <= x, y, z <= w, each inequality is a plane in world space
+    const QVector4D rowW = viewProjection.row(3);
+    std::vector<QVector4D> planes;
+    for(int i = 0; i < 3; ++i)
     {
-        std::nth_element( begin, begin + centerPos, end, sortByY );
-        median = (begin + centerPos)->position.y();
+        planes.push_back( rowW + viewProjection.row(i) );
+        planes.push_back( rowW - viewProjection.row(i) );
     }
-    else
+    pointsInPolytope(planes, indices);
+}
+
+void KdTree::appendSubtree(const KdTreeNode& node, std::vector<PointIndex>& indices) const
+{
+    for(PointIndex i = node.begin; i < node.end; ++i)
     {
-        std::nth_element( begin, begin + centerPos, end, sortByZ );
-        median = (begin + centerPos)->position.z();
+        if(m_numRemoved > 0 && m_removed[ m_indices[i] ]) continue;
+        indices.push_back( m_indices[i] );
     }
+}
 
-    KdTreeNode* childNode = new KdTreeNode; //create new node
-    childNode->median = median;
-    childNode->begin = begin;
-    childNode->end = end;
+float KdTree::rayEntryDistance(const CellBounds& cell, const QVector3D& origin, const QVector3D& direction, const float radius)
+{
+    const float infinity = std::numeric_limits<float>::infinity();
 
-    if(numPoints > 1)
+    // intersection of the ray with the slabs of all axes
+    float entry = 0;
+    float exit = infinity;
+    for(int axis = 0; axis < 3; ++axis)
     {
-        childNode->leftChild = buildKdTree(begin, begin + centerPos, depth + 1);
-        childNode->rightChild = buildKdTree(begin + centerPos, end, depth + 1);
+        const float lower = cell.lower[axis] - radius - origin[axis];
+        const float upper = cell.upper[axis] + radius - origin[axis];
+        if(direction[axis] == 0)
+        {
+            if(lower > 0 || upper < 0) return infinity;
+            continue;
+        }
+
+        float lowerDistance = lower / direction[axis];
+        float upperDistance = upper / direction[axis];
+        if(lowerDistance > upperDistance) std::swap(lowerDistance, upperDistance);
+        entry = std::max(entry, lowerDistance);
+        exit = std::min(exit, upperDistance);
     }
+    return entry <= exit ? entry : infinity;
+}
+
+void KdTree::leafRayDistances(const KdTreeNode& node, const QVector3D& origin, const QVector3D& direction, const float sqrRadius, float* rayDistances) const
+{
+    recordLeaf(node);
+    const uint numPoints = node.end - node.begin;
+    const float* x = m_x.data() + node.begin;
+    const float* y = m_y.data() + node.begin;
+    const float* z = m_z.data() + node.begin;
 
-    return childNode;
+    const float ox = origin.x(), oy = origin.y(), oz = origin.z();
+    const float dx = direction.x(), dy = direction.y(), dz = direction.z();
+    const float infinity = std::numeric_limits<float>::infinity();
+
+    // distance along the ray is the projection onto the direction, the distance to the ray follows from Pythagoras
+    #pragma omp simd
+    for(uint i = 0; i < numPoints; ++i)
+    {
+        const float px = x[i] - ox;
+        const float py = y[i] - oy;
+        const float pz = z[i] - oz;
+        const float along = px*dx + py*dy + pz*dz;
+        const float sqrDistanceToRay = px*px + py*py + pz*pz - along*along;
+        rayDistances[i] = (along >= 0) & (sqrDistanceToRay <= sqrRadius) ? along : infinity;
+    }
+
+    if(m_numRemoved == 0) return;
+    for(uint i = 0; i < numPoints; ++i)
+        if(m_removed[ m_indices[node.begin + i] ]) rayDistances[i] = infinity;
 }
 
-void KdTree::rangeQuery(const QVector3D& min, const QVector3D& max, QVector<int>& vertexPtrs, KdTreeNode* node, uint depth)
+void KdTree::scanLeafPolytope(const KdTreeNode& node, const std::vector<QVector4D>& planes, std::vector<PointIndex>& indices) const
 {
-    //qDebug() << "depth is" << depth;
-    if(node == 0) return;
+    recordLeaf(node);
+    const uint numPoints = node.end - node.begin;
+    const float* x = m_x.data() + node.begin;
+    const float* y = m_y.data() + node.begin;
+    const float* z = m_z.data() + node.begin;
 
-    unsigned int numPoints = (node->end - node->begin);
-    if(numPoints == 0) return;
-    else if(numPoints == 1)
+    // branch-free test of the whole bucket, one plane after another
+    int inside[MAX_LEAF_SIZE];
+    std::fill(inside, inside + numPoints, 1);
+    for(const QVector4D& plane : planes)
+    {
+        const float a = plane.x(), b = plane.y(), c = plane.z(), d = plane.w();
+
+        #pragma omp simd
+        for(uint i = 0; i < numPoints; ++i) inside[i] &= (a*x[i] + b*y[i] + c*z[i] + d >= 0);
+    }
+
+    appendLeafHits(node, inside, indices);
+}
+
+KdTree::TreeStatistics KdTree::treeStatistics() const
+{
+    TreeStatistics statistics;
+    statistics.leafOccupancy.assign(m_leafSize + 1, 0);
+
+    // depth first walk with an explicit stack of (node, level) pairs
+    PointIndex numPoints = 0;
+    double leafDepthSum = 0;
+    std::vector<std::pair<PointIndex, int>> stack;
+    for(PointIndex root : m_roots)
     {
-        Vertex point = *node->begin;
-        if( inRange(point.position, min, max) ) vertexPtrs.push_back( (int) node->begin );
+        stack.push_back( {root, 1} );
+        while( !stack.empty() )
+        {
+            const PointIndex nodeIndex = stack.back().first;
+            const int level = stack.back().second;
+            stack.pop_back();
+
+            const KdTreeNode& node = m_nodes[nodeIndex];
+            ++statistics.numNodes;
+            statistics.depth = std::max(statistics.depth, level);
+            if(node.rightChild != 0)
+            {
+                stack.push_back( {node.rightChild, level + 1} );
+                stack.push_back( {nodeIndex + 1, level + 1} );
+                continue;
+            }
+
+            const PointIndex leafPoints = node.end - node.begin;
+            ++statistics.numLeaves;
+            // subtrees built before a change of the leaf size may hold larger leaves
+            if(leafPoints >= (PointIndex) statistics.leafOccupancy.size()) statistics.leafOccupancy.resize(leafPoints + 1, 0);
+            ++statistics.leafOccupancy[leafPoints];
+            leafDepthSum += (double) level * leafPoints;
+            numPoints += leafPoints;
+        }
+    }
+    if(numPoints > 0) statistics.meanLeafDepth = leafDepthSum / numPoints;
+    return statistics;
+}
+
+template<int Axis>
+PointIndex KdTree::splitNode(PointIndex begin, PointIndex end, PointIndex nodeIndex, bool parallelPartition)
+{
+    PointIndex numPoints = (end - begin);
+
+    KdTreeNode& node = m_nodes[nodeIndex];
+    node.begin = begin;
+    node.end = end;
+
+    // small ranges become leaf buckets
+    if(numPoints <= m_leafSize)
+    {
+        node.rightChild = 0;
+        return numPoints;
+    }
+
+    PointIndex centerPos = numPoints/2;
+
+    auto first = m_buildPoints.begin() + begin;
+    auto last = m_buildPoints.begin() + end;
+
+    nthElement( first, first + centerPos, last,
+                [](const BuildPoint& p1, const BuildPoint& p2) { return p1.position[Axis] < p2.position[Axis]; },
+                parallelPartition );
+    node.median = (first + centerPos)->position[Axis];
+    node.axis = Axis;
+
+    // left subtree directly follows its parent, right subtree follows the left one
+    node.rightChild = nodeIndex + 1 + kdNodeCount(centerPos, m_leafSize);
+
+    return centerPos;
+}
+
+void KdTree::buildUnbalanced(PointIndex begin, PointIndex end, CellBounds cell, std::vector<KdTreeNode>& nodes, bool tasks)
+{
+    const PointIndex nodeIndex = nodes.size();
+    nodes.emplace_back();
+    nodes[nodeIndex].begin = begin;
+    nodes[nodeIndex].end = end;
+
+    // small ranges become leaf buckets
+    if(end - begin <= m_leafSize) return;
+
+    int axis;
+    float median;
+    const PointIndex centerPos = m_splitPolicy == SlidingMidpointSplit ? splitSlidingMidpoint(begin, end, cell, axis, median)
+                                                                       : splitLargestExtent(begin, end, axis, median);
+    nodes[nodeIndex].axis = axis;
+    nodes[nodeIndex].median = median;
+
+    CellBounds leftCell = cell;
+    leftCell.upper[axis] = median;
+    CellBounds rightCell = cell;
+    rightCell.lower[axis] = median;
+
+    if( !tasks || end - begin - centerPos <= TASK_CUTOFF )
+    {
+        buildUnbalanced(begin, begin + centerPos, leftCell, nodes, tasks);
+        nodes[nodeIndex].rightChild = nodes.size();
+        buildUnbalanced(begin + centerPos, end, rightCell, nodes, tasks);
         return;
     }
 
-    unsigned int currentDimension = depth % 3;
-    if(currentDimension == 0)
+    // the right subtree is built concurrently into nodes of its own, which are appended behind the left subtree
+    std::vector<KdTreeNode> rightNodes;
+    #pragma omp task shared(rightNodes)
+    buildUnbalanced(begin + centerPos, end, rightCell, rightNodes, tasks);
+    buildUnbalanced(begin, begin + centerPos, leftCell, nodes, tasks);
+    #pragma omp taskwait
+
+    const PointIndex rightChild = nodes.size();
+    nodes[nodeIndex].rightChild = rightChild;
+    for(KdTreeNode& node : rightNodes)
+    {
+        if(node.rightChild != 0) node.rightChild += rightChild;
+        nodes.push_back(node);
+    }
+}
+
+PointIndex KdTree::splitSlidingMidpoint(PointIndex begin, PointIndex end, const CellBounds& cell, int& axis, float& median)
+{
+    axis = 0;
+    for(int a = 1; a < 3; ++a)
+        if(cell.upper[a] - cell.lower[a] > cell.upper[axis] - cell.lower[axis]) axis = a;
+    median = (cell.lower[axis] + cell.upper[axis]) / 2;
+
+    const int splitAxis = axis;
+    auto first = m_buildPoints.begin() + begin;
+    auto last = m_buildPoints.begin() + end;
+    auto isLess = [splitAxis](const BuildPoint& p1, const BuildPoint& p2) { return p1.position[splitAxis] < p2.position[splitAxis]; };
+
+    const float split = median;
+    auto center = std::partition(first, last, [&](const BuildPoint& p) { return p.position[splitAxis] < split; });
+    if(center != first && center != last) return center - first;
+
+    auto extent = std::minmax_element(first, last, isLess);
+    if(extent.first->position[axis] == extent.second->position[axis])
+    {
+        // all points share the coordinate, any split by rank is valid and keeps the tree balanced
+        median = first->position[axis];
+        return (end - begin) / 2;
+    }
+
+    // slide the plane to the nearest point, which becomes the only point of the otherwise empty side
+    if(center == first)
     {
-        if(min.x() <= node->median)
-            rangeQuery(min, max, vertexPtrs, node->leftChild, depth+1);
-        if(max.x() > node->median)
-            rangeQuery(min, max, vertexPtrs, node->rightChild, depth+1);
+        median = extent.first->position[axis];
+        std::iter_swap(first, extent.first);
+        return 1;
     }
-    else if(currentDimension == 1)
+    median = extent.second->position[axis];
+    std::iter_swap(last - 1, extent.second);
+    return end - begin - 1;
+}
+
+PointIndex KdTree::splitLargestExtent(PointIndex begin, PointIndex end, int& axis, float& median)
+{
+    float lower[3] = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+    float upper[3] = {-lower[0], -lower[1], -lower[2]};
+    for(PointIndex i = begin; i < end; ++i)
     {
-        if(min.y() <= node->median)
-            rangeQuery(min, max, vertexPtrs, node->leftChild, depth+1);
-        if(max.y() > node->median)
-            rangeQuery(min, max, vertexPtrs, node->rightChild, depth+1);
+        const QVector3D& p = m_buildPoints[i].position;
+        for(int a = 0; a < 3; ++a)
+        {
+            lower[a] = std::min(lower[a], p[a]);
+            upper[a] = std::max(upper[a], p[a]);
+        }
     }
-    else
+    axis = 0;
+    for(int a = 1; a < 3; ++a)
+        if(upper[a] - lower[a] > upper[axis] - lower[axis]) axis = a;
+
+    const int splitAxis = axis;
+    const PointIndex centerPos = (end - begin) / 2;
+    auto first = m_buildPoints.begin() + begin;
+    std::nth_element( first, first + centerPos, m_buildPoints.begin() + end,
+                      [splitAxis](const BuildPoint& p1, const BuildPoint& p2) { return p1.position[splitAxis] < p2.position[splitAxis]; } );
+    median = (first + centerPos)->position[axis];
+    return centerPos;
+}
+
+void KdTree::scanLeafBox(const KdTreeNode& node, const QVector3D& min, const QVector3D& max, std::vector<PointIndex>& indices) const
+{
+    const uint numPoints = node.end - node.begin;
+    const float* x = m_x.data() + node.begin;
+    const float* y = m_y.data() + node.begin;
+    const float* z = m_z.data() + node.begin;
+
+    const float minX = min.x(), minY = min.y(), minZ = min.z();
+    const float maxX = max.x(), maxY = max.y(), maxZ = max.z();
+
+    // branch-free test of the whole bucket, vectorized by the compiler
+    int inside[MAX_LEAF_SIZE];
+    #pragma omp simd
+    for(uint i = 0; i < numPoints; ++i)
     {
-        if(min.z() <= node->median)
-            rangeQuery(min, max, vertexPtrs, node->leftChild, depth+1);
-        if(max.z() > node->median)
-            rangeQuery(min, max, vertexPtrs, node->rightChild, depth+1);
+        inside[i] = (x[i] >= minX) & (x[i] <= maxX) &
+                    (y[i] >= minY) & (y[i] <= maxY) &
+                    (z[i] >= minZ) & (z[i] <= maxZ);
     }
+
+    appendLeafHits(node, inside, indices);
 }
 
-Vertex* KdTree::nearestPoint(QVector3D& point)
+void KdTree::scanLeafSphere(const KdTreeNode& node, const QVector3D& center, const float sqrDistance, std::vector<PointIndex>& indices) const
 {
-    Vertex* nearest;
-    Vertex* nearestPApprox = nearestPointApprox(point, m_tree, 0);
-    double dist = nearestPApprox->position.distanceToPoint(point);//9999999.0;
-    nearestPoint(point, m_tree, dist, nearest, 0);
-    return nearest;
+    const uint numPoints = node.end - node.begin;
+    const float* x = m_x.data() + node.begin;
+    const float* y = m_y.data() + node.begin;
+    const float* z = m_z.data() + node.begin;
+
+    const float cx = center.x(), cy = center.y(), cz = center.z();
+
+    // branch-free test of the whole bucket, vectorized by the compiler
+    int inside[MAX_LEAF_SIZE];
+    #pragma omp simd
+    for(uint i = 0; i < numPoints; ++i)
+    {
+        const float dx = x[i] - cx;
+        const float dy = y[i] - cy;
+        const float dz = z[i] - cz;
+        inside[i] = dx*dx + dy*dy + dz*dz <= sqrDistance;
+    }
+
+    appendLeafHits(node, inside, indices);
 }
 
-void KdTree::nearestPoint(const QVector3D& point, KdTreeNode* node, double& dist, Vertex* np, int depth)
+void KdTree::appendLeafHits(const KdTreeNode& node, const int* inside, std::vector<PointIndex>& indices) const
 {
-    if (node->leftChild == node->rightChild) {
-        Vertex* p = node->begin;
-        double distance = point.distanceToPoint(p->position);
-        if (distance > dist)
-            return;
-        np = p;
-        dist = distance;
+    const uint numPoints = node.end - node.begin;
+    if(m_numRemoved == 0)
+    {
+        for(uint i = 0; i < numPoints; ++i)
+            if(inside[i]) indices.push_back( m_indices[node.begin + i] );
         return;
     }
 
-    unsigned int currentDimension = depth % 3;
-    float value = (currentDimension == 0)? point.x()
-                : (currentDimension == 1)? point.y()
-                                         : point.z();
+    for(uint i = 0; i < numPoints; ++i)
+        if(inside[i] && !m_removed[ m_indices[node.begin + i] ]) indices.push_back( m_indices[node.begin + i] );
+}
+
+PointIndex KdTree::countLeafSphere(const KdTreeNode& node, const QVector3D& center, const float sqrDistance) const
+{
+    // removed points are farther away than any radius
+    float sqrDistances[MAX_LEAF_SIZE];
+    leafSqrDistances(node, center, sqrDistances);
+
+    const uint numPoints = node.end - node.begin;
+    const float maxSqrDistance = std::min(sqrDistance, std::nextafter(std::numeric_limits<float>::max(), 0.0f));
+    PointIndex count = 0;
+    #pragma omp simd reduction(+:count)
+    for(uint i = 0; i < numPoints; ++i) count += sqrDistances[i] <= maxSqrDistance;
+    return count;
+}
+
+PointIndex KdTree::countLeafBox(const KdTreeNode& node, const QVector3D& min, const QVector3D& max) const
+{
+    int inside[MAX_LEAF_SIZE];
+    const uint numPoints = node.end - node.begin;
+    const float* x = m_x.data() + node.begin;
+    const float* y = m_y.data() + node.begin;
+    const float* z = m_z.data() + node.begin;
+
+    const float minX = min.x(), minY = min.y(), minZ = min.z();
+    const float maxX = max.x(), maxY = max.y(), maxZ = max.z();
+
+    #pragma omp simd
+    for(uint i = 0; i < numPoints; ++i)
+    {
+        inside[i] = (x[i] >= minX) & (x[i] <= maxX) &
+                    (y[i] >= minY) & (y[i] <= maxY) &
+                    (z[i] >= minZ) & (z[i] <= maxZ);
+    }
+
+    PointIndex count = 0;
+    for(uint i = 0; i < numPoints; ++i)
+        count += inside[i] && (m_numRemoved == 0 || !m_removed[ m_indices[node.begin + i] ]);
+    return count;
+}
+
+void KdTree::leafSqrDistances(const KdTreeNode& node, const QVector3D& point, float* sqrDistances) const
+{
+    const uint numPoints = node.end - node.begin;
+    const float* x = m_x.data() + node.begin;
+    const float* y = m_y.data() + node.begin;
+    const float* z = m_z.data() + node.begin;
+
+    const float px = point.x(), py = point.y(), pz = point.z();
 
-    if (value + dist > node->median)
-        nearestPoint(point, node->rightChild, dist, np, depth+1);
-    if (value - dist <= node->median)
-        nearestPoint(point, node->leftChild, dist, np, depth+1);
+    #pragma omp simd
+    for(uint i = 0; i < numPoints; ++i)
+    {
+        const float dx = x[i] - px;
+        const float dy = y[i] - py;
+        const float dz = z[i] - pz;
+        sqrDistances[i] = dx*dx + dy*dy + dz*dz;
+    }
+
+    if(m_numRemoved == 0) return;
+    for(uint i = 0; i < numPoints; ++i)
+        if(m_removed[ m_indices[node.begin + i] ]) sqrDistances[i] = std::numeric_limits<float>::max();
 }
 
-Vertex* KdTree::nearestPointApprox(const QVector3D& point, KdTreeNode* node, uint depth)
+Vertex* KdTree::nearestPoint(const QVector3D& point) const
 {
-    if(node == 0) return 0;
+    if(!m_vertexArrayPointer) return 0;
 
-    unsigned int numPoints = (node->end - node->begin);
-    unsigned int currentDimension = depth % 3;
+    PointIndex nearest = approximateNearestPoint(point, 0);
+    return nearest < 0 ? 0 : m_vertexArrayPointer + nearest;
+}
+
+void KdTree::kNearest(const QVector3D& point, int k, std::vector<PointIndex>& indices, std::vector<float>& distances) const
+{
+    indices.clear();
+    distances.clear();
+    if(m_roots.empty() || k <= 0) return;
 
-    if(numPoints == 0)
+    recordQuery();
+    std::vector<Neighbor> heap;
+    heap.reserve(k);
+    for(PointIndex root : m_roots)
+        withRootAxis([&](auto axis) { kNearest<decltype(axis)::value>(point, k, root, heap); });
+
+    // popping the max heap leaves the candidates sorted by ascending distance
+    std::sort_heap(heap.begin(), heap.end());
+    for(const Neighbor& neighbor : heap)
     {
-        return 0;
+        indices.push_back( m_indices[neighbor.index] );
+        distances.push_back( std::sqrt(neighbor.sqrDistance) );
     }
-    else if(numPoints == 1)
+}
+
+template<int Axis>
+void KdTree::kNearest(const QVector3D& point, uint k, PointIndex nodeIndex, std::vector<Neighbor>& heap) const
+{
+    const KdTreeNode& node = m_nodes[nodeIndex];
+    recordNode();
+
+    if(node.rightChild == 0)
     {
-        return node->begin;
+        recordLeaf(node);
+        const uint numPoints = node.end - node.begin;
+        float sqrDistances[MAX_LEAF_SIZE];
+        leafSqrDistances(node, point, sqrDistances);
+
+        for(uint i = 0; i < numPoints; ++i)
+        {
+            if(m_numRemoved > 0 && m_removed[ m_indices[node.begin + i] ]) continue;
+
+            if(heap.size() < k)
+            {
+                heap.push_back( {sqrDistances[i], node.begin + i} );
+                std::push_heap(heap.begin(), heap.end());
+            }
+            else if(sqrDistances[i] < heap.front().sqrDistance)
+            {
+                // replace current k-th neighbor
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = {sqrDistances[i], node.begin + i};
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+        return;
+    }
+
+    // visit the side of the split plane containing the point first, it most likely shrinks the search radius
+    const float planeDistance = point[splitAxis<Axis>(node)] - node.median;
+    const PointIndex nearChild = planeDistance <= 0 ? nodeIndex + 1 : node.rightChild;
+    const PointIndex farChild = planeDistance <= 0 ? node.rightChild : nodeIndex + 1;
+
+    kNearest<nextAxis(Axis)>(point, k, nearChild, heap);
+    if(heap.size() < k || planeDistance * planeDistance <= heap.front().sqrDistance)
+        kNearest<nextAxis(Axis)>(point, k, farChild, heap);
+}
+
+PointIndex KdTree::approximateNearestPoint(const QVector3D& point, float epsilon, int maxLeafVisits, int* nodesVisited) const
+{
+    if(nodesVisited) *nodesVisited = 0;
+    if(m_roots.empty()) return -1;
+
+    recordQuery();
+    ApproximateSearch search;
+    search.point = point;
+    search.sqrErrorFactor = (1 + epsilon) * (1 + epsilon);
+    search.maxLeafVisits = maxLeafVisits;
+
+    for(PointIndex root : m_roots)
+    {
+        float cellOffsets[3] = {0, 0, 0};
+        withRootAxis([&](auto axis) { nearestPointApprox<decltype(axis)::value>(search, root, 0, cellOffsets); });
     }
 
-    if(currentDimension == 0)
+    if(nodesVisited) *nodesVisited = search.nodesVisited;
+    return search.nearest < 0 ? -1 : m_indices[search.nearest];
+}
+
+template<int Axis>
+void KdTree::nearestPointApprox(ApproximateSearch& search, PointIndex nodeIndex, float cellSqrDistance, float* cellOffsets) const
+{
+    // leaf budget used up
+    if(search.maxLeafVisits > 0 && search.leafVisits >= search.maxLeafVisits) return;
+
+    const KdTreeNode& node = m_nodes[nodeIndex];
+    ++search.nodesVisited;
+    recordNode();
+
+    if(node.rightChild == 0)
     {
-        if(point.x() <= node->median)
+        ++search.leafVisits;
+        recordLeaf(node);
+
+        const uint numPoints = node.end - node.begin;
+        float sqrDistances[MAX_LEAF_SIZE];
+        leafSqrDistances(node, search.point, sqrDistances);
+
+        for(uint i = 0; i < numPoints; ++i)
         {
-            return node->leftChild ?
-                nearestPointApprox(point, node->leftChild, depth+1) :
-                nearestPointApprox(point, node->rightChild, depth+1);
+            if(sqrDistances[i] < search.nearestSqrDistance)
+            {
+                search.nearestSqrDistance = sqrDistances[i];
+                search.nearest = node.begin + i;
+            }
         }
-        else
+        return;
+    }
+
+    // the child containing the point is searched first, it most likely holds the nearest point
+    const int axis = splitAxis<Axis>(node);
+    const float planeDistance = search.point[axis] - node.median;
+    const PointIndex nearChild = planeDistance <= 0 ? nodeIndex + 1 : node.rightChild;
+    const PointIndex farChild = planeDistance <= 0 ? node.rightChild : nodeIndex + 1;
+
+    nearestPointApprox<nextAxis(Axis)>(search, nearChild, cellSqrDistance, cellOffsets);
+
+    // the far cell can only improve the result by more than the allowed error if it is closer than nearest / (1 + epsilon)
+    const float oldOffset = cellOffsets[axis];
+    const float farSqrDistance = cellSqrDistance - oldOffset * oldOffset + planeDistance * planeDistance;
+    if(farSqrDistance * search.sqrErrorFactor < search.nearestSqrDistance)
+    {
+        cellOffsets[axis] = planeDistance;
+        nearestPointApprox<nextAxis(Axis)>(search, farChild, farSqrDistance, cellOffsets);
+        cellOffsets[axis] = oldOffset;
+    }
+}
+
+KdTree::DistanceStatistics KdTree::distancesTo(const KdTree& reference, std::vector<float>& distances, bool parallel) const
+{
+    DistanceStatistics statistics;
+    distances.assign(m_removed.size(), -1);
+    if(m_roots.empty() || reference.size() == 0) return statistics;
+
+    DualTreeSearch search;
+    search.reference = &reference;
+    search.nodeBounds.assign(m_nodes.size(), std::numeric_limits<float>::infinity());
+    search.sqrDistances.assign(m_indices.size(), std::numeric_limits<float>::infinity());
+
+    // the query trees are cut into subtrees small enough to balance the load, each is searched independently
+    const PointIndex maxSubtreeSize = std::max<PointIndex>( TASK_CUTOFF / 16, m_indices.size() / (16 * omp_get_max_threads()) );
+    std::vector<std::pair<PointIndex, CellBounds>> subtrees;
+    std::vector<std::pair<PointIndex, CellBounds>> stack;
+    for(size_t r = 0; r < m_roots.size(); ++r)
+    {
+        stack.push_back( {m_roots[r], m_rootBounds[r]} );
+        while( !stack.empty() )
         {
-            return node->rightChild ?
-                nearestPointApprox(point, node->rightChild, depth+1) :
-                nearestPointApprox(point, node->leftChild, depth+1);
+            const auto subtree = stack.back();
+            stack.pop_back();
+
+            const KdTreeNode& node = m_nodes[subtree.first];
+            if(node.rightChild == 0 || node.end - node.begin <= maxSubtreeSize)
+            {
+                subtrees.push_back(subtree);
+                continue;
+            }
+
+            CellBounds left, right;
+            splitCell(node, subtree.second, left, right);
+            stack.push_back( {subtree.first + 1, left} );
+            stack.push_back( {node.rightChild, right} );
         }
     }
-    else if(currentDimension == 1)
+
+    #pragma omp parallel for schedule(dynamic) if(parallel)
+    for(PointIndex i = 0; i < (PointIndex) subtrees.size(); ++i)
+    {
+        for(size_t r = 0; r < reference.m_roots.size(); ++r)
+            dualTreeNearest(search, subtrees[i].first, subtrees[i].second, reference.m_roots[r], reference.m_rootBounds[r]);
+    }
+
+    // scatter to vertex order and reduce the aggregates per thread
+    #pragma omp parallel if(parallel)
     {
-        if(point.y() <= node->median)
+        DistanceStatistics threadStatistics;
+        threadStatistics.minDistance = std::numeric_limits<float>::infinity();
+        threadStatistics.maxDistance = -1;
+        double threadSum = 0;
+
+        #pragma omp for nowait
+        for(PointIndex i = 0; i < (PointIndex) m_indices.size(); ++i)
         {
-            return node->leftChild ?
-                nearestPointApprox(point, node->leftChild, depth+1) :
-                nearestPointApprox(point, node->rightChild, depth+1);
+            const PointIndex index = m_indices[i];
+            if(m_numRemoved > 0 && m_removed[index]) continue;
+
+            const float distance = std::sqrt(search.sqrDistances[i]);
+            distances[index] = distance;
+            threadSum += distance;
+            ++threadStatistics.numPoints;
+            if(distance < threadStatistics.minDistance)
+            {
+                threadStatistics.minDistance = distance;
+                threadStatistics.closestPoint = index;
+            }
+            if(distance > threadStatistics.maxDistance)
+            {
+                threadStatistics.maxDistance = distance;
+                threadStatistics.farthestPoint = index;
+            }
         }
-        else
+
+        #pragma omp critical
         {
-            return node->rightChild ?
-                nearestPointApprox(point, node->rightChild, depth+1) :
-                nearestPointApprox(point, node->leftChild, depth+1);
+            if(threadStatistics.numPoints > 0)
+            {
+                if(statistics.numPoints == 0 || threadStatistics.minDistance < statistics.minDistance)
+                {
+                    statistics.minDistance = threadStatistics.minDistance;
+                    statistics.closestPoint = threadStatistics.closestPoint;
+                }
+                if(statistics.numPoints == 0 || threadStatistics.maxDistance > statistics.maxDistance)
+                {
+                    statistics.maxDistance = threadStatistics.maxDistance;
+                    statistics.farthestPoint = threadStatistics.farthestPoint;
+                }
+                statistics.numPoints += threadStatistics.numPoints;
+                statistics.meanDistance += threadSum;
+            }
         }
     }
-    else
+    if(statistics.numPoints > 0) statistics.meanDistance /= statistics.numPoints;
+    return statistics;
+}
+
+float KdTree::hausdorffDistance(const KdTree& first, const KdTree& second, bool parallel)
+{
+    std::vector<float> distances;
+    const float forward = first.distancesTo(second, distances, parallel).maxDistance;
+    const float backward = second.distancesTo(first, distances, parallel).maxDistance;
+    return std::max(forward, backward);
+}
+
+void KdTree::dualTreeNearest(DualTreeSearch& search, PointIndex queryNode, const CellBounds& queryCell,
+                             PointIndex referenceNode, const CellBounds& referenceCell) const
+{
+    // no point of the reference cell can be closer than the current nearest neighbors of all query points
+    if(cellSqrDistance(queryCell, referenceCell) > search.nodeBounds[queryNode]) return;
+
+    const KdTreeNode& query = m_nodes[queryNode];
+    const KdTreeNode& reference = search.reference->m_nodes[referenceNode];
+    const bool isQueryLeaf = query.rightChild == 0;
+    const bool isReferenceLeaf = reference.rightChild == 0;
+
+    if(isQueryLeaf && isReferenceLeaf)
     {
-        if(point.z() <= node->median)
+        search.nodeBounds[queryNode] = dualTreeLeaves(search, query, reference, referenceCell);
+        return;
+    }
+
+    if(isQueryLeaf)
+    {
+        CellBounds left, right;
+        splitCell(reference, referenceCell, left, right);
+        if(cellSqrDistance(queryCell, right) < cellSqrDistance(queryCell, left))
         {
-            return node->leftChild ?
-                nearestPointApprox(point, node->leftChild, depth+1) :
-                nearestPointApprox(point, node->rightChild, depth+1);
+            dualTreeNearest(search, queryNode, queryCell, reference.rightChild, right);
+            dualTreeNearest(search, queryNode, queryCell, referenceNode + 1, left);
         }
         else
         {
-            return node->rightChild ?
-                nearestPointApprox(point, node->rightChild, depth+1) :
-                nearestPointApprox(point, node->leftChild, depth+1);
+            dualTreeNearest(search, queryNode, queryCell, referenceNode + 1, left);
+            dualTreeNearest(search, queryNode, queryCell, reference.rightChild, right);
+        }
+        return;
+    }
+
+    CellBounds left, right;
+    splitCell(query, queryCell, left, right);
+    dualTreeNearest(search, queryNode + 1, left, referenceNode, referenceCell);
+    dualTreeNearest(search, query.rightChild, right, referenceNode, referenceCell);
+    search.nodeBounds[queryNode] = std::max(search.nodeBounds[queryNode + 1], search.nodeBounds[query.rightChild]);
+}
+
+float KdTree::dualTreeLeaves(DualTreeSearch& search, const KdTreeNode& queryLeaf, const KdTreeNode& referenceLeaf,
+                             const CellBounds& referenceCell) const
+{
+    const uint numReferencePoints = referenceLeaf.end - referenceLeaf.begin;
+    float sqrDistances[MAX_LEAF_SIZE];
+
+    // query leaves without remaining points end up with a negative bound, which skips them from then on
+    float maxSqrDistance = -1;
+    for(PointIndex i = queryLeaf.begin; i < queryLeaf.end; ++i)
+    {
+        if(m_numRemoved > 0 && m_removed[ m_indices[i] ]) continue;
+
+        float nearest = search.sqrDistances[i];
+        // points that already have a neighbor closer than the reference cell skip the scan
+        const QVector3D point(m_x[i], m_y[i], m_z[i]);
+        const CellBounds pointCell = {{point.x(), point.y(), point.z()}, {point.x(), point.y(), point.z()}};
+        if(cellSqrDistance(pointCell, referenceCell) > nearest)
+        {
+            maxSqrDistance = std::max(maxSqrDistance, nearest);
+            continue;
         }
+
+        search.reference->leafSqrDistances(referenceLeaf, point, sqrDistances);
+        #pragma omp simd reduction(min:nearest)
+        for(uint j = 0; j < numReferencePoints; ++j) nearest = std::min(nearest, sqrDistances[j]);
+
+        search.sqrDistances[i] = nearest;
+        maxSqrDistance = std::max(maxSqrDistance, nearest);
+    }
+    return maxSqrDistance;
+}
+
+void KdTree::splitCell(const KdTreeNode& node, const CellBounds& cell, CellBounds& left, CellBounds& right)
+{
+    left = cell;
+    right = cell;
+    left.upper[node.axis] = node.median;
+    right.lower[node.axis] = node.median;
+}
+
+float KdTree::cellSqrDistance(const CellBounds& first, const CellBounds& second)
+{
+    float sqrDistance = 0;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        const float gap = std::max( 0.0f, std::max(first.lower[axis] - second.upper[axis], second.lower[axis] - first.upper[axis]) );
+        sqrDistance += gap * gap;
     }
+    return sqrDistance;
 }
@@ -2,61 +2,233 @@
 #define KDTREE_H
 
 #include <QVector3D>
-#include <QVector>
+#include <QVector4D>
+#include <QMatrix4x4>
+#include <QString>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <type_traits>
 #include "vertex.h"
+#include "spatialindex.h"
+#include "mappablearray.h"
 
-/*!
- * \brief utility function for point sorting
- * \param p1
- * \param p2
- * \return returns true if p1.x < p2.x, false otherwise
- */
-inline bool sortByX( const QVector3D& p1, const QVector3D& p2) { return p1.x() < p2.x(); }
-/*!
- * \brief utility function for point sorting
- * \param p1
- * \param p2
- * \return returns true if p1.y < p2.y, false otherwise
- */
-inline bool sortByY( const QVector3D& p1, const QVector3D& p2) { return p1.y() < p2.y(); }
-/*!
- * \brief utility function for point sorting
- * \param p1
- * \param p2
- * \return returns true if p1.z < p2.z, false otherwise
- */
-inline bool sortByZ( const QVector3D& p1, const QVector3D& p2) { return p1.z() < p2.z(); }
-
-/*!
- * \brief utility function for searching points in a cuboid area
- * \param point
- * \param min minimum xyz coordinates
- * \param max maximum xyz coordinates
- * \return true if point is inside or on the cuboid defined by min and max
- */
-inline bool inRange(const QVector3D& point, const QVector3D& min, const QVector3D& max)
-{
-    return point.x() >= min.x() && point.x() <= max.x() &&
-           point.y() >= min.y() && point.y() <= max.y() &&
-           point.z() >= min.z() && point.z() <= max.z();
-}
+class QFile;
 
 /*!
  * \brief The KdTree class
  * \details This class is used for efficient filter and search operations on point clouds.
+ * The tree keeps its own packed copy of all point coordinates in tree order, the vertices passed to
+ * KdTree::build are not modified. Query results are offsets of points in that vertex array.
+ * Points can be inserted and removed after building: the tree is a sequence of static subtrees whose sizes
+ * roughly halve from one to the next (logarithmic method), inserted points form a new subtree that is merged with
+ * smaller trailing subtrees. Removed points are only marked and dropped when their subtree is rebuilt.
+ * A built tree can be saved to a file and memory mapped again later, which makes it available without rebuilding.
+ * Batched sphere queries are inherited from SpatialIndex. The split axis cycles through x, y and z and is a template
+ * parameter of every traversal step, KdTreeND provides static trees of other dimensions and coordinate types.
+ * All const member functions are thread-safe: any number of threads may query the same tree concurrently,
+ * as long as no thread modifies the tree at the same time.
  */
-class KdTree
+class KdTree : public SpatialIndex
 {
 public:
+    /*!
+     * \brief The SplitPolicy enum
+     * \details how KdTree::build chooses the split plane of a node
+     */
+    enum SplitPolicy
+    {
+        MedianSplit,            //!< median of the points, the axis cycles through x, y and z - balanced tree, fastest build
+        SlidingMidpointSplit,   //!< middle of the longest side of the cell, moved to the nearest point if one side would stay
+                                //!< empty - cells do not degenerate to thin slabs for anisotropic clouds, but the tree may be unbalanced
+        LargestExtentSplit      //!< median of the points along the axis in which they spread the most
+    };
+
+    /*!
+     * \brief The VertexOrdering enum
+     * \details order of the vertices stored in a tree file, see KdTree::save
+     */
+    enum VertexOrdering
+    {
+        OriginalOrder,      //!< vertices are in the order they were loaded in
+        MortonCurveOrder    //!< vertices were sorted with MortonOrder::sort
+    };
+
+    /*!
+     * \brief The TreeStatistics struct
+     * \details shape of the tree, see KdTree::treeStatistics
+     */
+    struct TreeStatistics
+    {
+        int depth = 0; //!< number of levels of the deepest subtree, 0 for an empty tree
+        PointIndex numNodes = 0; //!< number of nodes of all subtrees
+        PointIndex numLeaves = 0; //!< number of leaf buckets
+        double meanLeafDepth = 0; //!< mean number of levels from a subtree root down to a leaf, weighted by the points of the leaf
+        std::vector<PointIndex> leafOccupancy; //!< leafOccupancy[n] is the number of leaves holding n points, removed points included
+    };
+
+    /*!
+     * \brief The QueryStatistics struct
+     * \details work done by queries while KdTree::setCollectQueryStatistics is enabled
+     */
+    struct QueryStatistics
+    {
+        PointIndex queries = 0; //!< number of queries
+        PointIndex nodesVisited = 0; //!< number of visited nodes, leaves included
+        PointIndex pointsTested = 0; //!< number of points tested in leaf buckets
+
+        double nodesPerQuery() const { return queries == 0 ? 0 : (double) nodesVisited / queries; }
+        double pointsPerQuery() const { return queries == 0 ? 0 : (double) pointsTested / queries; }
+    };
+
+    /*!
+     * \brief The DistanceStatistics struct
+     * \details aggregate result of KdTree::distancesTo
+     */
+    struct DistanceStatistics
+    {
+        PointIndex numPoints = 0; //!< number of compared points
+        float minDistance = 0; //!< minimum clearance between the clouds
+        float maxDistance = 0; //!< directed Hausdorff distance, the largest distance of a point to the other cloud
+        double meanDistance = 0; //!< mean distance of the points to the other cloud
+        PointIndex closestPoint = -1; //!< offset of the point with the minimum distance, -1 if no point was compared
+        PointIndex farthestPoint = -1; //!< offset of the point with the maximum distance, -1 if no point was compared
+    };
+
     KdTree() {} //!< constructor - nothing actually happens here, the KdTree must be built with KdTree::build
+    KdTree(const KdTree&) = default;
+    KdTree(KdTree&&) = default; //!< hands the arrays over without copying, mapped arrays stay mapped
+    KdTree& operator=(const KdTree&) = default;
+    KdTree& operator=(KdTree&&) = default; //!< see KdTree(KdTree&&)
 
     /*!
      * \brief build KdTree
-     * \details deletes current tree, assigns point data and calls KdTree::buildKdTree to build a new tree from given vertices
+     * \details deletes current tree, copies point positions and calls KdTree::buildSubtree to build a new tree from given vertices
      * \param vertices reference to a QVector holding colors and positions of all points
+     * \param parallel build the tree on all OpenMP threads - queries give the same results as for a serially built tree
+     */
+    void build(std::vector<Vertex>& vertices, bool parallel = false) override;
+
+    /*!
+     * \brief insert points
+     * \details adds vertices [first, last) to the tree, e.g. after they have been appended to the vertex array.
+     * The new points form a subtree that is merged with all trailing subtrees holding fewer points,
+     * so every point takes part in a logarithmic number of rebuilds
+     * \param vertices vertex array the tree was built from, may have been reallocated since
+     * \param first offset of first new vertex
+     * \param last offset behind last new vertex, -1 for the end of vertices
+     */
+    void insert(std::vector<Vertex>& vertices, PointIndex first, PointIndex last = -1);
+
+    /*!
+     * \brief remove point
+     * \details marks a point as removed, it is skipped by all queries from now on. Once more than half of the points
+     * are marked, the tree rebuilds itself from the remaining points.
+     * Offsets of removed points must not be inserted again before KdTree::compact has been called
+     * \param index offset of the point from m_vertexArrayPointer
+     * \param rebalance rebuild once removed points dominate, bulk removals that are followed by KdTree::compact pass
+     * false to avoid a chain of rebuilds
+     */
+    void remove(PointIndex index, bool rebalance = true);
+
+    /*!
+     * \brief check whether a point has been removed
+     * \param index offset of the point from m_vertexArrayPointer
+     * \return true if the point has been removed with KdTree::remove
+     */
+    bool isRemoved(PointIndex index) const { return index < (PointIndex) m_removed.size() && m_removed[index]; }
+
+    /*!
+     * \brief compact
+     * \details drops all removed points and renumbers the remaining ones to match a vertex array from which the
+     * removed vertices have been erased, keeping the order of the others. No subtree is rebuilt for this.
+     * \param vertices vertex array without the removed vertices
+     */
+    void compact(std::vector<Vertex>& vertices);
+
+    /*!
+     * \brief save tree
+     * \details writes the tree, its packed point coordinates and the vertices it was built from to a file
+     * that KdTree::load maps back into memory. Removed points have to be dropped with KdTree::compact first
+     * \param fileName
+     * \param vertices vertex array the tree was built from
+     * \param vertexOrder original offset of every vertex if they have been reordered, e.g. by MortonOrder::sort,
+     * stored along with the vertices. Empty if vertices are in their original order
+     * \param vertexOrdering how the vertices were ordered, stored in the header
+     * \return true on success
      */
-    void build(QVector<Vertex>& vertices);
-    ~KdTree() { delete m_tree; } //!< destructor - deletes tree contents
+    bool save(const QString& fileName, const std::vector<Vertex>& vertices,
+              const std::vector<PointIndex>& vertexOrder = std::vector<PointIndex>(),
+              VertexOrdering vertexOrdering = OriginalOrder) const;
+
+    /*!
+     * \brief load tree
+     * \details memory maps a file written by KdTree::save. Queries are answered directly from the mapped file,
+     * nothing is rebuilt and only the vertices are copied. Modifying the tree copies the mapped arrays first
+     * \param fileName
+     * \param vertices receives the vertices stored in the file
+     * \param vertexOrder if not 0, receives the vertex order passed to KdTree::save
+     * \param vertexOrdering files whose vertices were ordered differently are rejected
+     * \return true on success, neither tree nor vertices are changed otherwise
+     */
+    bool load(const QString& fileName, std::vector<Vertex>& vertices, std::vector<PointIndex>* vertexOrder = 0,
+              VertexOrdering vertexOrdering = OriginalOrder);
+
+    /*!
+     * \brief number of points
+     * \return number of points in the tree, not counting removed ones
+     */
+    PointIndex size() const { return m_indices.size() - m_numRemoved; }
+
+    /*!
+     * \brief set leaf size
+     * \details sets the maximum number of points per leaf bucket, takes effect with the next call of KdTree::build
+     * \param leafSize number of points, clamped to [1, MAX_LEAF_SIZE]
+     */
+    void setLeafSize(uint leafSize) { m_leafSize = std::max(1u, std::min(leafSize, MAX_LEAF_SIZE)); }
+    uint leafSize() const { return m_leafSize; }
+
+    /*!
+     * \brief set split policy
+     * \details takes effect with the next call of KdTree::build, inserted points always follow the policy of the current tree
+     * \param policy
+     */
+    void setSplitPolicy(SplitPolicy policy) { m_requestedSplitPolicy = policy; }
+
+    /*!
+     * \brief split policy
+     * \return policy the current tree has been built with
+     */
+    SplitPolicy splitPolicy() const { return m_splitPolicy; }
+
+    /*!
+     * \brief tree statistics
+     * \details walks all nodes to determine depth, leaf count and leaf occupancy of the tree
+     */
+    TreeStatistics treeStatistics() const;
+
+    /*!
+     * \brief collect query statistics
+     * \details while enabled, all queries count the nodes they visit and the points they test. The counters are shared
+     * by all threads, which slows down concurrent queries, so this is meant for comparing split policies and leaf sizes
+     * \param enabled
+     */
+    void setCollectQueryStatistics(bool enabled) { m_isCollectingStatistics = enabled; }
+    bool collectQueryStatistics() const { return m_isCollectingStatistics; }
+
+    /*!
+     * \brief query statistics
+     * \return work done by all queries since the last call of KdTree::resetQueryStatistics
+     */
+    QueryStatistics queryStatistics() const { return m_queryStatistics; }
+    void resetQueryStatistics() { m_queryStatistics = QueryStatistics(); }
+
+    /*!
+     * \brief point order
+     * \return offsets of all points from m_vertexArrayPointer in the order they are stored in the tree
+     */
+    const MappableArray<PointIndex>& pointOrder() const { return m_indices; }
 
     /*!
      * \brief find all points in a box
@@ -65,7 +237,27 @@ public:
      * \param max maximum xyz boundaries for search box
      * \param indices offsets of points from m_vertexArrayPointer that have been found inside the box
      */
-    void pointsInBox(const QVector3D& min, const QVector3D& max, QVector<int>& indices);
+    void pointsInBox(const QVector3D& min, const QVector3D& max, std::vector<PointIndex>& indices) const override;
+
+    /*!
+     * \brief count points in a box
+     * \details counts the points within a cuboid without collecting them. Subtrees whose cell lies completely
+     * inside the cuboid add their point count without being descended, so the cost depends on the surface of
+     * the query rather than on the number of points inside
+     * \param min minimum xyz boundaries for search box
+     * \param max maximum xyz boundaries for search box
+     * \return number of points inside the box
+     */
+    PointIndex countInBox(const QVector3D& min, const QVector3D& max) const;
+
+    /*!
+     * \brief count points in a sphere
+     * \details same as KdTree::countInBox for the sphere defined by center point and radius, e.g. for local densities
+     * \param center center of the sphere
+     * \param distance radius of the sphere
+     * \return number of points inside the sphere
+     */
+    PointIndex countInSphere(const QVector3D& center, const float distance) const;
 
     /*!
      * \brief find all points in a sphere
@@ -74,74 +266,777 @@ public:
      * \param distance radius of the sphere
      * \param indices offsets of points from m_vertexArrayPointer that have been found inside the box
      */
-    void pointsInSphere(const QVector3D& center, const float distance, QVector<int>& indices);
+    void pointsInSphere(const QVector3D& center, const float distance, std::vector<PointIndex>& indices) const override;
 
     /*!
      * \brief nearestPoint
-     * \details starts search for nearest neighbor to given point with depth 0
+     * \details finds the exact nearest neighbor, same as KdTree::approximateNearestPoint with epsilon 0
      * \param point
-     * \return nearest neighbor of point
+     * \return nearest neighbor of point, 0 if the tree is empty
+     */
+    Vertex* nearestPoint(const QVector3D& point) const override;
+
+    /*!
+     * \brief k nearest neighbors
+     * \details finds the k points closest to a given point, sorted by ascending distance
+     * \param point query point
+     * \param k number of neighbors, fewer are returned if the tree holds less than k points
+     * \param indices offsets of the neighbors from m_vertexArrayPointer
+     * \param distances distances of the neighbors to point
+     */
+    void kNearest(const QVector3D& point, int k, std::vector<PointIndex>& indices, std::vector<float>& distances) const;
+
+    /*!
+     * \brief approximate nearest neighbor
+     * \details starts with the nearest point of the leaf reached by descending towards the query point, then searches
+     * neighboring cells that may hold a point closer by more than a factor of (1 + epsilon). With maxLeafVisits = 0
+     * the result is at most (1 + epsilon) times farther away than the exact nearest neighbor, a leaf budget trades
+     * this guarantee for a bounded query time
+     * \param point query point
+     * \param epsilon allowed relative distance error, 0 gives the exact nearest neighbor
+     * \param maxLeafVisits maximum number of leaves to scan, 0 for no limit
+     * \param nodesVisited if not 0, receives the number of visited tree nodes
+     * \return offset of the found point from m_vertexArrayPointer, -1 if the tree is empty
+     */
+    PointIndex approximateNearestPoint(const QVector3D& point, float epsilon, int maxLeafVisits = 0, int* nodesVisited = 0) const;
+
+    /*!
+     * \brief cloud to cloud distance
+     * \details computes the distance of every point of this tree to its nearest neighbor in reference with a dual tree
+     * traversal: pairs of nodes are visited together and a pair is skipped once the cells lie farther apart than the
+     * largest current nearest distance of the points in the query node. Independent query subtrees run in parallel
+     * \param reference tree of the cloud to compare with
+     * \param distances receives the distance of every vertex this tree was built from, -1 for removed vertices and if
+     * reference is empty
+     * \param parallel run on all OpenMP threads
+     * \return minimum clearance, directed Hausdorff distance and mean distance
+     */
+    DistanceStatistics distancesTo(const KdTree& reference, std::vector<float>& distances, bool parallel = true) const;
+
+    /*!
+     * \brief Hausdorff distance
+     * \details symmetric Hausdorff distance, the larger of both directed distances from KdTree::distancesTo
+     * \param first
+     * \param second
+     * \param parallel run on all OpenMP threads
+     * \return largest distance of a point of either cloud to the other cloud, 0 if one of the trees is empty
+     */
+    static float hausdorffDistance(const KdTree& first, const KdTree& second, bool parallel = true);
+
+    /*!
+     * \brief first point on a ray
+     * \details finds the point closest to the ray origin, measured along the ray, among all points within a cylinder of
+     * the given radius around the ray, e.g. the point under the mouse cursor. Subtrees are visited front to back and
+     * skipped once the ray enters their cell behind the current hit
+     * \param origin start of the ray, points behind it are ignored
+     * \param direction direction of the ray, does not need to be normalized
+     * \param radius radius of the cylinder around the ray
+     * \param rayDistance if not 0, receives the distance of the hit along the ray
+     * \return offset of the hit from m_vertexArrayPointer, -1 if no point is within the cylinder
+     */
+    PointIndex firstPointOnRay(const QVector3D& origin, const QVector3D& direction, const float radius, float* rayDistance = 0) const;
+
+    /*!
+     * \brief find all points on a ray
+     * \details finds all points within a cylinder around the ray like KdTree::firstPointOnRay
+     * \param origin start of the ray, points behind it are ignored
+     * \param direction direction of the ray, does not need to be normalized
+     * \param radius radius of the cylinder around the ray
+     * \param indices offsets of the hits from m_vertexArrayPointer, sorted by distance along the ray
+     */
+    void pointsOnRay(const QVector3D& origin, const QVector3D& direction, const float radius, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief find all points in a convex polytope
+     * \details the polytope is the intersection of half-spaces, a point p lies inside a plane (a, b, c, d) if
+     * a*p.x + b*p.y + c*p.z + d >= 0. Subtrees whose cell lies outside one of the planes are skipped, subtrees whose cell
+     * lies inside all of them are taken over without testing their points
+     * \param planes bounding planes of the polytope, normals pointing inwards
+     * \param indices offsets of points from m_vertexArrayPointer that have been found inside the polytope
+     */
+    void pointsInPolytope(const std::vector<QVector4D>& planes, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief find all points in a view frustum
+     * \details finds all points inside the frustum of a view projection matrix, i.e. all points that are projected
+     * into the clip volume, using KdTree::pointsInPolytope
+     * \param viewProjection projection matrix times modelview matrix
+     * \param indices offsets of points from m_vertexArrayPointer that have been found inside the frustum
+     */
+    void pointsInFrustum(const QMatrix4x4& viewProjection, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief visit all points in a sphere
+     * \details calls visit for every point within the sphere as soon as it is found, without collecting the points
+     * in a container first. Points are visited in tree order, not sorted by distance
+     * \param center center of the sphere
+     * \param distance radius of the sphere
+     * \param visit callable bool(PointIndex index, const QVector3D& position, float sqrDistance) receiving the offset
+     * of the point from m_vertexArrayPointer, its position and its squared distance to center - returning false
+     * stops the query
+     * \return false if visit stopped the query
+     */
+    template<typename Visitor>
+    bool visitPointsInSphere(const QVector3D& center, const float distance, Visitor visit) const;
+
+    /*!
+     * \brief visit all points in a box
+     * \details same as KdTree::visitPointsInSphere for the cuboid defined by min and max, the squared distance
+     * passed to visit is measured to the center of the cuboid
+     * \param min minimum xyz boundaries for search box
+     * \param max maximum xyz boundaries for search box
+     * \param visit callable bool(PointIndex index, const QVector3D& position, float sqrDistance)
+     * \return false if visit stopped the query
      */
-    Vertex* nearestPoint(QVector3D& point); //!<
+    template<typename Visitor>
+    bool visitPointsInBox(const QVector3D& min, const QVector3D& max, Visitor visit) const;
+
+    static const uint MAX_LEAF_SIZE = 64; //!< upper bound for KdTree::setLeafSize
+
+protected:
+    void appendPointsInSphere(const QVector3D& center, const float distance, std::vector<PointIndex>& indices) const override;
 
 private:
     /*!
      * \brief The KdTreeNode struct
-     * \details a single node of the KdTree
+     * \details a single node of the KdTree - nodes are stored in depth-first order in KdTree::m_nodes,
+     * so the left child of a node always directly follows its parent and only the right child has to be linked
      */
     struct KdTreeNode
     {
-        ~KdTreeNode() //!< destructor - calls child node destructors
-        {
-            delete leftChild;
-            delete rightChild;
-        }
-
         float median = 0; //!< median value for the KdTree split
+        qint32 axis = 0; //!< split axis, 0 for x, 1 for y and 2 for z
 
-        KdTreeNode* leftChild = 0; //!< pointer to left child node
-        KdTreeNode* rightChild = 0; //!< pointer to right child node
+        PointIndex rightChild = 0; //!< index of right child node in m_nodes, 0 for leaf nodes
 
-        Vertex* begin = 0;
-        Vertex* end = 0;
+        PointIndex begin = 0; //!< offset of first point of this node in the packed coordinate arrays
+        PointIndex end = 0; //!< offset behind last point of this node in the packed coordinate arrays
     };
 
     /*!
-     * \brief build KdTree
-     * \details recursively builds KdTree from vertex data
+     * \brief The CellBounds struct
+     * \details axis aligned box of a tree cell, each subtree stores the bounding box of its points as root cell
+     */
+    struct CellBounds
+    {
+        float lower[3]; //!< minimum coordinates
+        float upper[3]; //!< maximum coordinates
+    };
+
+    /*!
+     * \brief The Neighbor struct
+     * \details candidate of a k nearest neighbor search, ordered by distance so a std heap keeps the farthest on top
+     */
+    struct Neighbor
+    {
+        float sqrDistance; //!< squared distance to query point
+        PointIndex index; //!< offset of point in the packed coordinate arrays
+
+        bool operator<(const Neighbor& other) const { return sqrDistance < other.sqrDistance; }
+    };
+
+    /*!
+     * \brief The ApproximateSearch struct
+     * \details state of a KdTree::approximateNearestPoint query
+     */
+    struct ApproximateSearch
+    {
+        QVector3D point; //!< query point
+        float sqrErrorFactor; //!< (1 + epsilon)^2
+        int maxLeafVisits; //!< leaf budget, 0 for no limit
+
+        int leafVisits = 0; //!< number of scanned leaves
+        int nodesVisited = 0; //!< number of visited nodes
+        float nearestSqrDistance = std::numeric_limits<float>::max(); //!< squared distance of current nearest point
+        PointIndex nearest = -1; //!< offset of current nearest point in the packed coordinate arrays, -1 if none found yet
+    };
+
+    /*!
+     * \brief The DualTreeSearch struct
+     * \details state of a KdTree::distancesTo traversal
+     */
+    struct DualTreeSearch
+    {
+        const KdTree* reference; //!< tree the nearest neighbors are searched in
+        std::vector<float> nodeBounds; //!< largest squared nearest distance of the points of every query node
+        std::vector<float> sqrDistances; //!< squared nearest distance of every query point in tree order
+    };
+
+    /*!
+     * \brief The BuildPoint struct
+     * \details point record the tree is built on before its coordinates are split into the packed arrays
+     */
+    struct BuildPoint
+    {
+        QVector3D position; //!< point position
+        PointIndex index; //!< offset of point from m_vertexArrayPointer
+    };
+
+    /*!
+     * \brief The FileHeader struct
+     * \details header of files written by KdTree::save, the arrays follow at the given byte offsets
+     */
+    struct FileHeader
+    {
+        char magic[8]; //!< file type identifier, FILE_MAGIC
+        quint32 version; //!< file format version, FILE_VERSION
+        quint32 leafSize; //!< leaf size the tree was built with
+        quint32 nodeSize; //!< size of KdTreeNode, detects files of incompatible builds
+        quint32 vertexSize; //!< size of Vertex, detects files of incompatible builds
+        quint32 splitPolicy; //!< SplitPolicy the tree was built with
+        quint32 vertexOrdering; //!< VertexOrdering of the stored vertices, keeps the following fields 8 byte aligned
+
+        qint64 numNodes; //!< number of nodes
+        qint64 numRoots; //!< number of subtrees
+        qint64 numPoints; //!< number of points in the tree
+        qint64 numVertices; //!< number of vertices
+        qint64 numVertexOrder; //!< number of original vertex offsets, either 0 or numVertices
+
+        qint64 nodeOffset; //!< offset of the node array
+        qint64 rootOffset; //!< offset of the subtree root array
+        qint64 rootBoundsOffset; //!< offset of the subtree bounding boxes
+        qint64 xOffset; //!< offset of the packed x coordinates
+        qint64 yOffset; //!< offset of the packed y coordinates
+        qint64 zOffset; //!< offset of the packed z coordinates
+        qint64 indexOffset; //!< offset of the point offsets in tree order
+        qint64 vertexOffset; //!< offset of the vertex array
+        qint64 vertexOrderOffset; //!< offset of the original vertex offsets
+    };
+
+    /*!
+     * \brief detach from mapped file
+     * \details copies all arrays mapped by KdTree::load into owned memory and releases the file,
+     * must be called before the tree is modified
+     */
+    void detach();
+
+    /*!
+     * \brief check tree file contents
+     * \details checks that node ranges, child links, split axes and subtree roots stay inside the node and point arrays
+     * and that the point offsets address stored vertices, so queries on a corrupt file cannot read out of bounds.
+     * Child links always point forward, which also rules out cycles
+     * \param header header of the file, its sections have been checked to lie within the file
+     * \param memory mapped file
+     * \return true if the tree can be used
+     */
+    static bool isValidTree(const FileHeader& header, const uchar* memory);
+
+    /*!
+     * \brief build subtree
+     * \details builds a static subtree from the points in m_buildPoints and appends it to the node and packed
+     * coordinate arrays
+     * \param parallel build on all OpenMP threads
+     */
+    void buildSubtree(bool parallel);
+
+    /*!
+     * \brief collect points of a subtree
+     * \details appends all points of the trailing subtrees starting with m_roots[first] that have not been removed
+     * to m_buildPoints and deletes these subtrees
+     * \param first index in m_roots
+     */
+    void collectSubtrees(uint first);
+
+    /*!
+     * \brief split node
+     * \details partitions the points of range [begin, end) at their median along Axis and writes the node to m_nodes[nodeIndex]
+     * \param begin
+     * \param end
+     * \param nodeIndex
+     * \param parallelPartition use all OpenMP threads for the partitioning
+     * \return offset of the median from begin, i.e. the number of points in the left subtree
+     */
+    template<int Axis>
+    PointIndex splitNode(PointIndex begin, PointIndex end, PointIndex nodeIndex, bool parallelPartition);
+
+    /*!
+     * \brief build unbalanced KdTree
+     * \details recursively builds the subtree for range [begin, end) with a split policy other than MedianSplit.
+     * The number of nodes is not known in advance, so nodes are appended and the right child is linked once the left
+     * subtree is complete. If tasks is set, right subtrees with more than TASK_CUTOFF points are built as OpenMP tasks
+     * into arrays of their own and appended afterwards
+     * \param begin
+     * \param end
+     * \param cell bounds of the cell of the subtree
+     * \param nodes the nodes of the subtree are appended here, child indices are relative to the start of nodes
+     * \param tasks
+     */
+    void buildUnbalanced(PointIndex begin, PointIndex end, CellBounds cell, std::vector<KdTreeNode>& nodes, bool tasks);
+
+    /*!
+     * \brief sliding midpoint split
+     * \details partitions the points of range [begin, end) at the middle of the longest side of their cell. If all points
+     * fall on one side, the plane slides to the nearest point, which then forms the other side. If all points share the
+     * coordinate along the split axis, they are split in halves instead, which keeps duplicate points from degenerating the tree
      * \param begin
      * \param end
-     * \param depth
-     * \return root node
+     * \param cell
+     * \param axis receives the split axis
+     * \param median receives the split value
+     * \return number of points in the left subtree
+     */
+    PointIndex splitSlidingMidpoint(PointIndex begin, PointIndex end, const CellBounds& cell, int& axis, float& median);
+
+    /*!
+     * \brief largest extent split
+     * \details partitions the points of range [begin, end) at their median along the axis of their largest extent
+     * \param begin
+     * \param end
+     * \param axis receives the split axis
+     * \param median receives the split value
+     * \return number of points in the left subtree
+     */
+    PointIndex splitLargestExtent(PointIndex begin, PointIndex end, int& axis, float& median);
+
+    /*!
+     * \brief split axis of a node
+     * \details traversals take the split axis as template argument. With MedianSplit the axis cycles through x, y and z
+     * and is known at compile time, the other policies only store it in the nodes, which NODE_AXIS selects
+     * \param node
+     * \return axis to compare the node median with
+     */
+    template<int Axis>
+    static int splitAxis(const KdTreeNode& node) { return Axis == NODE_AXIS ? node.axis : Axis; }
+
+    /*!
+     * \brief axis of the children
+     * \param axis template argument of a traversal step
+     * \return template argument for the children
+     */
+    static constexpr int nextAxis(int axis) { return axis == NODE_AXIS ? NODE_AXIS : (axis + 1) % 3; }
+
+    /*!
+     * \brief traverse with the axis of the root nodes
+     * \details calls traversal with std::integral_constant<int, 0> for trees built with MedianSplit and with
+     * std::integral_constant<int, NODE_AXIS> otherwise, so one call site instantiates both kinds of traversal
+     * \param traversal generic callable starting a traversal with the axis given as type
+     * \return result of traversal
+     */
+    template<typename Traversal>
+    auto withRootAxis(Traversal traversal) const
+    {
+        if(m_splitPolicy == MedianSplit) return traversal( std::integral_constant<int, 0>() );
+        return traversal( std::integral_constant<int, NODE_AXIS>() );
+    }
+
+    /*!
+     * \brief record query
+     * \details counts a query if query statistics are collected
+     */
+    void recordQuery() const
+    {
+        if( !m_isCollectingStatistics ) return;
+        #pragma omp atomic
+        ++m_queryStatistics.queries;
+    }
+
+    /*!
+     * \brief record node
+     * \details counts a visited node if query statistics are collected
      */
-    KdTreeNode* buildKdTree(Vertex* begin, Vertex* end, unsigned int depth);
+    void recordNode() const
+    {
+        if( !m_isCollectingStatistics ) return;
+        #pragma omp atomic
+        ++m_queryStatistics.nodesVisited;
+    }
+
+    /*!
+     * \brief record leaf
+     * \details counts the points of a scanned leaf if query statistics are collected
+     * \param node leaf node
+     */
+    void recordLeaf(const KdTreeNode& node) const
+    {
+        if( !m_isCollectingStatistics ) return;
+        #pragma omp atomic
+        m_queryStatistics.pointsTested += node.end - node.begin;
+    }
 
     /*!
      * \brief range query
      * \details recursively find points within cuboid defined by min and max points
      * \param min
      * \param max
+     * \param node index of current node in m_nodes, split along Axis
+     * \param scanLeaf function called with every leaf node that intersects the cuboid, returns false to stop the query
+     * \return false if scanLeaf stopped the query
+     */
+    template<int Axis, typename LeafScan>
+    bool rangeQuery(const QVector3D& min, const QVector3D& max, PointIndex node, LeafScan& scanLeaf) const;
+
+    /*!
+     * \brief sphere query
+     * \details recursively find points within a sphere - subtrees are pruned by the distance between the
+     * sphere center and their cell, which is tracked incrementally along the traversal
+     * \param center
+     * \param sqrDistance squared radius of the sphere
+     * \param node index of current node in m_nodes, split along Axis
+     * \param cellSqrDistance squared distance from center to the cell of node
+     * \param cellOffsets distance from center to the cell of node along each axis
+     * \param scanLeaf function called with every leaf node that intersects the sphere, returns false to stop the query
+     * \return false if scanLeaf stopped the query
+     */
+    template<int Axis, typename LeafScan>
+    bool sphereQuery(const QVector3D& center, const float sqrDistance, PointIndex node,
+                     float cellSqrDistance, float* cellOffsets, LeafScan& scanLeaf) const;
+
+    /*!
+     * \brief box test for a leaf bucket
+     * \details tests all points of a leaf against the cuboid at once using the packed coordinate arrays
+     * \param node leaf node
+     * \param min
+     * \param max
+     * \param indices offsets of points inside the cuboid are appended here
+     */
+    void scanLeafBox(const KdTreeNode& node, const QVector3D& min, const QVector3D& max, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief sphere test for a leaf bucket
+     * \details tests all points of a leaf against the sphere at once using the packed coordinate arrays
+     * \param node leaf node
+     * \param center
+     * \param sqrDistance squared radius of the sphere
+     * \param indices offsets of points inside the sphere are appended here
+     */
+    void scanLeafSphere(const KdTreeNode& node, const QVector3D& center, const float sqrDistance, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief append leaf hits
+     * \details appends the offsets of all points of a leaf flagged in inside, skipping removed points
+     * \param node leaf node
+     * \param inside one flag per point of the leaf
      * \param indices
+     */
+    void appendLeafHits(const KdTreeNode& node, const int* inside, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief count query
+     * \details recursively counts the points in a query region, tracking the cell of the current node
+     * \param node index of current node in m_nodes, split along Axis
+     * \param cell bounds of the cell of node, restored before returning
+     * \param isDisjoint returns true if the cell given by lower and upper corner does not touch the region
+     * \param isContained returns true if the cell given by lower and upper corner is completely inside the region
+     * \param countLeaf counts the points of a leaf inside the region
+     * \return number of points of the subtree inside the region
+     */
+    template<int Axis, typename DisjointTest, typename ContainedTest, typename LeafCount>
+    PointIndex countQuery(PointIndex node, CellBounds& cell,
+                          DisjointTest& isDisjoint, ContainedTest& isContained, LeafCount& countLeaf) const;
+
+    /*!
+     * \brief cell query
+     * \details recursively visits the nodes of a subtree together with their cells
+     * \param node index of current node in m_nodes, split along Axis
+     * \param cell bounds of the cell of node, restored before returning
+     * \param nearPoint of the two children of a node, the one on the side of nearPoint is visited first
+     * \param visitNode called with every visited node and its cell, returns true if the children should be visited as well
+     */
+    template<int Axis, typename NodeVisitor>
+    void cellQuery(PointIndex node, CellBounds& cell, const QVector3D& nearPoint, NodeVisitor& visitNode) const;
+
+    /*!
+     * \brief append subtree
+     * \details appends the offsets of all points of a subtree, skipping removed points
      * \param node
-     * \param depth
+     * \param indices
+     */
+    void appendSubtree(const KdTreeNode& node, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief ray entry distance
+     * \details clips a ray against a cell grown by radius along all axes, which contains every point within radius of
+     * the cell. A ray that passes a point of the cell at a distance of at most radius hence enters the grown cell first
+     * \param cell
+     * \param origin
+     * \param direction normalized ray direction
+     * \param radius
+     * \return distance along the ray where it enters the grown cell, 0 if origin lies inside and infinity if the ray misses it
+     */
+    static float rayEntryDistance(const CellBounds& cell, const QVector3D& origin, const QVector3D& direction, const float radius);
+
+    /*!
+     * \brief ray test for a leaf bucket
+     * \details tests all points of a leaf against the cylinder around a ray at once using the packed coordinate arrays
+     * \param node leaf node
+     * \param origin
+     * \param direction normalized ray direction
+     * \param sqrRadius squared radius of the cylinder
+     * \param rayDistances receives the distance along the ray of every point within the cylinder, infinity for all other
+     * points and removed points
+     */
+    void leafRayDistances(const KdTreeNode& node, const QVector3D& origin, const QVector3D& direction, const float sqrRadius, float* rayDistances) const;
+
+    /*!
+     * \brief polytope test for a leaf bucket
+     * \details tests all points of a leaf against the half-spaces of a convex polytope using the packed coordinate arrays
+     * \param node leaf node
+     * \param planes
+     * \param indices offsets of points inside the polytope are appended here
      */
-    void rangeQuery(const QVector3D& min, const QVector3D& max, QVector<int>& indices, KdTreeNode* node, const uint depth);
+    void scanLeafPolytope(const KdTreeNode& node, const std::vector<QVector4D>& planes, std::vector<PointIndex>& indices) const;
 
-    // FIXME: finish implementation
-    Vertex* nearestPointApprox(const QVector3D& point, KdTreeNode* node, uint depth);
-    //Vertex* nearestPoint(const QVector3D& point, QVector3D& approx,  KdTreeNode* node, uint depth);
     /*!
-     * \brief nearest point
-     * \details recursively find nearest neighbor to given point
+     * \brief number of points of a subtree
+     * \details the size of the point range of the node, minus the removed points counted for it in m_removedInNode
+     * \param nodeIndex index of the node in m_nodes
+     */
+    PointIndex subtreeCount(PointIndex nodeIndex) const
+    {
+        const KdTreeNode& node = m_nodes[nodeIndex];
+        return node.end - node.begin - (m_numRemoved == 0 ? 0 : m_removedInNode[nodeIndex]);
+    }
+
+    /*!
+     * \brief count removed point
+     * \details increments the removed point count of all nodes on the path from the subtree root down to the leaf that
+     * holds the point, creating the counts and the tree offsets of all vertices with the first removed point
+     * \param index offset of the point from m_vertexArrayPointer
+     */
+    void countRemoved(PointIndex index);
+
+    /*!
+     * \brief update removal bookkeeping
+     * \details drops m_removedInNode and m_treeOffsets once no removed point is left in the tree, otherwise extends
+     * them to the nodes and points of the last subtree built
+     * \param firstPoint offset of the first point of the last subtree in the packed coordinate arrays
+     */
+    void updateRemovedCounts(PointIndex firstPoint);
+
+    /*!
+     * \brief count sphere hits of a leaf bucket
+     * \param node leaf node
+     * \param center
+     * \param sqrDistance squared radius of the sphere
+     * \return number of points of the leaf inside the sphere, not counting removed ones
+     */
+    PointIndex countLeafSphere(const KdTreeNode& node, const QVector3D& center, const float sqrDistance) const;
+
+    /*!
+     * \brief count box hits of a leaf bucket
+     * \param node leaf node
+     * \param min
+     * \param max
+     * \return number of points of the leaf inside the cuboid, not counting removed ones
+     */
+    PointIndex countLeafBox(const KdTreeNode& node, const QVector3D& min, const QVector3D& max) const;
+
+    /*!
+     * \brief squared distances for a leaf bucket
+     * \details computes the squared distances of all points of a leaf to a point at once, removed points get
+     * the largest float value so they are never picked as neighbors
+     * \param node leaf node
      * \param point
-     * \param node
-     * \param dist distance to current neighbor
-     * \param np current nearest point
-     * \param depth current search depth
+     * \param sqrDistances one entry per point of the leaf
      */
-    void nearestPoint(const QVector3D& point, KdTreeNode* node, double& dist, Vertex *np, int depth);
+    void leafSqrDistances(const KdTreeNode& node, const QVector3D& point, float* sqrDistances) const;
+
+    /*!
+     * \brief approximate nearest point with error bound
+     * \details recursive part of KdTree::approximateNearestPoint - visits the child containing the point first,
+     * the other child only if its cell is closer than the current nearest distance divided by (1 + epsilon)
+     * \param search search state
+     * \param node index of current node in m_nodes, split along Axis
+     * \param cellSqrDistance squared distance from the query point to the cell of node
+     * \param cellOffsets distance from the query point to the cell of node along each axis
+     */
+    template<int Axis>
+    void nearestPointApprox(ApproximateSearch& search, PointIndex node, float cellSqrDistance, float* cellOffsets) const;
+
+    /*!
+     * \brief dual tree nearest neighbors
+     * \details recursive part of KdTree::distancesTo - descends the query tree down to its leaves first, then walks
+     * the reference tree with the child closer to the query cell first, so the bounds of a query leaf shrink early.
+     * Each query leaf hence runs one shared traversal for all its points instead of one per point
+     * \param search search state
+     * \param queryNode index of a node in m_nodes
+     * \param queryCell cell of queryNode
+     * \param referenceNode index of a node of the reference tree
+     * \param referenceCell cell of referenceNode
+     */
+    void dualTreeNearest(DualTreeSearch& search, PointIndex queryNode, const CellBounds& queryCell,
+                         PointIndex referenceNode, const CellBounds& referenceCell) const;
+
+    /*!
+     * \brief dual tree base case
+     * \details updates the nearest distances of all points of a query leaf with the points of a reference leaf
+     * \param search
+     * \param queryLeaf
+     * \param referenceLeaf
+     * \param referenceCell cell of referenceLeaf
+     * \return largest nearest distance of the points in queryLeaf
+     */
+    float dualTreeLeaves(DualTreeSearch& search, const KdTreeNode& queryLeaf, const KdTreeNode& referenceLeaf,
+                         const CellBounds& referenceCell) const;
+
+    /*!
+     * \brief children cells
+     * \param node inner node
+     * \param cell cell of node
+     * \param left receives the cell of the left child
+     * \param right receives the cell of the right child
+     */
+    static void splitCell(const KdTreeNode& node, const CellBounds& cell, CellBounds& left, CellBounds& right);
+
+    /*!
+     * \brief squared distance between cells
+     * \return squared distance between the closest points of two cells, 0 if they overlap
+     */
+    static float cellSqrDistance(const CellBounds& first, const CellBounds& second);
+
+    /*!
+     * \brief k nearest neighbors
+     * \details recursively collects the k nearest neighbors of a point in a bounded max heap, subtrees are skipped
+     * once the heap is full and the split plane is farther away than the current k-th neighbor
+     * \param point
+     * \param k
+     * \param node index of current node in m_nodes, split along Axis
+     * \param heap current candidates, holding at most k entries
+     */
+    template<int Axis>
+    void kNearest(const QVector3D& point, uint k, PointIndex node, std::vector<Neighbor>& heap) const;
+
+    static const uint TASK_CUTOFF = 1 << 14; //!< subtrees with fewer points are built serially
+    static const int NODE_AXIS = 3; //!< axis template argument of traversals that read the split axis from the nodes
+    static const char FILE_MAGIC[8]; //!< identifies files written by KdTree::save
+    static const quint32 FILE_VERSION = 5; //!< current file format version
+    static const qint64 FILE_ALIGNMENT = 64; //!< alignment of the arrays in files written by KdTree::save
+
+    MappableArray<KdTreeNode> m_nodes; //!< flat node array holding all subtrees one after another
+    std::vector<PointIndex> m_roots; //!< root node index of every static subtree, in the order of m_nodes
+    std::vector<CellBounds> m_rootBounds; //!< bounding box of the points of every static subtree
+
+    MappableArray<float> m_x; //!< packed x coordinates of all points in tree order
+    MappableArray<float> m_y; //!< packed y coordinates of all points in tree order
+    MappableArray<float> m_z; //!< packed z coordinates of all points in tree order
+    MappableArray<PointIndex> m_indices; //!< offsets of all points from m_vertexArrayPointer in tree order
+
+    std::shared_ptr<QFile> m_mappedFile; //!< file the arrays are mapped from by KdTree::load, 0 if they are owned
+
+    std::vector<bool> m_removed; //!< removal flag for every offset from m_vertexArrayPointer
+    PointIndex m_numRemoved = 0; //!< number of removed points that are still stored in the tree
+    std::vector<PointIndex> m_removedInNode; //!< number of removed points below every node, empty while m_numRemoved is 0
+    std::vector<PointIndex> m_treeOffsets; //!< offset of every vertex in the packed coordinate arrays, empty while m_numRemoved is 0
+
+    std::vector<BuildPoint> m_buildPoints; //!< point records while building, empty otherwise
+
+    uint m_leafSize = 16; //!< maximum number of points per leaf
+    SplitPolicy m_splitPolicy = MedianSplit; //!< split policy of the current tree
+    SplitPolicy m_requestedSplitPolicy = MedianSplit; //!< split policy set with KdTree::setSplitPolicy
+
+    bool m_isCollectingStatistics = false; //!< true while queries count their work
+    mutable QueryStatistics m_queryStatistics; //!< work done by queries, updated atomically
 
-    KdTreeNode* m_tree = 0; //!< pointer to root node
     Vertex* m_vertexArrayPointer = 0; //!< pointer to point data
 };
+
+template<typename Visitor>
+bool KdTree::visitPointsInSphere(const QVector3D& center, const float distance, Visitor visit) const
+{
+    recordQuery();
+    const float sqrDistance = distance * distance;
+    auto visitLeaf = [&](const KdTreeNode& leaf)
+    {
+        // distances are computed for the whole bucket at once, removed points are farther away than any radius
+        float sqrDistances[MAX_LEAF_SIZE];
+        leafSqrDistances(leaf, center, sqrDistances);
+
+        for(PointIndex i = leaf.begin; i < leaf.end; ++i)
+        {
+            const float pointSqrDistance = sqrDistances[i - leaf.begin];
+            if(pointSqrDistance > sqrDistance || pointSqrDistance == std::numeric_limits<float>::max()) continue;
+            if( !visit(m_indices[i], QVector3D(m_x[i], m_y[i], m_z[i]), pointSqrDistance) ) return false;
+        }
+        return true;
+    };
+
+    for(PointIndex root : m_roots)
+    {
+        float cellOffsets[3] = {0, 0, 0};
+        const bool continueQuery = withRootAxis([&](auto axis)
+        {
+            return sphereQuery<decltype(axis)::value>(center, sqrDistance, root, 0, cellOffsets, visitLeaf);
+        });
+        if( !continueQuery ) return false;
+    }
+    return true;
+}
+
+template<typename Visitor>
+bool KdTree::visitPointsInBox(const QVector3D& min, const QVector3D& max, Visitor visit) const
+{
+    recordQuery();
+    const QVector3D center = (min + max) / 2;
+    auto visitLeaf = [&](const KdTreeNode& leaf)
+    {
+        for(PointIndex i = leaf.begin; i < leaf.end; ++i)
+        {
+            const QVector3D position(m_x[i], m_y[i], m_z[i]);
+            if( !inRange(position, min, max) || (m_numRemoved > 0 && m_removed[ m_indices[i] ]) ) continue;
+            if( !visit(m_indices[i], position, (position - center).lengthSquared()) ) return false;
+        }
+        return true;
+    };
+
+    for(PointIndex root : m_roots)
+    {
+        const bool continueQuery = withRootAxis([&](auto axis) { return rangeQuery<decltype(axis)::value>(min, max, root, visitLeaf); });
+        if( !continueQuery ) return false;
+    }
+    return true;
+}
+
+template<int Axis, typename LeafScan>
+bool KdTree::rangeQuery(const QVector3D& min, const QVector3D& max, PointIndex nodeIndex, LeafScan& scanLeaf) const
+{
+    const KdTreeNode& node = m_nodes[nodeIndex];
+    recordNode();
+
+    if(node.rightChild == 0)
+    {
+        recordLeaf(node);
+        return scanLeaf(node);
+    }
+
+    // points equal to the median may end up in both halves, hence both comparisons include it
+    const int axis = splitAxis<Axis>(node);
+    if(min[axis] <= node.median && !rangeQuery<nextAxis(Axis)>(min, max, nodeIndex + 1, scanLeaf)) return false;
+    if(max[axis] >= node.median && !rangeQuery<nextAxis(Axis)>(min, max, node.rightChild, scanLeaf)) return false;
+    return true;
+}
+
+template<int Axis, typename LeafScan>
+bool KdTree::sphereQuery(const QVector3D& center, const float sqrDistance, PointIndex nodeIndex,
+                         float cellSqrDistance, float* cellOffsets, LeafScan& scanLeaf) const
+{
+    const KdTreeNode& node = m_nodes[nodeIndex];
+    recordNode();
+
+    if(node.rightChild == 0)
+    {
+        recordLeaf(node);
+        return scanLeaf(node);
+    }
+
+    // left points are <= median and right points >= median, so the split plane bounds the far child
+    const int axis = splitAxis<Axis>(node);
+    const float planeDistance = center[axis] - node.median;
+    const PointIndex nearChild = planeDistance <= 0 ? nodeIndex + 1 : node.rightChild;
+    const PointIndex farChild = planeDistance <= 0 ? node.rightChild : nodeIndex + 1;
+
+    if( !sphereQuery<nextAxis(Axis)>(center, sqrDistance, nearChild, cellSqrDistance, cellOffsets, scanLeaf) ) return false;
+
+    // the far cell only differs from the current one along the split axis, so its distance is updated incrementally
+    const float oldOffset = cellOffsets[axis];
+    const float farSqrDistance = cellSqrDistance - oldOffset * oldOffset + planeDistance * planeDistance;
+    if(farSqrDistance <= sqrDistance)
+    {
+        cellOffsets[axis] = planeDistance;
+        const bool continueQuery = sphereQuery<nextAxis(Axis)>(center, sqrDistance, farChild, farSqrDistance, cellOffsets, scanLeaf);
+        cellOffsets[axis] = oldOffset;
+        return continueQuery;
+    }
+    return true;
+}
+
 #endif // KDTREE_H
@@ -0,0 +1,175 @@
+#ifndef KDTREEBUILD_H
+#define KDTREEBUILD_H
+
+#include <QtGlobal>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <omp.h>
+#include "vertex.h"
+
+#if defined(__GLIBCXX__) && defined(_OPENMP)
+#include <parallel/algorithm>
+#endif
+
+/*!
+ * \brief sort
+ * \details std::sort, optionally using the OpenMP based implementation of libstdc++ parallel mode
+ */
+template<typename Iterator>
+inline void sortElements(Iterator first, Iterator last, bool parallel)
+{
+#if defined(__GLIBCXX__) && defined(_OPENMP)
+    if(parallel)
+    {
+        __gnu_parallel::sort(first, last);
+        return;
+    }
+#else
+    Q_UNUSED(parallel);
+#endif
+    std::sort(first, last);
+}
+
+/*!
+ * \brief nth element selection
+ * \details std::nth_element, optionally using the OpenMP based implementation of libstdc++ parallel mode
+ */
+template<typename Iterator, typename Compare>
+inline void nthElement(Iterator first, Iterator nth, Iterator last, Compare compare, bool parallel)
+{
+#if defined(__GLIBCXX__) && defined(_OPENMP)
+    if(parallel)
+    {
+        __gnu_parallel::nth_element(first, nth, last, compare);
+        return;
+    }
+#else
+    Q_UNUSED(parallel);
+#endif
+    std::nth_element(first, nth, last, compare);
+}
+
+/*!
+ * \brief The KdSubtree struct
+ * \details point range and root node of a subtree of a median split tree that is still to be built
+ */
+struct KdSubtree
+{
+    PointIndex begin; //!< offset of the first point in the build point array
+    PointIndex end; //!< offset behind the last point in the build point array
+    PointIndex nodeIndex; //!< index of the subtree root in the node array
+};
+
+/*!
+ * \brief number of nodes of a median split subtree
+ * \details sizes of sibling subtrees differ by at most one, so the counts for numPoints and numPoints + 1
+ * are determined together, which takes logarithmic time
+ * \param numPoints number of points in the subtree
+ * \param leafSize maximum number of points per leaf
+ * \param count number of nodes of a subtree holding numPoints points
+ * \param countNext number of nodes of a subtree holding numPoints + 1 points
+ */
+inline void kdNodeCount(PointIndex numPoints, PointIndex leafSize, PointIndex& count, PointIndex& countNext)
+{
+    if(numPoints + 1 <= leafSize)
+    {
+        count = countNext = 1;
+        return;
+    }
+
+    // counts for the children numPoints/2 and numPoints/2 + 1
+    PointIndex half, halfNext;
+    kdNodeCount(numPoints/2, leafSize, half, halfNext);
+
+    if(numPoints % 2 == 0)
+    {
+        count = 1 + 2 * half;
+        countNext = 1 + half + halfNext;
+    }
+    else
+    {
+        count = 1 + half + halfNext;
+        countNext = 1 + 2 * halfNext;
+    }
+    if(numPoints <= leafSize) count = 1;
+}
+
+inline PointIndex kdNodeCount(PointIndex numPoints, PointIndex leafSize)
+{
+    if(numPoints == 0) return 0;
+
+    PointIndex count, countNext;
+    kdNodeCount(numPoints, leafSize, count, countNext);
+    return count;
+}
+
+/*!
+ * \brief build median split subtree
+ * \details recursively splits a subtree whose left child directly follows its parent, the split axis cycles through
+ * Dim axes. The tree only provides the split of a single node: split(axis, subtree, parallelPartition, rightChild) is
+ * called with axis of type std::integral_constant<int, Axis>, writes the node, sets rightChild to the index of its
+ * right child or 0 for a leaf and returns the number of points in the left subtree
+ * \param subtree
+ * \param split
+ * \param taskCutoff subtrees with fewer points are built serially
+ * \param tasks spawn an OpenMP task for every left subtree larger than taskCutoff
+ */
+template<int Axis, int Dim, typename Split>
+void buildKdSubtree(const KdSubtree& subtree, Split split, PointIndex taskCutoff, bool tasks)
+{
+    PointIndex rightChild = 0;
+    const PointIndex centerPos = split(std::integral_constant<int, Axis>(), subtree, false, rightChild);
+    if(rightChild == 0) return;
+
+    const KdSubtree left{subtree.begin, subtree.begin + centerPos, subtree.nodeIndex + 1};
+    const KdSubtree right{subtree.begin + centerPos, subtree.end, rightChild};
+
+    if(tasks && subtree.end - subtree.begin > taskCutoff)
+    {
+        #pragma omp task
+        buildKdSubtree<(Axis + 1) % Dim, Dim>(left, split, taskCutoff, true);
+    }
+    else buildKdSubtree<(Axis + 1) % Dim, Dim>(left, split, taskCutoff, tasks);
+    buildKdSubtree<(Axis + 1) % Dim, Dim>(right, split, taskCutoff, tasks);
+}
+
+/*!
+ * \brief build median split subtrees in parallel
+ * \details near the root there are too few subtrees to keep all cores busy, so the upper levels are split one after
+ * another, each with a partition step that itself runs on all threads. The remaining subtrees are independent and
+ * cover disjoint point and node ranges, they are built as OpenMP tasks, see buildKdSubtree
+ * \param subtrees subtrees of the current level, all split along Axis
+ * \param split see buildKdSubtree
+ * \param taskCutoff subtrees with fewer points are built serially
+ */
+template<int Axis, int Dim, typename Split>
+void buildKdSubtreesParallel(const std::vector<KdSubtree>& subtrees, Split split, PointIndex taskCutoff)
+{
+    const uint numThreads = omp_get_max_threads();
+    if( subtrees.size() < numThreads && subtrees.front().end - subtrees.front().begin > taskCutoff )
+    {
+        std::vector<KdSubtree> children;
+        for(const KdSubtree& s : subtrees)
+        {
+            PointIndex rightChild = 0;
+            const PointIndex centerPos = split(std::integral_constant<int, Axis>(), s, true, rightChild);
+            children.push_back( {s.begin, s.begin + centerPos, s.nodeIndex + 1} );
+            children.push_back( {s.begin + centerPos, s.end, rightChild} );
+        }
+        buildKdSubtreesParallel<(Axis + 1) % Dim, Dim>(children, split, taskCutoff);
+        return;
+    }
+
+    #pragma omp parallel
+    #pragma omp single
+    for(size_t i = 0; i < subtrees.size(); ++i)
+    {
+        const KdSubtree s = subtrees[i];
+
+        #pragma omp task
+        buildKdSubtree<Axis, Dim>(s, split, taskCutoff, true);
+    }
+}
+
+#endif // KDTREEBUILD_H
@@ -0,0 +1,520 @@
+#ifndef KDTREEND_H
+#define KDTREEND_H
+
+#include <QVector3D>
+#include <QtGlobal>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <omp.h>
+#include "vertex.h"
+#include "kdtreebuild.h"
+
+/*!
+ * \brief accessor for 2D and 3D queries
+ * \details maps a vertex to its position, a tree with two dimensions only uses x and y, e.g. for height maps and slices
+ */
+struct VertexPositionAccessor
+{
+    typedef Vertex Point;
+    float operator()(const Vertex& vertex, int axis) const { return vertex.position[axis]; }
+};
+
+/*!
+ * \brief accessor for 6D feature queries
+ * \details maps a vertex to its position followed by its normal vector. The normal is scaled by a weight, which sets
+ * how far apart in space two points may be to still count as close as two points with normals differing by one
+ */
+struct VertexPositionNormalAccessor
+{
+    typedef Vertex Point;
+    explicit VertexPositionNormalAccessor(float normalWeight = 1): normalWeight(normalWeight) {}
+    float operator()(const Vertex& vertex, int axis) const
+    {
+        return axis < 3 ? vertex.position[axis] : normalWeight * vertex.normal[axis - 3];
+    }
+    float normalWeight; //!< scale of the normal components
+};
+
+/*!
+ * \brief The KdTreeND class
+ * \details static KdTree over points of any dimension. The Accessor maps a point to its coordinates, it is a
+ * functor with a typedef Point and an operator()(const Point& point, int axis) returning coordinate axis of point.
+ * The split axis cycles through all dimensions and is a template parameter of every traversal step, so there is no
+ * branching on the axis at runtime. Like KdTree, the tree stores packed coordinates in tree order with leaf buckets
+ * of up to MAX_LEAF_SIZE points that are tested at once, and query results are offsets of points in the array passed
+ * to KdTreeND::build. Unlike KdTree, the tree can not be changed after building.
+ * All const member functions are thread-safe.
+ * \tparam Dim number of dimensions
+ * \tparam Scalar coordinate type, float or double
+ * \tparam Accessor maps points to coordinates
+ */
+template<int Dim, typename Scalar = float, typename Accessor = VertexPositionAccessor>
+class KdTreeND
+{
+public:
+    typedef typename Accessor::Point Point; //!< type of the points the tree is built from
+    typedef std::array<Scalar, Dim> Coordinates; //!< coordinates of a point or query location
+
+    /*!
+     * \brief constructor
+     * \details the tree must be built with KdTreeND::build
+     * \param accessor maps points to coordinates
+     */
+    explicit KdTreeND(const Accessor& accessor = Accessor()): m_accessor(accessor) {}
+
+    /*!
+     * \brief build KdTree
+     * \details deletes current tree, copies the coordinates of all points and builds a new tree from them
+     * \param points point data, query results are offsets in this array
+     * \param parallel build the tree on all OpenMP threads
+     */
+    void build(const std::vector<Point>& points, bool parallel = false);
+
+    /*!
+     * \brief set leaf size
+     * \details maximum number of points per leaf, takes effect with the next call of KdTreeND::build
+     * \param leafSize clamped to [1, MAX_LEAF_SIZE]
+     */
+    void setLeafSize(uint leafSize) { m_leafSize = std::max(1u, std::min(leafSize, MAX_LEAF_SIZE)); }
+    uint leafSize() const { return m_leafSize; }
+
+    /*!
+     * \brief number of points
+     * \return number of points in the tree
+     */
+    PointIndex size() const { return m_indices.size(); }
+
+    /*!
+     * \brief coordinates of a point
+     * \param point
+     * \return coordinates of point as given by the accessor
+     */
+    Coordinates coordinates(const Point& point) const;
+
+    /*!
+     * \brief find all points in a box
+     * \param min minimum boundaries for search box
+     * \param max maximum boundaries for search box
+     * \param indices offsets of points that have been found inside the box
+     */
+    void pointsInBox(const Coordinates& min, const Coordinates& max, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief find all points in a sphere
+     * \param center center of the sphere
+     * \param distance radius of the sphere
+     * \param indices offsets of points that have been found inside the sphere
+     */
+    void pointsInSphere(const Coordinates& center, const Scalar distance, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief nearest point
+     * \param point
+     * \return offset of the nearest neighbor of point, -1 if the tree is empty
+     */
+    PointIndex nearestPoint(const Coordinates& point) const;
+
+    /*!
+     * \brief k nearest neighbors
+     * \param point
+     * \param k number of neighbors
+     * \param indices offsets of the neighbors sorted by ascending distance, fewer than k if the tree is smaller
+     * \param distances distance of each neighbor
+     */
+    void kNearest(const Coordinates& point, int k, std::vector<PointIndex>& indices, std::vector<Scalar>& distances) const;
+
+    static const uint MAX_LEAF_SIZE = 64; //!< upper bound for the leaf size
+
+private:
+    /*!
+     * \brief The Node struct
+     * \details nodes are stored in depth-first order, the left child directly follows its parent
+     */
+    struct Node
+    {
+        Scalar median = 0; //!< split value, points of the left subtree are <= median, those of the right one >= median
+        PointIndex rightChild = 0; //!< index of the right child in m_nodes, 0 for leaves
+        PointIndex begin = 0; //!< offset of first point of this subtree in the packed arrays
+        PointIndex end = 0; //!< offset behind last point of this subtree in the packed arrays
+    };
+
+    /*!
+     * \brief The BuildPoint struct
+     * \details point record that is partitioned while building
+     */
+    struct BuildPoint
+    {
+        Coordinates coordinates; //!< coordinates of the point
+        PointIndex index; //!< offset of the point in the array passed to KdTreeND::build
+    };
+
+    /*!
+     * \brief The Neighbor struct
+     * \details candidate of a nearest neighbor search, ordered by distance so a max heap keeps the farthest on top
+     */
+    struct Neighbor
+    {
+        Scalar sqrDistance; //!< squared distance to the query point
+        PointIndex index; //!< offset in the packed arrays
+        bool operator<(const Neighbor& other) const { return sqrDistance < other.sqrDistance; }
+    };
+
+    /*!
+     * \brief split node
+     * \details partitions the points of range [begin, end) at their median along Axis and writes the node,
+     * see buildKdSubtree
+     * \param subtree range and node to split
+     * \param parallelPartition use all OpenMP threads for the partitioning
+     * \param rightChild receives the index of the right child, 0 if the node became a leaf
+     * \return offset of the median from begin, 0 if the node became a leaf
+     */
+    template<int Axis>
+    PointIndex splitNode(const KdSubtree& subtree, bool parallelPartition, PointIndex& rightChild);
+
+    /*!
+     * \brief range query
+     * \param min
+     * \param max
+     * \param node index of current node in m_nodes, split along Axis
+     * \param indices offsets of points inside the box are appended here
+     */
+    template<int Axis>
+    void rangeQuery(const Coordinates& min, const Coordinates& max, PointIndex node, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief sphere query
+     * \details subtrees are pruned by the distance between the sphere center and their cell, which is tracked
+     * incrementally along the traversal
+     * \param center
+     * \param sqrDistance squared radius of the sphere
+     * \param node index of current node in m_nodes, split along Axis
+     * \param cellSqrDistance squared distance from center to the cell of node
+     * \param cellOffsets distance from center to the cell of node along each axis
+     * \param indices offsets of points inside the sphere are appended here
+     */
+    template<int Axis>
+    void sphereQuery(const Coordinates& center, const Scalar sqrDistance, PointIndex node,
+                     Scalar cellSqrDistance, Coordinates& cellOffsets, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief k nearest neighbors
+     * \details collects the k nearest neighbors in a bounded max heap, cells farther away than the current k-th neighbor are skipped
+     * \param point
+     * \param k
+     * \param node index of current node in m_nodes, split along Axis
+     * \param cellSqrDistance squared distance from point to the cell of node
+     * \param cellOffsets distance from point to the cell of node along each axis
+     * \param heap current candidates, holding at most k entries
+     */
+    template<int Axis>
+    void kNearest(const Coordinates& point, const uint k, PointIndex node,
+                  Scalar cellSqrDistance, Coordinates& cellOffsets, std::vector<Neighbor>& heap) const;
+
+    /*!
+     * \brief box test for a leaf bucket
+     * \param node leaf node
+     * \param min
+     * \param max
+     * \param indices offsets of points inside the box are appended here
+     */
+    void scanLeafBox(const Node& node, const Coordinates& min, const Coordinates& max, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief squared distances for a leaf bucket
+     * \param node leaf node
+     * \param point
+     * \param sqrDistances one entry per point of the leaf
+     */
+    void leafSqrDistances(const Node& node, const Coordinates& point, Scalar* sqrDistances) const;
+
+    static const PointIndex TASK_CUTOFF = 1 << 14; //!< subtrees with fewer points are built serially
+
+    Accessor m_accessor; //!< maps points to coordinates
+    std::vector<Node> m_nodes; //!< flat node array in depth-first order
+    std::vector<Scalar> m_coordinates[Dim]; //!< packed coordinates of all points in tree order, one array per axis
+    std::vector<PointIndex> m_indices; //!< offsets of all points in tree order
+    std::vector<BuildPoint> m_buildPoints; //!< point records while building, empty otherwise
+    uint m_leafSize = 16; //!< maximum number of points per leaf
+};
+
+template<int Dim, typename Scalar, typename Accessor>
+const uint KdTreeND<Dim, Scalar, Accessor>::MAX_LEAF_SIZE;
+template<int Dim, typename Scalar, typename Accessor>
+const PointIndex KdTreeND<Dim, Scalar, Accessor>::TASK_CUTOFF;
+
+template<int Dim, typename Scalar, typename Accessor>
+void KdTreeND<Dim, Scalar, Accessor>::build(const std::vector<Point>& points, bool parallel)
+{
+    const PointIndex numPoints = points.size();
+
+    m_buildPoints.resize(numPoints);
+    #pragma omp parallel for if(parallel)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        m_buildPoints[i].coordinates = coordinates(points[i]);
+        m_buildPoints[i].index = i;
+    }
+
+    // the node count is known in advance, so all nodes are allocated at once
+    m_nodes.assign(kdNodeCount(numPoints, m_leafSize), Node());
+
+    if(numPoints > 0)
+    {
+        auto split = [this](auto axis, const KdSubtree& s, bool parallelPartition, PointIndex& rightChild)
+        {
+            return splitNode<decltype(axis)::value>(s, parallelPartition, rightChild);
+        };
+        const KdSubtree root{0, numPoints, 0};
+        if(parallel) buildKdSubtreesParallel<0, Dim>( {root}, split, TASK_CUTOFF );
+        else buildKdSubtree<0, Dim>(root, split, TASK_CUTOFF, false);
+    }
+
+    for(int axis = 0; axis < Dim; ++axis) m_coordinates[axis].resize(numPoints);
+    m_indices.resize(numPoints);
+
+    #pragma omp parallel for if(parallel)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        for(int axis = 0; axis < Dim; ++axis) m_coordinates[axis][i] = m_buildPoints[i].coordinates[axis];
+        m_indices[i] = m_buildPoints[i].index;
+    }
+
+    std::vector<BuildPoint>().swap(m_buildPoints);
+}
+
+template<int Dim, typename Scalar, typename Accessor>
+typename KdTreeND<Dim, Scalar, Accessor>::Coordinates KdTreeND<Dim, Scalar, Accessor>::coordinates(const Point& point) const
+{
+    Coordinates result;
+    for(int axis = 0; axis < Dim; ++axis) result[axis] = m_accessor(point, axis);
+    return result;
+}
+
+template<int Dim, typename Scalar, typename Accessor>
+template<int Axis>
+PointIndex KdTreeND<Dim, Scalar, Accessor>::splitNode(const KdSubtree& subtree, bool parallelPartition, PointIndex& rightChild)
+{
+    const PointIndex numPoints = subtree.end - subtree.begin;
+
+    Node& node = m_nodes[subtree.nodeIndex];
+    node.begin = subtree.begin;
+    node.end = subtree.end;
+
+    // small ranges become leaf buckets
+    if(numPoints <= m_leafSize)
+    {
+        node.rightChild = rightChild = 0;
+        return 0;
+    }
+
+    const PointIndex centerPos = numPoints/2;
+    auto first = m_buildPoints.begin() + subtree.begin;
+    nthElement( first, first + centerPos, m_buildPoints.begin() + subtree.end,
+                [](const BuildPoint& p1, const BuildPoint& p2) { return p1.coordinates[Axis] < p2.coordinates[Axis]; },
+                parallelPartition );
+    node.median = (first + centerPos)->coordinates[Axis];
+
+    // left subtree directly follows its parent, right subtree follows the left one
+    node.rightChild = rightChild = subtree.nodeIndex + 1 + kdNodeCount(centerPos, m_leafSize);
+
+    return centerPos;
+}
+
+template<int Dim, typename Scalar, typename Accessor>
+void KdTreeND<Dim, Scalar, Accessor>::pointsInBox(const Coordinates& min, const Coordinates& max, std::vector<PointIndex>& indices) const
+{
+    indices.clear();
+    if(!m_nodes.empty()) rangeQuery<0>(min, max, 0, indices);
+}
+
+template<int Dim, typename Scalar, typename Accessor>
+void KdTreeND<Dim, Scalar, Accessor>::pointsInSphere(const Coordinates& center, const Scalar distance, std::vector<PointIndex>& indices) const
+{
+    indices.clear();
+    if(m_nodes.empty()) return;
+
+    Coordinates cellOffsets;
+    cellOffsets.fill(0);
+    sphereQuery<0>(center, distance * distance, 0, 0, cellOffsets, indices);
+}
+
+template<int Dim, typename Scalar, typename Accessor>
+PointIndex KdTreeND<Dim, Scalar, Accessor>::nearestPoint(const Coordinates& point) const
+{
+    if(m_nodes.empty()) return -1;
+
+    std::vector<Neighbor> heap;
+    heap.reserve(1);
+    Coordinates cellOffsets;
+    cellOffsets.fill(0);
+    kNearest<0>(point, 1, 0, 0, cellOffsets, heap);
+    return m_indices[heap.front().index];
+}
+
+template<int Dim, typename Scalar, typename Accessor>
+void KdTreeND<Dim, Scalar, Accessor>::kNearest(const Coordinates& point, int k, std::vector<PointIndex>& indices, std::vector<Scalar>& distances) const
+{
+    indices.clear();
+    distances.clear();
+    if(m_nodes.empty() || k <= 0) return;
+
+    std::vector<Neighbor> heap;
+    heap.reserve(k);
+    Coordinates cellOffsets;
+    cellOffsets.fill(0);
+    kNearest<0>(point, k, 0, 0, cellOffsets, heap);
+
+    // popping the max heap leaves the candidates sorted by ascending distance
+    std::sort_heap(heap.begin(), heap.end());
+    for(const Neighbor& neighbor : heap)
+    {
+        indices.push_back( m_indices[neighbor.index] );
+        distances.push_back( std::sqrt(neighbor.sqrDistance) );
+    }
+}
+
+template<int Dim, typename Scalar, typename Accessor>
+template<int Axis>
+void KdTreeND<Dim, Scalar, Accessor>::rangeQuery(const Coordinates& min, const Coordinates& max, PointIndex nodeIndex, std::vector<PointIndex>& indices) const
+{
+    const Node& node = m_nodes[nodeIndex];
+
+    if(node.rightChild == 0)
+    {
+        scanLeafBox(node, min, max, indices);
+        return;
+    }
+
+    // points equal to the median may end up in both halves, hence both comparisons include it
+    if(min[Axis] <= node.median) rangeQuery<(Axis + 1) % Dim>(min, max, nodeIndex + 1, indices);
+    if(max[Axis] >= node.median) rangeQuery<(Axis + 1) % Dim>(min, max, node.rightChild, indices);
+}
+
+template<int Dim, typename Scalar, typename Accessor>
+template<int Axis>
+void KdTreeND<Dim, Scalar, Accessor>::sphereQuery(const Coordinates& center, const Scalar sqrDistance, PointIndex nodeIndex,
+                                                  Scalar cellSqrDistance, Coordinates& cellOffsets, std::vector<PointIndex>& indices) const
+{
+    const Node& node = m_nodes[nodeIndex];
+
+    if(node.rightChild == 0)
+    {
+        const uint numPoints = node.end - node.begin;
+        Scalar sqrDistances[MAX_LEAF_SIZE];
+        leafSqrDistances(node, center, sqrDistances);
+
+        for(uint i = 0; i < numPoints; ++i)
+            if(sqrDistances[i] <= sqrDistance) indices.push_back( m_indices[node.begin + i] );
+        return;
+    }
+
+    const Scalar planeDistance = center[Axis] - node.median;
+    const PointIndex nearChild = planeDistance <= 0 ? nodeIndex + 1 : node.rightChild;
+    const PointIndex farChild = planeDistance <= 0 ? node.rightChild : nodeIndex + 1;
+
+    sphereQuery<(Axis + 1) % Dim>(center, sqrDistance, nearChild, cellSqrDistance, cellOffsets, indices);
+
+    // the far cell only differs from the current one along the split axis
+    const Scalar oldOffset = cellOffsets[Axis];
+    const Scalar farSqrDistance = cellSqrDistance - oldOffset * oldOffset + planeDistance * planeDistance;
+    if(farSqrDistance <= sqrDistance)
+    {
+        cellOffsets[Axis] = planeDistance;
+        sphereQuery<(Axis + 1) % Dim>(center, sqrDistance, farChild, farSqrDistance, cellOffsets, indices);
+        cellOffsets[Axis] = oldOffset;
+    }
+}
+
+template<int Dim, typename Scalar, typename Accessor>
+template<int Axis>
+void KdTreeND<Dim, Scalar, Accessor>::kNearest(const Coordinates& point, const uint k, PointIndex nodeIndex,
+                                               Scalar cellSqrDistance, Coordinates& cellOffsets, std::vector<Neighbor>& heap) const
+{
+    const Node& node = m_nodes[nodeIndex];
+
+    if(node.rightChild == 0)
+    {
+        const uint numPoints = node.end - node.begin;
+        Scalar sqrDistances[MAX_LEAF_SIZE];
+        leafSqrDistances(node, point, sqrDistances);
+
+        for(uint i = 0; i < numPoints; ++i)
+        {
+            if(heap.size() < k)
+            {
+                heap.push_back( {sqrDistances[i], node.begin + i} );
+                std::push_heap(heap.begin(), heap.end());
+            }
+            else if(sqrDistances[i] < heap.front().sqrDistance)
+            {
+                // replace current k-th neighbor
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = {sqrDistances[i], node.begin + i};
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+        return;
+    }
+
+    // visit the side of the split plane containing the point first, it most likely shrinks the search radius
+    const Scalar planeDistance = point[Axis] - node.median;
+    const PointIndex nearChild = planeDistance <= 0 ? nodeIndex + 1 : node.rightChild;
+    const PointIndex farChild = planeDistance <= 0 ? node.rightChild : nodeIndex + 1;
+
+    kNearest<(Axis + 1) % Dim>(point, k, nearChild, cellSqrDistance, cellOffsets, heap);
+
+    const Scalar oldOffset = cellOffsets[Axis];
+    const Scalar farSqrDistance = cellSqrDistance - oldOffset * oldOffset + planeDistance * planeDistance;
+    if(heap.size() < k || farSqrDistance < heap.front().sqrDistance)
+    {
+        cellOffsets[Axis] = planeDistance;
+        kNearest<(Axis + 1) % Dim>(point, k, farChild, farSqrDistance, cellOffsets, heap);
+        cellOffsets[Axis] = oldOffset;
+    }
+}
+
+template<int Dim, typename Scalar, typename Accessor>
+void KdTreeND<Dim, Scalar, Accessor>::scanLeafBox(const Node& node, const Coordinates& min, const Coordinates& max, std::vector<PointIndex>& indices) const
+{
+    const uint numPoints = node.end - node.begin;
+
+    // branch-free test of the whole bucket, one axis after another
+    int inside[MAX_LEAF_SIZE];
+    std::fill(inside, inside + numPoints, 1);
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+        const Scalar* values = m_coordinates[axis].data() + node.begin;
+        const Scalar lower = min[axis], upper = max[axis];
+
+        #pragma omp simd
+        for(uint i = 0; i < numPoints; ++i) inside[i] &= (values[i] >= lower) & (values[i] <= upper);
+    }
+
+    for(uint i = 0; i < numPoints; ++i)
+        if(inside[i]) indices.push_back( m_indices[node.begin + i] );
+}
+
+template<int Dim, typename Scalar, typename Accessor>
+void KdTreeND<Dim, Scalar, Accessor>::leafSqrDistances(const Node& node, const Coordinates& point, Scalar* sqrDistances) const
+{
+    const uint numPoints = node.end - node.begin;
+
+    std::fill(sqrDistances, sqrDistances + numPoints, Scalar(0));
+    for(int axis = 0; axis < Dim; ++axis)
+    {
+        const Scalar* values = m_coordinates[axis].data() + node.begin;
+        const Scalar value = point[axis];
+
+        #pragma omp simd
+        for(uint i = 0; i < numPoints; ++i)
+        {
+            const Scalar d = values[i] - value;
+            sqrDistances[i] += d*d;
+        }
+    }
+}
+
+#endif // KDTREEND_H
@@ -35,21 +35,52 @@ ApplicationWindow {
 
         property real lastX: 0
         property real lastY: 0
+        property real pressX: 0
+        property real pressY: 0
+        property bool moved: false
+        property bool selecting: false
 
         onPressed: {
             lastX = mouse.x
             lastY = mouse.y
+            pressX = mouse.x
+            pressY = mouse.y
+            moved = false
+            // dragging with shift held selects the points inside a rectangle instead of rotating
+            selecting = (mouse.modifiers & Qt.ShiftModifier)
         }
 
         onPositionChanged: {
             var deltaX = mouse.x - lastX
             var deltaY = mouse.y - lastY
+            if(deltaX !== 0 || deltaY !== 0) moved = true
 
-            sceneRenderer.rotate(lastX, lastY, mouse.x, mouse.y)
+            if(!selecting) sceneRenderer.rotate(lastX, lastY, mouse.x, mouse.y)
 
             lastX = mouse.x
             lastY = mouse.y
         }
+
+        onReleased: {
+            if(selecting && moved) sceneRenderer.selectRectangle(pressX, pressY, mouse.x, mouse.y)
+            else if(!moved) sceneRenderer.pickPoint(mouse.x, mouse.y)
+            selecting = false
+        }
+    }
+
+    Rectangle {
+        id: selectionRectangle
+
+        visible: mouseArea.selecting && mouseArea.moved
+
+        x: Math.min(mouseArea.pressX, mouseArea.lastX)
+        y: Math.min(mouseArea.pressY, mouseArea.lastY)
+        width: Math.abs(mouseArea.lastX - mouseArea.pressX)
+        height: Math.abs(mouseArea.lastY - mouseArea.pressY)
+
+        color: "transparent"
+        border.color: "white"
+        border.width: 1
     }
 
     Rectangle {
@@ -72,6 +103,13 @@ ApplicationWindow {
                 Layout.fillHeight: true
                 onClicked: selectGeometryFileDialog.open()
             }
+
+            Button {
+                text: "save model"
+
+                Layout.fillHeight: true
+                onClicked: saveGeometryFileDialog.open()
+            }
         }
     }
 
@@ -235,7 +273,7 @@ ApplicationWindow {
                 Layout.alignment: Qt.AlignRight
 
                 width: 200
-                height: 120
+                height: 150
 
                 color: uiColor
 
@@ -269,6 +307,18 @@ ApplicationWindow {
                             }
                         }
                     }
+
+                    RowLayout {
+                        Button {
+                            text: "select similar"
+
+                            Layout.fillWidth: true
+
+                            onClicked: {
+                                sceneRenderer.selectSimilarPoints( parseFloat(normalRadiusInput.text) )
+                            }
+                        }
+                    }
                 }
             }
 
@@ -392,6 +442,7 @@ ApplicationWindow {
         id: selectGeometryFileDialog
         title: "select file"
         folder: shortcuts.documents
+        nameFilters: [ "Point clouds (*.xyz *.txt *.pts *.ply *.las *.cloud)", "All files (*)" ]
 
         onAccepted: {
             var filePath = fileUrl.toString().replace( "file:///", "" )
@@ -405,4 +456,23 @@ ApplicationWindow {
 
         onRejected: this.close()
     }
+
+    FileDialog {
+        id: saveGeometryFileDialog
+        title: "save file"
+        folder: shortcuts.documents
+        selectExisting: false
+        nameFilters: [ "PLY files (*.ply)", "Native point clouds (*.cloud)" ]
+
+        onAccepted: {
+            var filePath = fileUrl.toString().replace( "file:///", "" )
+            console.log( "saving geometry file:", filePath )
+
+            if( !sceneRenderer.saveGeometryFile(filePath) ) console.log( "could not save", filePath )
+
+            this.close()
+        }
+
+        onRejected: this.close()
+    }
 }
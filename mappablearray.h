@@ -0,0 +1,137 @@
+#ifndef MAPPABLEARRAY_H
+#define MAPPABLEARRAY_H
+
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+/*!
+ * \brief The MappableArray class
+ * \details array that either owns its elements in a std::vector or refers to elements in a memory mapped file.
+ * Read access works the same for both, write access first copies mapped elements into the vector (detach),
+ * so mapped memory is never modified. The memory of a mapping must outlive the array or the next call of
+ * MappableArray::clear.
+ */
+template<typename T>
+class MappableArray
+{
+public:
+    MappableArray() {}
+
+    MappableArray(const MappableArray& other) { *this = other; }
+    MappableArray(MappableArray&& other) noexcept { *this = std::move(other); }
+
+    MappableArray& operator=(const MappableArray& other)
+    {
+        if(this == &other) return *this;
+
+        // a mapping is shared, owned elements are copied
+        m_vector = other.m_vector;
+        m_isMapped = other.m_isMapped;
+        if(m_isMapped)
+        {
+            m_data = other.m_data;
+            m_size = other.m_size;
+        }
+        else update();
+        return *this;
+    }
+
+    /*!
+     * \brief move assignment
+     * \details takes over the owned elements or the mapping without copying, other is left empty
+     */
+    MappableArray& operator=(MappableArray&& other) noexcept
+    {
+        if(this == &other) return *this;
+
+        // a moved vector keeps its memory, so m_data stays valid for owned elements
+        m_vector = std::move(other.m_vector);
+        m_data = other.m_data;
+        m_size = other.m_size;
+        m_isMapped = other.m_isMapped;
+
+        other.m_vector.clear();
+        other.m_isMapped = false;
+        other.update();
+        return *this;
+    }
+
+    const T& operator[](size_t i) const { return m_data[i]; }
+    T& operator[](size_t i) { detach(); return m_vector[i]; }
+
+    const T* data() const { return m_data; }
+    T* data() { detach(); return m_vector.data(); }
+
+    const T* begin() const { return m_data; }
+    const T* end() const { return m_data + m_size; }
+    T* begin() { return data(); }
+    T* end() { return data() + m_size; }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    void clear()
+    {
+        m_vector.clear();
+        m_isMapped = false;
+        update();
+    }
+
+    void resize(size_t size)
+    {
+        detach();
+        m_vector.resize(size);
+        update();
+    }
+
+    void push_back(const T& value)
+    {
+        detach();
+        m_vector.push_back(value);
+        update();
+    }
+
+    /*!
+     * \brief map elements
+     * \details drops all owned elements and refers to the given memory instead
+     * \param data first element, typically inside a memory mapped file
+     * \param size number of elements
+     */
+    void map(const T* data, size_t size)
+    {
+        std::vector<T>().swap(m_vector);
+        m_data = data;
+        m_size = size;
+        m_isMapped = true;
+    }
+
+    bool isMapped() const { return m_isMapped; }
+
+    /*!
+     * \brief detach
+     * \details copies mapped elements into owned memory, nothing happens for owned elements
+     */
+    void detach()
+    {
+        if(!m_isMapped) return;
+
+        m_vector.assign(m_data, m_data + m_size);
+        m_isMapped = false;
+        update();
+    }
+
+private:
+    void update()
+    {
+        m_data = m_vector.data();
+        m_size = m_vector.size();
+    }
+
+    std::vector<T> m_vector; //!< owned elements, empty while mapped
+    const T* m_data = 0; //!< first element, either in m_vector or mapped memory
+    size_t m_size = 0; //!< number of elements
+    bool m_isMapped = false; //!< true if m_data refers to mapped memory
+};
+
+#endif // MAPPABLEARRAY_H
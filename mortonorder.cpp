@@ -0,0 +1,119 @@
+#include "mortonorder.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <omp.h>
+
+const int MortonOrder::BITS_PER_AXIS;
+const int MortonOrder::RADIX_BITS;
+const int MortonOrder::RADIX_SIZE;
+
+void MortonOrder::sort(std::vector<Vertex>& vertices, std::vector<PointIndex>& originalIndices, bool parallel)
+{
+    const PointIndex numPoints = vertices.size();
+    if(originalIndices.size() != vertices.size())
+    {
+        originalIndices.resize(numPoints);
+        for(PointIndex i = 0; i < numPoints; ++i) originalIndices[i] = i;
+    }
+    if(numPoints < 2) return;
+
+    float minX = std::numeric_limits<float>::max(), minY = minX, minZ = minX;
+    float maxX = -minX, maxY = -minX, maxZ = -minX;
+    #pragma omp parallel for if(parallel) reduction(min:minX, minY, minZ) reduction(max:maxX, maxY, maxZ)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        const QVector3D& p = vertices[i].position;
+        minX = std::min(minX, p.x()); maxX = std::max(maxX, p.x());
+        minY = std::min(minY, p.y()); maxY = std::max(maxY, p.y());
+        minZ = std::min(minZ, p.z()); maxZ = std::max(maxZ, p.z());
+    }
+
+    // all axes share one scale, so the curve runs through cubic cells
+    const double maxCell = (1 << BITS_PER_AXIS) - 1;
+    const double maxExtent = std::max( maxX - minX, std::max(maxY - minY, maxZ - minZ) );
+    const double scale = maxExtent > 0 ? maxCell / maxExtent : 0;
+    auto cell = [&](float value, float min) { return (quint32) std::min(maxCell, (value - (double) min) * scale); };
+
+    std::vector<SortKey> keys(numPoints);
+    #pragma omp parallel for if(parallel)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        const QVector3D& p = vertices[i].position;
+        keys[i].code = code( cell(p.x(), minX), cell(p.y(), minY), cell(p.z(), minZ) );
+        keys[i].index = i;
+    }
+
+    radixSort(keys, parallel);
+
+    std::vector<Vertex> sortedVertices(numPoints);
+    std::vector<PointIndex> sortedIndices(numPoints);
+    #pragma omp parallel for if(parallel)
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        sortedVertices[i] = vertices[ keys[i].index ];
+        sortedIndices[i] = originalIndices[ keys[i].index ];
+    }
+    vertices.swap(sortedVertices);
+    originalIndices.swap(sortedIndices);
+}
+
+void MortonOrder::radixSort(std::vector<SortKey>& keys, bool parallel)
+{
+    const PointIndex numKeys = keys.size();
+    const int numThreads = parallel ? omp_get_max_threads() : 1;
+
+    std::vector<SortKey> buffer(numKeys);
+    std::vector<PointIndex> counts(numThreads * RADIX_SIZE);
+
+    SortKey* source = keys.data();
+    SortKey* target = buffer.data();
+    for(int shift = 0; shift < 3 * BITS_PER_AXIS; shift += RADIX_BITS)
+    {
+        std::fill(counts.begin(), counts.end(), 0);
+        bool isSkipped = false;
+
+        // every thread works on the same block of keys for counting and scattering, which keeps the sort stable
+        #pragma omp parallel num_threads(numThreads)
+        {
+            const int thread = omp_get_thread_num();
+            const int activeThreads = omp_get_num_threads();
+            const PointIndex begin = numKeys * thread / activeThreads;
+            const PointIndex end = numKeys * (thread + 1) / activeThreads;
+
+            PointIndex* threadCounts = counts.data() + thread * RADIX_SIZE;
+            for(PointIndex i = begin; i < end; ++i) ++threadCounts[ (source[i].code >> shift) & (RADIX_SIZE - 1) ];
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                // offsets in bucket-major, thread-minor order
+                PointIndex offset = 0;
+                for(int digit = 0; digit < RADIX_SIZE; ++digit)
+                {
+                    const PointIndex bucketBegin = offset;
+                    for(int t = 0; t < activeThreads; ++t)
+                    {
+                        PointIndex& count = counts[t * RADIX_SIZE + digit];
+                        const PointIndex threadBucketSize = count;
+                        count = offset;
+                        offset += threadBucketSize;
+                    }
+
+                    // a pass where all keys fall into one bucket would only copy them
+                    if(offset - bucketBegin == numKeys) isSkipped = true;
+                }
+            }
+
+            if( !isSkipped )
+            {
+                for(PointIndex i = begin; i < end; ++i)
+                    target[ threadCounts[ (source[i].code >> shift) & (RADIX_SIZE - 1) ]++ ] = source[i];
+            }
+        }
+
+        if( !isSkipped ) std::swap(source, target);
+    }
+
+    if(source != keys.data()) keys.swap(buffer);
+}
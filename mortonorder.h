@@ -0,0 +1,85 @@
+#ifndef MORTONORDER_H
+#define MORTONORDER_H
+
+#include <QVector3D>
+#include <QtGlobal>
+#include <vector>
+
+#include "vertex.h"
+
+/*!
+ * \brief The MortonOrder class
+ * \details sorts point clouds along the Z-order (Morton order) curve. Points that are close in space are mostly
+ * close in memory afterwards, so the neighborhood loops of the filters touch the vertex array almost sequentially
+ * instead of jumping around in scanner order. Sorting is a parallel least significant digit radix sort of the
+ * 63 bit Morton codes, which takes linear time.
+ */
+class MortonOrder
+{
+public:
+    /*!
+     * \brief sort vertices
+     * \details reorders vertices along the Morton curve of a grid with 2^21 cells per axis over their bounding box,
+     * vertices sharing a cell keep their relative order
+     * \param vertices point cloud
+     * \param originalIndices original offset of every vertex, permuted along with the vertices. If it does not have
+     * one entry per vertex, it is initialized with the current offsets first
+     * \param parallel compute codes, sort and permute on all OpenMP threads
+     */
+    static void sort(std::vector<Vertex>& vertices, std::vector<PointIndex>& originalIndices, bool parallel = true);
+
+    /*!
+     * \brief Morton code
+     * \details interleaves the bits of three cell coordinates, x ends up in the least significant bit
+     * \param x cell coordinate, only the lower 21 bits are used
+     * \param y cell coordinate, only the lower 21 bits are used
+     * \param z cell coordinate, only the lower 21 bits are used
+     * \return 63 bit Morton code
+     */
+    static quint64 code(quint32 x, quint32 y, quint32 z) { return spreadBits(x) | (spreadBits(y) << 1) | (spreadBits(z) << 2); }
+
+    static const int BITS_PER_AXIS = 21; //!< Morton codes of three coordinates fit into 63 bits
+
+private:
+    /*!
+     * \brief The SortKey struct
+     * \details Morton code of a vertex and its offset, the record the radix sort moves around
+     */
+    struct SortKey
+    {
+        quint64 code; //!< Morton code of the vertex position
+        PointIndex index; //!< offset of the vertex before sorting
+    };
+
+    /*!
+     * \brief spread bits
+     * \details inserts two zero bits after each of the lower 21 bits of value
+     * \param value
+     * \return spread value
+     */
+    static quint64 spreadBits(quint32 value)
+    {
+        quint64 x = value & 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8) & 0x100f00f00f00f00full;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2) & 0x1249249249249249ull;
+        return x;
+    }
+
+    /*!
+     * \brief radix sort
+     * \details stable least significant digit radix sort by SortKey::code. Every thread counts the digits of its
+     * own block of keys and scatters them to offsets derived from all counts, digits that are the same for all keys
+     * are skipped
+     * \param keys keys to sort
+     * \param parallel sort on all OpenMP threads
+     */
+    static void radixSort(std::vector<SortKey>& keys, bool parallel);
+
+    static const int RADIX_BITS = 8; //!< bits sorted per radix pass
+    static const int RADIX_SIZE = 1 << RADIX_BITS; //!< number of buckets per radix pass
+};
+
+#endif // MORTONORDER_H
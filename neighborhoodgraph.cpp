@@ -0,0 +1,103 @@
+#include "neighborhoodgraph.h"
+
+#include <QDebug>
+#include <numeric>
+
+void NeighborhoodGraph::buildRadius(const SpatialIndex& index, const std::vector<Vertex>& vertices, float radius)
+{
+    const PointIndex numVertices = vertices.size();
+
+    std::vector<QVector3D> centers(numVertices);
+    for(PointIndex i = 0; i < numVertices; ++i) centers[i] = vertices[i].position;
+
+    index.pointsInSpheres(centers, radius, m_offsets, m_neighbors);
+    sortByDistance(vertices);
+
+    m_type = Radius;
+    m_radius = radius;
+    m_k = 0;
+}
+
+void NeighborhoodGraph::buildKNearest(const KdTree& tree, const std::vector<Vertex>& vertices, int k)
+{
+    const PointIndex numVertices = vertices.size();
+
+    // removed points are skipped by the tree, only its remaining points can be neighbors
+    k = std::max(0, (int) std::min<PointIndex>(k, tree.size()));
+
+    // every vertex gets exactly k neighbors
+    m_offsets.resize(numVertices + 1);
+    for(PointIndex i = 0; i <= numVertices; ++i) m_offsets[i] = i * k;
+    m_neighbors.resize(numVertices * k);
+    m_distances.resize(numVertices * k);
+
+    PointIndex* neighbors = m_neighbors.data();
+    float* distances = m_distances.data();
+
+    #pragma omp parallel
+    {
+        std::vector<PointIndex> indices;
+        std::vector<float> neighborDistances;
+
+        #pragma omp for
+        for(PointIndex i = 0; i < numVertices; ++i)
+        {
+            // results come sorted by distance already
+            tree.kNearest(vertices[i].position, k, indices, neighborDistances);
+            std::copy(indices.begin(), indices.end(), neighbors + i * k);
+            std::copy(neighborDistances.begin(), neighborDistances.end(), distances + i * k);
+        }
+    }
+
+    m_type = KNearest;
+    m_radius = 0;
+    m_k = k;
+}
+
+void NeighborhoodGraph::clear()
+{
+    m_type = Empty;
+    m_radius = 0;
+    m_k = 0;
+
+    m_offsets.clear();
+    m_neighbors.clear();
+    m_distances.clear();
+}
+
+void NeighborhoodGraph::sortByDistance(const std::vector<Vertex>& vertices)
+{
+    const PointIndex numVertices = vertices.size();
+    m_distances.resize(m_neighbors.size());
+
+    const Vertex* points = vertices.data();
+    PointIndex* neighbors = m_neighbors.data();
+    float* distances = m_distances.data();
+
+    #pragma omp parallel
+    {
+        std::vector<int> order;
+        std::vector<PointIndex> sortedNeighbors;
+
+        #pragma omp for schedule(dynamic, 1024)
+        for(PointIndex i = 0; i < numVertices; ++i)
+        {
+            const PointIndex begin = m_offsets[i];
+            const int count = m_offsets[i + 1] - begin;
+
+            for(PointIndex n = begin; n < begin + count; ++n)
+                distances[n] = points[i].position.distanceToPoint( points[ neighbors[n] ].position );
+
+            // sort neighbors and distances of this vertex together
+            order.resize(count);
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&](int a, int b) { return distances[begin + a] < distances[begin + b]; });
+
+            sortedNeighbors.resize(count);
+            for(int n = 0; n < count; ++n) sortedNeighbors[n] = neighbors[begin + order[n]];
+            std::copy(sortedNeighbors.begin(), sortedNeighbors.end(), neighbors + begin);
+
+            std::sort(distances + begin, distances + begin + count);
+        }
+    }
+}
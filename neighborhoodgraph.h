@@ -0,0 +1,128 @@
+#ifndef NEIGHBORHOODGRAPH_H
+#define NEIGHBORHOODGRAPH_H
+
+#include <QVector3D>
+#include <vector>
+#include <algorithm>
+
+#include "spatialindex.h"
+#include "kdtree.h"
+#include "vertex.h"
+
+/*!
+ * \brief The NeighborhoodGraph class
+ * \details caches the neighborhoods of all points of a point cloud, either all neighbors within a radius or the
+ * k nearest neighbors. Neighbor lists are stored in compressed sparse row layout and sorted by ascending distance,
+ * so queries for a smaller radius or fewer neighbors are answered by taking a prefix of the cached lists.
+ * The graph has to be cleared whenever point positions change.
+ */
+class NeighborhoodGraph
+{
+public:
+    enum Type
+    {
+        Empty,      //!< nothing cached
+        Radius,     //!< all neighbors within radius()
+        KNearest    //!< the k() nearest neighbors
+    };
+
+    /*!
+     * \brief build radius graph
+     * \details caches all neighbors within radius for every vertex
+     * \param index KdTree or HashGrid built from vertices
+     * \param vertices point cloud
+     * \param radius
+     */
+    void buildRadius(const SpatialIndex& index, const std::vector<Vertex>& vertices, float radius);
+
+    /*!
+     * \brief build k nearest neighbor graph
+     * \details caches the k nearest neighbors for every vertex. k is clamped to the number of points in the tree that
+     * are not removed, so every vertex gets the same number of neighbors
+     * \param tree KdTree built from vertices
+     * \param vertices point cloud
+     * \param k
+     */
+    void buildKNearest(const KdTree& tree, const std::vector<Vertex>& vertices, int k);
+
+    void clear(); //!< drops all cached neighborhoods
+
+    /*!
+     * \brief check whether cached neighborhoods can answer radius queries
+     * \param radius
+     * \return true for a radius graph with at least the given radius
+     */
+    bool coversRadius(float radius) const { return m_type == Radius && radius <= m_radius; }
+
+    /*!
+     * \brief check whether cached neighborhoods can answer k nearest neighbor queries
+     * \param k
+     * \return true for a k nearest neighbor graph with at least k neighbors per point
+     */
+    bool coversKNearest(int k) const { return m_type == KNearest && k <= m_k; }
+
+    Type type() const { return m_type; }
+    float radius() const { return m_radius; }
+    int k() const { return m_k; }
+    PointIndex vertexCount() const { return m_offsets.empty() ? 0 : m_offsets.size() - 1; }
+
+    /*!
+     * \brief number of cached neighbors of a vertex
+     * \param vertex offset of the vertex in the point cloud
+     */
+    int neighborCount(PointIndex vertex) const { return m_offsets[vertex + 1] - m_offsets[vertex]; }
+
+    /*!
+     * \brief number of neighbors of a vertex within a radius
+     * \details radius must not exceed the cached radius, see NeighborhoodGraph::coversRadius
+     * \param vertex offset of the vertex in the point cloud
+     * \param radius
+     */
+    int radiusNeighborCount(PointIndex vertex, float radius) const
+    {
+        if(radius >= m_radius) return neighborCount(vertex);
+
+        const float* first = distances(vertex);
+        return std::upper_bound(first, first + neighborCount(vertex), radius) - first;
+    }
+
+    /*!
+     * \brief number of nearest neighbors of a vertex
+     * \details k must not exceed the cached k, see NeighborhoodGraph::coversKNearest
+     * \param vertex offset of the vertex in the point cloud
+     * \param k
+     */
+    int nearestNeighborCount(PointIndex vertex, int k) const { return std::min(k, neighborCount(vertex)); }
+
+    /*!
+     * \brief neighbors of a vertex
+     * \param vertex offset of the vertex in the point cloud
+     * \return offsets of the neighbors, sorted by ascending distance
+     */
+    const PointIndex* neighbors(PointIndex vertex) const { return m_neighbors.data() + m_offsets[vertex]; }
+
+    /*!
+     * \brief neighbor distances of a vertex
+     * \param vertex offset of the vertex in the point cloud
+     * \return distances of the neighbors in the same order as NeighborhoodGraph::neighbors
+     */
+    const float* distances(PointIndex vertex) const { return m_distances.data() + m_offsets[vertex]; }
+
+private:
+    /*!
+     * \brief sort neighbor lists
+     * \details computes all neighbor distances and sorts each neighbor list by them
+     * \param vertices
+     */
+    void sortByDistance(const std::vector<Vertex>& vertices);
+
+    Type m_type = Empty;
+    float m_radius = 0;
+    int m_k = 0;
+
+    std::vector<PointIndex> m_offsets; //!< neighbors of vertex i are stored from m_offsets[i] to m_offsets[i+1] - 1
+    std::vector<PointIndex> m_neighbors; //!< neighbor offsets in the point cloud
+    std::vector<float> m_distances; //!< neighbor distances
+};
+
+#endif // NEIGHBORHOODGRAPH_H
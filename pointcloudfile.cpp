@@ -0,0 +1,162 @@
+#include "pointcloudfile.h"
+
+#include <QDebug>
+#include <QFile>
+#include <cstring>
+#include <algorithm>
+
+const char PointCloudFile::FILE_MAGIC[8] = {'I', '3', 'D', 'C', 'L', 'O', 'U', 'D'};
+const quint32 PointCloudFile::FILE_VERSION;
+const qint64 PointCloudFile::FILE_ALIGNMENT;
+
+/*!
+ * \brief round offset up to a multiple of alignment
+ */
+static qint64 alignedOffset(qint64 offset, qint64 alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+bool PointCloudFile::save(const QString& fileName, const std::vector<Vertex>& vertices, int attributes)
+{
+    FileHeader header;
+    std::memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+    header.version = FILE_VERSION;
+    header.vectorSize = sizeof(QVector3D);
+    header.attributes = attributes & (Normals | Colors);
+    header.reserved = 0;
+    header.numPoints = vertices.size();
+
+    qint64 fileSize = sizeof(FileHeader);
+    auto appendSection = [&](bool hasSection)
+    {
+        if( !hasSection ) return (qint64) 0;
+        const qint64 offset = alignedOffset(fileSize, FILE_ALIGNMENT);
+        fileSize = offset + header.numPoints * sizeof(QVector3D);
+        return offset;
+    };
+    header.positionOffset = appendSection(true);
+    header.normalOffset = appendSection(header.attributes & Normals);
+    header.colorOffset = appendSection(header.attributes & Colors);
+
+    QFile file(fileName);
+    if( !file.open(QIODevice::WriteOnly) || !file.resize(fileSize) )
+    {
+        qWarning() << "PointCloudFile::save(): could not open file " << fileName;
+        return false;
+    }
+
+    // every section is gathered from the vertices block by block
+    const PointIndex blockSize = 1 << 16;
+    std::vector<QVector3D> block( std::min<PointIndex>(blockSize, header.numPoints) );
+    auto writeSection = [&](qint64 offset, QVector3D Vertex::* attribute)
+    {
+        if(offset == 0) return true;
+        if( !file.seek(offset) ) return false;
+
+        for(PointIndex first = 0; first < header.numPoints; first += blockSize)
+        {
+            const PointIndex count = std::min(blockSize, header.numPoints - first);
+
+            #pragma omp parallel for
+            for(PointIndex i = 0; i < count; ++i) block[i] = vertices[first + i].*attribute;
+
+            const qint64 size = count * sizeof(QVector3D);
+            if( file.write( (const char*) block.data(), size ) != size ) return false;
+        }
+        return true;
+    };
+
+    // the header is written last, so an incomplete file is never taken for a valid one
+    const bool success = writeSection(header.positionOffset, &Vertex::position) &&
+                         writeSection(header.normalOffset, &Vertex::normal) &&
+                         writeSection(header.colorOffset, &Vertex::color) &&
+                         file.seek(0) && file.write( (const char*) &header, sizeof(FileHeader) ) == sizeof(FileHeader);
+
+    if( !success ) qWarning() << "PointCloudFile::save(): could not write file " << fileName;
+    return success;
+}
+
+bool PointCloudFile::load(const QString& fileName)
+{
+    clear();
+
+    std::shared_ptr<QFile> file = std::make_shared<QFile>(fileName);
+    if( !file->open(QIODevice::ReadOnly) ) return false;
+
+    const qint64 fileSize = file->size();
+    if(fileSize < (qint64) sizeof(FileHeader)) return false;
+
+    const uchar* memory = file->map(0, fileSize);
+    if( !memory )
+    {
+        qWarning() << "PointCloudFile::load(): could not map file " << fileName;
+        return false;
+    }
+
+    FileHeader header;
+    std::memcpy(&header, memory, sizeof(FileHeader));
+
+    auto isValidSection = [&](qint64 offset, bool hasSection)
+    {
+        if( !hasSection ) return offset == 0;
+        return offset >= (qint64) sizeof(FileHeader) && offset % FILE_ALIGNMENT == 0 &&
+               offset + header.numPoints * (qint64) sizeof(QVector3D) <= fileSize;
+    };
+    const bool isValid = std::memcmp(header.magic, FILE_MAGIC, sizeof(header.magic)) == 0 &&
+                         header.version == FILE_VERSION &&
+                         header.vectorSize == sizeof(QVector3D) &&
+                         (header.attributes & ~(Normals | Colors)) == 0 &&
+                         header.numPoints >= 0 &&
+                         isValidSection(header.positionOffset, true) &&
+                         isValidSection(header.normalOffset, header.attributes & Normals) &&
+                         isValidSection(header.colorOffset, header.attributes & Colors);
+    if( !isValid )
+    {
+        qWarning() << "PointCloudFile::load(): " << fileName << " is not a valid point cloud file";
+        return false;
+    }
+
+    m_positions.map( (const QVector3D*) (memory + header.positionOffset), header.numPoints );
+    if(header.attributes & Normals) m_normals.map( (const QVector3D*) (memory + header.normalOffset), header.numPoints );
+    if(header.attributes & Colors) m_colors.map( (const QVector3D*) (memory + header.colorOffset), header.numPoints );
+    m_attributes = header.attributes;
+    m_mappedFile = file;
+    return true;
+}
+
+bool PointCloudFile::isPointCloudFile(const char* begin, const char* end)
+{
+    return end - begin >= (qint64) sizeof(FILE_MAGIC) && std::memcmp(begin, FILE_MAGIC, sizeof(FILE_MAGIC)) == 0;
+}
+
+void PointCloudFile::toVertices(std::vector<Vertex>& vertices, bool append) const
+{
+    // clear buffer if append flag is not set
+    if(!append) vertices.clear();
+
+    const PointIndex first = vertices.size();
+    const PointIndex numPoints = size();
+    vertices.resize(first + numPoints);
+
+    const bool hasNormals = m_attributes & Normals;
+    const bool hasColors = m_attributes & Colors;
+
+    #pragma omp parallel for
+    for(PointIndex i = 0; i < numPoints; ++i)
+    {
+        Vertex& vertex = vertices[first + i];
+        vertex.position = m_positions[i];
+        if(hasNormals) vertex.normal = m_normals[i];
+        if(hasColors) vertex.color = m_colors[i];
+    }
+}
+
+void PointCloudFile::clear()
+{
+    m_positions.clear();
+    m_normals.clear();
+    m_colors.clear();
+    m_attributes = 0;
+    m_mappedFile.reset();
+}
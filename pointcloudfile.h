@@ -0,0 +1,108 @@
+#ifndef POINTCLOUDFILE_H
+#define POINTCLOUDFILE_H
+
+#include <QVector3D>
+#include <QString>
+#include <vector>
+#include <memory>
+
+#include "vertex.h"
+#include "mappablearray.h"
+
+class QFile;
+
+/*!
+ * \brief The PointCloudFile class
+ * \details native binary point cloud format. A header is followed by one section of positions, normals and colors
+ * each (structure of arrays), aligned to 64 bytes. PointCloudFile::load maps the file instead of parsing it, pages
+ * are only read when the arrays are accessed, e.g. by PointCloudFile::toVertices, which copies them into vertices.
+ */
+class PointCloudFile
+{
+public:
+    /*!
+     * \brief The Attribute enum
+     * \details flags of the vertex attributes a file holds beside positions
+     */
+    enum Attribute
+    {
+        Normals = 1,
+        Colors = 2
+    };
+
+    /*!
+     * \brief save point cloud
+     * \details writes the sections first and the header last, so an incomplete file is never taken for a valid one
+     * \param fileName
+     * \param vertices
+     * \param attributes Attribute flags, sections of other attributes are left empty
+     * \return false if the file could not be written
+     */
+    static bool save(const QString& fileName, const std::vector<Vertex>& vertices, int attributes = Normals | Colors);
+
+    /*!
+     * \brief load point cloud
+     * \details maps the file, it stays mapped as long as this object or a copy of its arrays refers to it
+     * \param fileName
+     * \return false if the file could not be mapped or is not a valid point cloud file
+     */
+    bool load(const QString& fileName);
+
+    /*!
+     * \brief file type test
+     * \param begin start of the file content
+     * \param end end of the file content
+     * \return true if the content starts with the identifier of point cloud files
+     */
+    static bool isPointCloudFile(const char* begin, const char* end);
+
+    /*!
+     * \brief copy to vertex buffer
+     * \details interleaves the sections into vertices in parallel, attributes the file does not hold get the
+     * Vertex defaults
+     * \param vertices
+     * \param append keep the current vertices and append the loaded ones
+     */
+    void toVertices(std::vector<Vertex>& vertices, bool append = false) const;
+
+    void clear();
+
+    PointIndex size() const { return m_positions.size(); }
+    int attributes() const { return m_attributes; }
+
+    const MappableArray<QVector3D>& positions() const { return m_positions; }
+    const MappableArray<QVector3D>& normals() const { return m_normals; } //!< empty without Normals attribute
+    const MappableArray<QVector3D>& colors() const { return m_colors; } //!< empty without Colors attribute
+
+private:
+    /*!
+     * \brief The FileHeader struct
+     * \details header of files written by PointCloudFile::save, the sections follow at the given byte offsets
+     */
+    struct FileHeader
+    {
+        char magic[8]; //!< file type identifier, FILE_MAGIC
+        quint32 version; //!< file format version, FILE_VERSION
+        quint32 vectorSize; //!< size of QVector3D, detects files of incompatible builds
+        quint32 attributes; //!< Attribute flags
+        quint32 reserved; //!< unused, keeps the following fields 8 byte aligned
+
+        qint64 numPoints; //!< number of points
+        qint64 positionOffset; //!< offset of the positions
+        qint64 normalOffset; //!< offset of the normals, 0 without Normals attribute
+        qint64 colorOffset; //!< offset of the colors, 0 without Colors attribute
+    };
+
+    static const char FILE_MAGIC[8]; //!< identifies files written by PointCloudFile::save
+    static const quint32 FILE_VERSION = 1; //!< current file format version
+    static const qint64 FILE_ALIGNMENT = 64; //!< alignment of the sections
+
+    MappableArray<QVector3D> m_positions;
+    MappableArray<QVector3D> m_normals;
+    MappableArray<QVector3D> m_colors;
+    int m_attributes = 0; //!< Attribute flags of the loaded file
+
+    std::shared_ptr<QFile> m_mappedFile; //!< file the arrays are mapped from, 0 if nothing is loaded
+};
+
+#endif // POINTCLOUDFILE_H
@@ -3,21 +3,27 @@
 #include <QDebug>
 #include <QOpenGLContext>
 #include <QQuickWindow>
+#include <QFileInfo>
 #include <QtMath>
 #include <algorithm>
 #include <omp.h>
 
 #include "vertexfileloader.h"
+#include "pointcloudfile.h"
 #include "kdtree.h"
+#include "kdtreend.h"
+#include "mortonorder.h"
 #include "utils.h"
 
 const float SceneRenderer::MIN_DIST = 0.5f;
 const float SceneRenderer::MAX_DIST = 5.0f;
+const float SceneRenderer::MAX_GRID_OCCUPANCY = 16.0f;
+const float SceneRenderer::PREVIEW_GROWTH = 1.25f;
 
 SceneRenderer::SceneRenderer()
 {
-    m_vertexBufferPing = new QVector<Vertex>();
-    m_vertexBufferPong = new QVector<Vertex>();
+    m_vertexBufferPing = new std::vector<Vertex>();
+    m_vertexBufferPong = new std::vector<Vertex>();
 
     m_sphere = new TetrahedronSphere(5, 0.1f);
 
@@ -35,72 +41,340 @@ SceneRenderer::SceneRenderer()
 
     setupKdTree();
 
+    frameGeometry(*m_vertexBufferPing);
     setupModelView();
 }
 
 void SceneRenderer::setupKdTree()
 {
-    m_tree.build(*m_vertexBufferPing);
+    // the tree only depends on point positions
+    if( !m_isKdTreeInvalidated ) return;
 
-    QVector3D min, max;
-    pointCloudBounds(*m_vertexBufferPing, min, max);
+    m_tree.build(*m_vertexBufferPing, true);
+    m_isKdTreeInvalidated = false;
+
+    if( !m_hasFileColors ) colorByTreeOrder(m_tree, *m_vertexBufferPing);
+}
+
+void SceneRenderer::colorByTreeOrder(const KdTree& tree, std::vector<Vertex>& vertices)
+{
+    const MappableArray<PointIndex>& treeOrder = tree.pointOrder();
+    for(size_t idx = 0; idx < treeOrder.size(); ++idx)
+    {
+        vertices[ treeOrder[idx] ].color = colorFromGradientHSV( (double) idx / treeOrder.size() );
+    }
+}
+
+void SceneRenderer::setupHashGrid(float cellSize)
+{
+    if( !m_isHashGridInvalidated && m_grid.cellSize() == cellSize ) return;
+
+    m_grid.setCellSize(cellSize);
+    m_grid.build(*m_vertexBufferPing, true);
+    m_isHashGridInvalidated = false;
+}
 
-    int idx = 0;
-    for(auto& vertex : *m_vertexBufferPing)
+const SpatialIndex& SceneRenderer::setupSpatialIndex(float radius)
+{
+    switch(m_spatialIndexType)
     {
-        vertex.color = colorFromGradientHSV( (double) idx / m_vertexBufferPing->length() );
-        ++idx;
+    case KdTreeIndex:
+        setupKdTree();
+        return m_tree;
+    case HashGridIndex:
+        setupHashGrid(radius);
+        return m_grid;
+    default:
+        break;
     }
+
+    setupHashGrid(radius);
+    if(m_grid.averageCellOccupancy() <= MAX_GRID_OCCUPANCY) return m_grid;
+
+    setupKdTree();
+    return m_tree;
+}
+
+void SceneRenderer::setupNeighborhoods(float radius)
+{
+    // neighborhoods of a larger radius that are still valid answer the query as well
+    if( !m_neighborhoods.coversRadius(radius) ) m_neighborhoods.buildRadius(setupSpatialIndex(radius), *m_vertexBufferPing, radius);
+}
+
+void SceneRenderer::invalidatePositions()
+{
+    m_isKdTreeInvalidated = true;
+    m_isHashGridInvalidated = true;
+    m_neighborhoods.clear();
 }
 
 void SceneRenderer::setGeometryFilePath(const QString& geometryFilePath)
 {
+    cancelLoading();
     m_geometryFilePath = geometryFilePath;
 
-    char* stringByteData = m_geometryFilePath.toLatin1().data();
-    VertexFileLoader::loadVerticesFromFile(stringByteData, *m_vertexBufferPing);
+    // the current geometry stays until the loading thread has something to show
+    const std::shared_ptr<LoadingState> loading = std::make_shared<LoadingState>();
+    const bool useMortonOrder = m_useMortonOrder;
+    const bool useTreeFile = m_useTreeFile;
+    QQuickWindow* window = m_window;
+    m_loadingThread = std::thread([loading, geometryFilePath, useMortonOrder, useTreeFile, window]()
+    {
+        loadGeometry(*loading, geometryFilePath, useMortonOrder, useTreeFile, window);
+        loading->isFinished = true;
+    });
+    m_loading = loading;
+    m_isLoading = true;
+}
 
-    generatePointIndices(*m_vertexBufferPing, m_indices);
+void SceneRenderer::loadGeometry(LoadingState& loading, const QString& geometryFilePath, bool useMortonOrder, bool useTreeFile,
+                                 QQuickWindow* window)
+{
+    std::unique_ptr<LoadedGeometry> geometry(new LoadedGeometry);
+    auto requestUpdate = [&loading, window]()
+    {
+        if( !loading.isCancelled ) QMetaObject::invokeMethod(window, "update", Qt::QueuedConnection);
+    };
+
+    // the tree file next to the geometry file holds tree and vertices, it is only used while it is up to date
+    const QString treeFilePath = geometryFilePath + ".kdtree";
+    QFileInfo treeFileInfo(treeFilePath);
+    const bool isTreeFileValid = treeFileInfo.exists() &&
+                                 treeFileInfo.lastModified() >= QFileInfo(geometryFilePath).lastModified();
+
+    // a file of the other vertex ordering is rejected, the ordering would silently change otherwise
+    const KdTree::VertexOrdering vertexOrdering = useMortonOrder ? KdTree::MortonCurveOrder : KdTree::OriginalOrder;
+    if( isTreeFileValid && geometry->tree.load(treeFilePath, geometry->vertices, &geometry->originalIndices, vertexOrdering) )
+    {
+        // the colors were saved with the vertices
+        geometry->hasFileColors = true;
+    }
+    else
+    {
+        // every batch is shown right away, the renderer picks it up with the next frame
+        auto publishBatch = [&](const Vertex* vertices, PointIndex numVertices)
+        {
+            {
+                std::lock_guard<std::mutex> lock(loading.mutex);
+                loading.preview.insert(loading.preview.end(), vertices, vertices + numVertices);
+            }
+            requestUpdate();
+            return !loading.isCancelled;
+        };
+
+        // the column layout is detected, normals and colors delivered by the scanner are taken over
+        VertexFileLoader::Schema schema;
+        const bool isLoaded = loadGeometryFile(geometryFilePath, geometry->vertices, false, schema, publishBatch);
+        if(loading.isCancelled) return;
+        if( !isLoaded || geometry->vertices.empty() )
+        {
+            qWarning() << "SceneRenderer::loadGeometry(): could not load points from " << geometryFilePath;
 
-    setupKdTree();
+            std::lock_guard<std::mutex> lock(loading.mutex);
+            loading.isFailed = true;
+            std::vector<Vertex>().swap(loading.preview);
+            requestUpdate();
+            return;
+        }
+        geometry->hasFileColors = schema.hasColors();
+
+        // points arrive in scanner order, sorting them makes neighborhood loops run through memory almost sequentially
+        if(useMortonOrder) MortonOrder::sort(geometry->vertices, geometry->originalIndices);
+        if(loading.isCancelled) return;
+
+        geometry->tree.build(geometry->vertices, true);
+        if(loading.isCancelled) return;
+
+        if( !geometry->hasFileColors ) colorByTreeOrder(geometry->tree, geometry->vertices);
+        // writing the tree file delays the display of the cloud, it is only done on request
+        if(useTreeFile) geometry->tree.save(treeFilePath, geometry->vertices, geometry->originalIndices, vertexOrdering);
+    }
+    if(loading.isCancelled) return;
+
+    generatePointIndices(geometry->vertices, geometry->indices);
+    computeBestFitSphere(geometry->vertices, geometry->sphereCenter, geometry->sphereRadius);
+
+    std::lock_guard<std::mutex> lock(loading.mutex);
+    loading.geometry = std::move(geometry);
+    std::vector<Vertex>().swap(loading.preview);
+    requestUpdate();
+}
+
+void SceneRenderer::cancelLoading()
+{
+    // cancelled threads that are done by now are joined without waiting
+    auto firstFinished = std::partition(m_cancelledLoads.begin(), m_cancelledLoads.end(),
+                                        [](const auto& load) { return !load.second->isFinished; });
+    for(auto load = firstFinished; load != m_cancelledLoads.end(); ++load) load->first.join();
+    m_cancelledLoads.erase(firstFinished, m_cancelledLoads.end());
+
+    if( !m_loadingThread.joinable() ) return;
+
+    // the thread stops at its next check, it is not waited for
+    m_loading->isCancelled = true;
+    m_cancelledLoads.emplace_back(std::move(m_loadingThread), m_loading);
+    m_loading.reset();
+    m_isLoading = false;
+
+    // the preview of the cancelled load may be on screen, the current geometry is uploaded again
+    m_isGeometryInvalidated = true;
+}
+
+void SceneRenderer::synchronize()
+{
+    // the GUI thread is blocked, so it can not replace the loading state meanwhile
+    const std::shared_ptr<LoadingState> loading = m_loading;
+    if(loading != m_previewLoading)
+    {
+        // the preview of a cancelled load is dropped before the next paint
+        std::vector<Vertex>().swap(m_preview);
+        m_previewLoading = loading;
+    }
+    if( !loading ) return;
+
+    std::unique_ptr<LoadedGeometry> geometry;
+    bool isFailed = false;
+    std::vector<Vertex> batch;
+    {
+        std::lock_guard<std::mutex> lock(loading->mutex);
+        geometry = std::move(loading->geometry);
+        isFailed = loading->isFailed;
+
+        // each upload copies the whole preview, letting it grow by a factor first keeps the sum of all uploads linear.
+        // The new points are only swapped out here, the loading thread is not held up by copies or uploads
+        const PointIndex previewSize = m_preview.size() + loading->preview.size();
+        if( !geometry && !isFailed && !loading->preview.empty() && previewSize >= PREVIEW_GROWTH * m_preview.size() )
+            batch.swap(loading->preview);
+    }
+
+    if( !batch.empty() )
+    {
+        const bool isFirstBatch = m_preview.empty();
+        m_preview.insert(m_preview.end(), batch.begin(), batch.end());
+        if(isFirstBatch)
+        {
+            m_rotation = QMatrix4x4();
+            frameGeometry(m_preview);
+            setupModelView();
+        }
+        m_isPreviewInvalidated = true;
+    }
+    if( !geometry && !isFailed ) return;
+
+    // the loading thread is done, the preview is not needed anymore
+    m_loadingThread.join();
+    m_loading.reset();
+    m_previewLoading.reset();
+    std::vector<Vertex>().swap(m_preview);
+    m_isLoading = false;
+    m_isPreviewInvalidated = false;
+
+    if(isFailed)
+    {
+        // the preview may have replaced the current geometry on screen
+        m_isGeometryInvalidated = true;
+        return;
+    }
+
+    // the tree refers to the memory of the loaded vertices, which is kept by swapping
+    m_vertexBufferPing->swap(geometry->vertices);
+    m_originalIndices.swap(geometry->originalIndices);
+    m_indices.swap(geometry->indices);
+    m_tree = std::move(geometry->tree);
+    m_hasFileColors = geometry->hasFileColors;
+    m_isKdTreeInvalidated = false;
+    m_isHashGridInvalidated = true;
+    m_neighborhoods.clear();
 
     // reset rotation
     m_rotation = QMatrix4x4();
+    frameGeometry(*m_vertexBufferPing);
     setupModelView();
 
     m_planeVertexBuffer.clear();
 
-    QVector3D center;
-    double radius = 0;
-    computeBestFitSphere(*m_vertexBufferPing, center, radius);
-    m_sphere->setupBuffer(5, radius);
-    m_sphere->setPosition(center);
+    m_sphere->setupBuffer(5, geometry->sphereRadius);
+    m_sphere->setPosition(geometry->sphereCenter);
 
     // geometry changed, hence make paint function recreate VAO
     m_isGeometryInvalidated = true;
+}
+
+void SceneRenderer::appendGeometryFilePath(const QString& geometryFilePath)
+{
+    if(m_isLoading)
+    {
+        qWarning() << "SceneRenderer::appendGeometryFilePath(): " << m_geometryFilePath << " is still loading";
+        return;
+    }
+
+    const PointIndex first = m_vertexBufferPing->size();
+
+    VertexFileLoader::Schema schema;
+    if( !loadGeometryFile(geometryFilePath, *m_vertexBufferPing, true, schema) )
+    {
+        // points read before the error would be missing in the tree
+        qWarning() << "SceneRenderer::appendGeometryFilePath(): could not load points from " << geometryFilePath;
+        m_vertexBufferPing->resize(first);
+        return;
+    }
+
+    // appended points keep their order, otherwise the tree could not just insert them
+    if( !m_originalIndices.empty() )
+    {
+        for(PointIndex i = first; i < (PointIndex) m_vertexBufferPing->size(); ++i) m_originalIndices.push_back(i);
+    }
+
+    // a valid tree only has to take the new points, otherwise it is built on the next query
+    if( !m_isKdTreeInvalidated ) m_tree.insert(*m_vertexBufferPing, first);
+    m_isHashGridInvalidated = true;
+    m_neighborhoods.clear();
+
+    generatePointIndices(*m_vertexBufferPing, m_indices);
+    frameGeometry(*m_vertexBufferPing);
+    setupModelView();
 
-    // schedule repaint for next frame when loading is done
+    // geometry changed, hence make paint function recreate VAO
+    m_isGeometryInvalidated = true;
     m_window->update();
 }
 
-void SceneRenderer::setupModelView()
+bool SceneRenderer::saveGeometryFile(const QString& geometryFilePath) const
+{
+    if( geometryFilePath.endsWith(".cloud", Qt::CaseInsensitive) ) return PointCloudFile::save(geometryFilePath, *m_vertexBufferPing);
+
+    QByteArray fileName = geometryFilePath.toLatin1();
+    return VertexFileLoader::saveVerticesToPLY(fileName.data(), *m_vertexBufferPing);
+}
+
+bool SceneRenderer::loadGeometryFile(const QString& geometryFilePath, std::vector<Vertex>& vertices, bool append, VertexFileLoader::Schema& schema,
+                                     const VertexFileLoader::BatchLoaded& batchLoaded)
+{
+    QByteArray fileName = geometryFilePath.toLatin1();
+    return VertexFileLoader::loadVerticesFromFile(fileName.data(), vertices, append, &schema, batchLoaded);
+}
+
+void SceneRenderer::frameGeometry(const std::vector<Vertex>& vertices)
 {
-    QVector3D cog = centerOfGravity(*m_vertexBufferPing);
+    m_viewCenter = centerOfGravity(vertices);
     QVector3D min, max;
-    pointCloudBounds(*m_vertexBufferPing, min, max);
+    pointCloudBounds(vertices, min, max);
     max -= min;
-    float maxScale = std::max( max.x(), std::max(max.y(), max.z()) );
+    m_viewScale = 1.0f / std::max( max.x(), std::max(max.y(), max.z()) );
+}
 
+void SceneRenderer::setupModelView()
+{
     QMatrix4x4 view;
     QVector3D eye(0, 0, m_zDistance);
     QVector3D center(0, 0, 0);
     QVector3D up(0, 1.f, 0);
 
     view.lookAt(eye, center, up);
-    view.scale(1.0f / maxScale);
+    view.scale(m_viewScale);
 
     m_modelview = m_rotation;
-    m_modelview.translate(-cog);
+    m_modelview.translate(-m_viewCenter);
     m_modelview = view * m_modelview;
 }
 
@@ -117,6 +391,20 @@ void SceneRenderer::paint()
     {
         initVertexData();
         m_isGeometryInvalidated = false;
+
+        // a file that is still loading keeps replacing the current geometry on screen
+        m_isPreviewInvalidated = !m_preview.empty();
+    }
+
+    if( m_isPreviewInvalidated )
+    {
+        if( !m_preview.empty() )
+        {
+            std::vector<PointIndex> previewIndices;
+            generatePointIndices(m_preview, previewIndices);
+            m_defaultVAO.init(m_preview, previewIndices);
+        }
+        m_isPreviewInvalidated = false;
     }
 
     //qDebug() << "SceneRenderer: repaint scene";
@@ -271,11 +559,11 @@ void SceneRenderer::initVertexData()
     m_highlightedVAO.init(*m_vertexBufferPing, m_highlightedIndices);
     m_targetPointVAO.init(*m_vertexBufferPing, m_targetPointIndices);
 
-    QVector<int> planeIndices;
+    std::vector<PointIndex> planeIndices;
     generatePointIndices(m_planeVertexBuffer, planeIndices);
     m_planeVAO.init(m_planeVertexBuffer, planeIndices);
 
-    QVector<int> sphereIndices;
+    std::vector<PointIndex> sphereIndices;
     generatePointIndices(m_sphere->vertices(), sphereIndices);
     m_sphereVAO.init(m_sphere->vertices(), sphereIndices);
 }
@@ -313,52 +601,114 @@ void SceneRenderer::rotate(float lastposX, float lastposY, float currposX, float
     m_window->update();
 }
 
+void SceneRenderer::pickPoint(float x, float y, float pickRadius)
+{
+    setupKdTree();
+
+    const QVector3D nearPoint = unproject(x, y, -1);
+    const QVector3D direction = unproject(x, y, 1) - nearPoint;
+
+    // the modelview matrix moves the point cloud center to (0, 0, -m_zDistance) in eye space
+    const QVector4D center = m_projection * QVector4D(0, 0, -m_zDistance, 1);
+    const float centerDepth = center.z() / center.w();
+    const float radius = (unproject(x + pickRadius, y, centerDepth) - unproject(x, y, centerDepth)).length();
+
+    m_targetPointIndices.clear();
+    const PointIndex target = m_tree.firstPointOnRay(nearPoint, direction, radius);
+    if(target >= 0) m_targetPointIndices.push_back(target);
+    m_tree.pointsOnRay(nearPoint, direction, radius, m_highlightedIndices);
+
+    // trigger recreation of vertex buffers
+    m_isGeometryInvalidated = true;
+    m_window->update();
+}
+
+void SceneRenderer::selectRectangle(float x1, float y1, float x2, float y2)
+{
+    setupKdTree();
+
+    // rectangle in normalized device coordinates
+    const float left = 2 * std::min(x1, x2) / m_viewportSize.width() - 1;
+    const float right = 2 * std::max(x1, x2) / m_viewportSize.width() - 1;
+    const float bottom = 1 - 2 * std::max(y1, y2) / m_viewportSize.height();
+    const float top = 1 - 2 * std::min(y1, y2) / m_viewportSize.height();
+    if(left == right || bottom == top) return;
+
+    // scale the rectangle to the whole clip volume, the frustum of the result only contains the points inside the rectangle
+    QMatrix4x4 pick;
+    pick.scale( 2 / (right - left), 2 / (top - bottom), 1 );
+    pick.translate( -(left + right) / 2, -(bottom + top) / 2, 0 );
+
+    m_tree.pointsInFrustum(pick * m_projection * m_modelview, m_highlightedIndices);
+
+    // trigger recreation of vertex buffers
+    m_isGeometryInvalidated = true;
+    m_window->update();
+}
+
+QVector3D SceneRenderer::unproject(float x, float y, float depth) const
+{
+    const QVector4D ndc(2 * x / m_viewportSize.width() - 1, 1 - 2 * y / m_viewportSize.height(), depth, 1);
+    return ( (m_projection * m_modelview).inverted() * ndc ).toVector3DAffine();
+}
+
 void SceneRenderer::smoothMesh(const float radius)
 {
     // selection highlight will become incorrect, remove it
     m_highlightedIndices.clear();
 
-    setupKdTree();
+    // smoothing moves all points, so neighborhoods are not cached but visited directly
+    const SpatialIndex& index = setupSpatialIndex(radius);
+    if(&index == &m_grid) smoothVertices(m_grid, radius);
+    else smoothVertices(m_tree, radius);
 
-    QVector<int> neighbors;
-    m_vertexBufferPong->clear();
+    swapVertexBuffers();
+    invalidatePositions();
 
-    //#pragma omp parallel for
-    for(const auto vertex : *m_vertexBufferPing)
-    {
-        m_tree.pointsInSphere(vertex.position, radius, neighbors);
+    // trigger recreation of vertex buffers
+    m_isGeometryInvalidated = true;
+}
 
-        if(neighbors.empty())
-        {
-            m_vertexBufferPong->append(vertex);
-            continue;
-        }
+template<typename Index>
+void SceneRenderer::smoothVertices(const Index& index, const float radius)
+{
+    const PointIndex numVertices = m_vertexBufferPing->size();
+
+    m_vertexBufferPong->resize(numVertices);
+    const Vertex* ping = m_vertexBufferPing->data();
+    Vertex* pong = m_vertexBufferPong->data();
+
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for(PointIndex i = 0; i < numVertices; ++i)
+    {
+        const Vertex& vertex = ping[i];
 
         QVector3D meanPosition;
         double totalWeight = 0;
-        for(int index: neighbors)
+        index.visitPointsInSphere(vertex.position, radius, [&](PointIndex, const QVector3D& neighbor, float sqrDistance)
         {
-            const QVector3D neighbor = m_vertexBufferPing->at(index).position;
-            double dist = neighbor.distanceToPoint(vertex.position);
-            double weight = std::exp( -dist/radius );
+            double weight = std::exp( -std::sqrt(sqrDistance)/radius );
 
             meanPosition += weight * neighbor;
             totalWeight += weight;
+            return true;
+        });
+
+        if(totalWeight == 0)
+        {
+            pong[i] = vertex;
+            continue;
         }
 
         meanPosition /= totalWeight;
-        m_vertexBufferPong->append( meanPosition );
+        pong[i] = Vertex( meanPosition );
     }
-
-    swapVertexBuffers();
-
-    // trigger recreation of vertex buffers
-    m_isGeometryInvalidated = true;
 }
 
 void SceneRenderer::undoSmooth()
 {
     swapVertexBuffers();
+    invalidatePositions();
 
     // trigger recreation of vertex buffers
     m_isGeometryInvalidated = true;
@@ -368,21 +718,30 @@ void SceneRenderer::estimateNormals(float planeFitRadius)
 {
     qDebug() << "SceneRenderer::thinning()";
 
-    setupKdTree();
+    setupNeighborhoods(planeFitRadius);
+
+    const PointIndex numVertices = m_vertexBufferPing->size();
+
+    Vertex* vertices = m_vertexBufferPing->data();
 
-    QVector<int> neighborIndices;
-    QVector<const Vertex*> neighborReferences;
-    for(auto& vertex: *m_vertexBufferPing)
+    #pragma omp parallel
     {
-        m_tree.pointsInSphere(vertex.position, planeFitRadius, neighborIndices);
-        // create references list
-        neighborReferences.clear();
-        for(int index: neighborIndices)
+        QVector<const Vertex*> neighborReferences;
+
+        #pragma omp for
+        for(PointIndex i = 0; i < numVertices; ++i)
         {
-            neighborReferences.append( &m_vertexBufferPing->at(index) );
+            // create references list
+            neighborReferences.clear();
+            const PointIndex* neighbors = m_neighborhoods.neighbors(i);
+            const int numNeighbors = m_neighborhoods.radiusNeighborCount(i, planeFitRadius);
+            for(int n = 0; n < numNeighbors; ++n)
+            {
+                neighborReferences.append( vertices + neighbors[n] );
+            }
+
+            vertices[i].normal = fittedPlaneNormal(neighborReferences);
         }
-
-        vertex.normal = fittedPlaneNormal(neighborReferences);
     }
 
     m_isGeometryInvalidated = true;
@@ -392,38 +751,66 @@ void SceneRenderer::thinning(float radius)
 {
     qDebug() << "SceneRenderer::thinning()";
 
+    // removed points are tracked by the KdTree, whichever index finds the neighborhoods
     setupKdTree();
+    setupNeighborhoods(radius);
 
-    QVector<int> neighborIndices;
-    for(auto& vertex: *m_vertexBufferPing)
+    for(PointIndex i = 0; i < (PointIndex) m_vertexBufferPing->size(); ++i)
     {
-        // vertices that are already flagged can be skipped
-        if( vertex.isFlagged() ) continue;
-
-        // query neighborhood of vertex
-        m_tree.pointsInSphere(vertex.position, radius, neighborIndices);
-
-        // flag all neighbors to remove (or rather not copy) them later
-        for(int index : neighborIndices)
+        // vertices that are already removed can be skipped
+        if( m_tree.isRemoved(i) ) continue;
+
+        // remove all neighbors from the tree, they are not copied later. The tree is compacted right after,
+        // so it must not rebuild itself in between
+        const PointIndex* neighbors = m_neighborhoods.neighbors(i);
+        const int numNeighbors = m_neighborhoods.radiusNeighborCount(i, radius);
+        for(int n = 0; n < numNeighbors; ++n)
         {
-            Vertex* vertexToBeRemoved = m_vertexBufferPing->data() + index;
             // the query vertex itself should not be removed
-            if(&vertex != vertexToBeRemoved) vertexToBeRemoved->flag();
+            if(neighbors[n] != i) m_tree.remove( neighbors[n], false );
         }
     }
 
     m_vertexBufferPong->clear();
-    for(auto& vertex : *m_vertexBufferPing)
+    PointIndex numRemaining = 0;
+    for(PointIndex i = 0; i < (PointIndex) m_vertexBufferPing->size(); ++i)
     {
-        if( !vertex.isFlagged() ) m_vertexBufferPong->append(vertex);
+        if( m_tree.isRemoved(i) ) continue;
+
+        m_vertexBufferPong->push_back( (*m_vertexBufferPing)[i] );
+        if( !m_originalIndices.empty() ) m_originalIndices[numRemaining] = m_originalIndices[i];
+        ++numRemaining;
     }
+    if( !m_originalIndices.empty() ) m_originalIndices.resize(numRemaining);
 
     swapVertexBuffers();
 
+    // the remaining points keep their place in the tree, so it only has to drop the removed ones
+    m_tree.compact(*m_vertexBufferPing);
+    m_isHashGridInvalidated = true;
+    m_neighborhoods.clear();
+
     generatePointIndices(*m_vertexBufferPing, m_indices);
     m_isGeometryInvalidated = true;
 }
 
+void SceneRenderer::selectSimilarPoints(float radius)
+{
+    if( m_targetPointIndices.empty() ) return;
+
+    // normals differing by one count as far apart as points at distance radius
+    const VertexPositionNormalAccessor accessor(radius);
+    KdTreeND<6, float, VertexPositionNormalAccessor> featureTree(accessor);
+    featureTree.build(*m_vertexBufferPing, true);
+
+    const Vertex& target = (*m_vertexBufferPing)[ m_targetPointIndices.front() ];
+    featureTree.pointsInSphere(featureTree.coordinates(target), radius, m_highlightedIndices);
+
+    // trigger recreation of vertex buffers
+    m_isGeometryInvalidated = true;
+    m_window->update();
+}
+
 void SceneRenderer::fitPlane()
 {
     QVector<QVector3D> planePoints;
@@ -432,7 +819,7 @@ void SceneRenderer::fitPlane()
     m_planeVertexBuffer.clear();
     for(auto point : planePoints)
     {
-        m_planeVertexBuffer.append( Vertex(point));
+        m_planeVertexBuffer.push_back( Vertex(point));
     }
 
     m_isGeometryInvalidated = true;
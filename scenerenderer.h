@@ -12,8 +12,16 @@
 #include <QVector4D>
 #include <QMatrix4x4>
 
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
 #include "kdtree.h"
+#include "hashgrid.h"
+#include "neighborhoodgraph.h"
 #include "vertexarrayobject.h"
+#include "vertexfileloader.h"
 #include "vertex.h"
 
 #include "tetrahedronsphere.h"
@@ -30,10 +38,23 @@ class SceneRenderer : public QObject,
 public:
     inline float sqr(float x) { return x*x; }
 
+    /*!
+     * \brief The SpatialIndexType enum
+     * \details spatial index used to find the neighborhoods of the filters
+     */
+    enum SpatialIndexType
+    {
+        AutoIndex,      //!< HashGrid for sparse neighborhoods, KdTree otherwise, see SceneRenderer::setupSpatialIndex
+        KdTreeIndex,    //!< always KdTree
+        HashGridIndex   //!< always HashGrid with the filter radius as cell size
+    };
+
     SceneRenderer();
 
     ~SceneRenderer()
     {
+        cancelLoading();
+        for(auto& load : m_cancelledLoads) load.first.join();
         delete m_vertexBufferPing;
         delete m_vertexBufferPong;
         delete m_program;
@@ -67,6 +88,15 @@ public:
      */
     void thinning(float radius);
 
+    /*!
+     * \brief select similar points
+     * \details highlights all points that are close to the picked point in position and normal, which selects the
+     * smooth surface patch around it. Positions and normals span a 6D space, in which normals are scaled by radius.
+     * Nothing is selected before a point has been picked
+     * \param radius maximum distance in the feature space
+     */
+    void selectSimilarPoints(float radius);
+
     void fitPlane();
 
     /*!
@@ -79,6 +109,26 @@ public:
      */
     void rotate(float x1, float y1, float x2, float y2);
 
+    /*!
+     * \brief pick point
+     * \details finds the points under the cursor with a ray through the cursor position - the first point hit becomes the
+     * target point, all points hit are highlighted
+     * \param x cursor X coordinate
+     * \param y cursor Y coordinate
+     * \param pickRadius radius of the picked area around the cursor in pixels, measured at the depth of the point cloud center
+     */
+    void pickPoint(float x, float y, float pickRadius = 4.0f);
+
+    /*!
+     * \brief select rectangle
+     * \details highlights all points projected into a screen rectangle using a frustum query
+     * \param x1 X coordinate of one corner
+     * \param y1 Y coordinate of one corner
+     * \param x2 X coordinate of the opposite corner
+     * \param y2 Y coordinate of the opposite corner
+     */
+    void selectRectangle(float x1, float y1, float x2, float y2);
+
     void setViewportSize(const QSize& viewportSize)
     {
         m_viewportSize = viewportSize;
@@ -124,6 +174,36 @@ public:
         m_pointSize = pointSize;
     }
 
+    /*!
+     * \brief use Morton order
+     * \details sort loaded point clouds along the Morton curve, so neighbors are mostly close in memory.
+     * Takes effect with the next call of SceneRenderer::setGeometryFilePath
+     * \param enabled
+     */
+    void setUseMortonOrder(bool enabled) { m_useMortonOrder = enabled; }
+    bool useMortonOrder() const { return m_useMortonOrder; }
+
+    /*!
+     * \brief use tree file
+     * \details save the tree and the vertices of loaded point clouds to a tree file next to them, which makes reopening
+     * them fast. Writing the file takes about as long as writing the cloud twice and delays the display of the
+     * loaded cloud, so it is off by default. Up to date tree files are always read.
+     * Takes effect with the next call of SceneRenderer::setGeometryFilePath
+     * \param enabled
+     */
+    void setUseTreeFile(bool enabled) { m_useTreeFile = enabled; }
+    bool useTreeFile() const { return m_useTreeFile; }
+
+    /*!
+     * \brief original index
+     * \param index offset of a vertex in the current vertex buffer
+     * \return offset of the vertex in the loaded files, before it was reordered
+     */
+    PointIndex originalIndex(PointIndex index) const { return m_originalIndices.empty() ? index : m_originalIndices[index]; }
+
+    SpatialIndexType spatialIndexType() const { return m_spatialIndexType; }
+    void setSpatialIndexType(SpatialIndexType type) { m_spatialIndexType = type; }
+
     const QVector4D& vertexColor()
     {
         return m_vertexColor;
@@ -133,8 +213,41 @@ public:
         m_vertexColor = vertexColor;
     }
 
+    /*!
+     * \brief set geometry file
+     * \details starts loading the file on a background thread and returns immediately. Points are shown as they are
+     * parsed, the KdTree is built on the background thread once all points are loaded and the loaded geometry replaces
+     * the current one in SceneRenderer::synchronize. A load that is still running is cancelled
+     * \param geometryFilePath
+     */
     void setGeometryFilePath(const QString& geometryFilePath);
     QString& geometryFilePath() { return m_geometryFilePath; }
+
+    /*!
+     * \brief append geometry file
+     * \details loads the points of another file in addition to the current ones and inserts them into the KdTree
+     * instead of rebuilding it. Nothing happens while a file is loading
+     * \param geometryFilePath
+     */
+    void appendGeometryFilePath(const QString& geometryFilePath);
+
+    /*!
+     * \brief save geometry file
+     * \details writes the current point cloud including normals and colors, as native PointCloudFile if the file name
+     * ends with .cloud and as binary PLY file otherwise
+     * \param geometryFilePath
+     * \return false if the file could not be written
+     */
+    bool saveGeometryFile(const QString& geometryFilePath) const;
+
+    /*!
+     * \brief synchronize
+     * \details hands the state of a background load over to the renderer, must be called while the GUI thread is
+     * blocked, i.e. from the synchronization step of the scene graph
+     */
+    void synchronize();
+
+    bool isLoading() const { return m_isLoading; }
 public slots:
     // plain old OpenGL paint function
     void paint();
@@ -145,14 +258,15 @@ private:
     QString m_geometryFilePath;
     QQuickWindow* m_window = 0;
 
-    QVector<Vertex>* m_vertexBufferPing = 0;
-    QVector<Vertex>* m_vertexBufferPong = 0;
+    std::vector<Vertex>* m_vertexBufferPing = 0;
+    std::vector<Vertex>* m_vertexBufferPong = 0;
 
-    QVector<Vertex> m_planeVertexBuffer;
+    std::vector<Vertex> m_planeVertexBuffer;
 
-    QVector<int> m_indices;
-    QVector<int> m_highlightedIndices;
-    QVector<int> m_targetPointIndices;
+    std::vector<PointIndex> m_indices;
+    std::vector<PointIndex> m_originalIndices; //!< offset of every vertex in the loaded files, empty if vertices are in file order
+    std::vector<PointIndex> m_highlightedIndices;
+    std::vector<PointIndex> m_targetPointIndices;
 
     QMatrix4x4 m_rotation;
     QMatrix4x4 m_modelview;
@@ -171,12 +285,59 @@ private:
     QVector4D m_vertexColor;
 
     KdTree m_tree;
+    HashGrid m_grid;
+    NeighborhoodGraph m_neighborhoods;
+    SpatialIndexType m_spatialIndexType = AutoIndex;
 
     bool m_isGeometryInvalidated = false;
+    bool m_isKdTreeInvalidated = true;
+    bool m_isHashGridInvalidated = true;
+    bool m_hasFileColors = false; //!< vertex colors were loaded from the file and are kept when the tree is rebuilt
+
+    /*!
+     * \brief The LoadedGeometry struct
+     * \details everything the loading thread prepares for a new geometry file
+     */
+    struct LoadedGeometry
+    {
+        std::vector<Vertex> vertices;
+        std::vector<PointIndex> originalIndices; //!< see SceneRenderer::m_originalIndices
+        std::vector<PointIndex> indices;
+        KdTree tree; //!< built on vertices, which keep their memory when they are swapped into the vertex buffer
+        bool hasFileColors = false;
+        QVector3D sphereCenter;
+        double sphereRadius = 0;
+    };
+
+    /*!
+     * \brief The LoadingState struct
+     * \details state shared by the renderer and one loading thread. Every load has a state of its own, so a cancelled
+     * thread can run to its end without blocking anyone and without touching the state of the next load
+     */
+    struct LoadingState
+    {
+        std::mutex mutex; //!< guards preview, geometry and isFailed
+        std::vector<Vertex> preview; //!< points the loading thread has parsed since the renderer took the last ones
+        std::unique_ptr<LoadedGeometry> geometry; //!< result of the loading thread, 0 until it is done
+        bool isFailed = false; //!< the loading thread is done without a result, the current geometry stays
+        std::atomic<bool> isCancelled{false}; //!< tells the loading thread to stop at its next check
+        std::atomic<bool> isFinished{false}; //!< the loading thread has returned and can be joined right away
+    };
+
+    std::thread m_loadingThread;
+    std::shared_ptr<LoadingState> m_loading; //!< state of the running load, 0 if there is none. Replaced by the GUI thread, read by synchronize() only
+    std::vector< std::pair<std::thread, std::shared_ptr<LoadingState>> > m_cancelledLoads; //!< cancelled loads whose threads have not been joined yet
+    std::atomic<bool> m_isLoading{false}; //!< a load has been started and not yet handed over
+    std::vector<Vertex> m_preview; //!< points of the running load taken over by synchronize(), render thread only
+    std::shared_ptr<LoadingState> m_previewLoading; //!< load m_preview belongs to, render thread only
+    bool m_isPreviewInvalidated = false; //!< the preview has to be uploaded with the next paint, render thread only
+
+    QVector3D m_viewCenter; //!< point the view is centered on
+    float m_viewScale = 1; //!< scale that fits the geometry into the view
 
     void swapVertexBuffers()
     {
-        QVector<Vertex>* swap = m_vertexBufferPing;
+        std::vector<Vertex>* swap = m_vertexBufferPing;
         m_vertexBufferPing = m_vertexBufferPong;
         m_vertexBufferPong = swap;
     }
@@ -200,15 +361,129 @@ private:
 
     static const float MIN_DIST;
     static const float MAX_DIST;
+    static const float MAX_GRID_OCCUPANCY; //!< HashGrid is chosen automatically up to this many points per cell
+    static const float PREVIEW_GROWTH; //!< the loading preview is uploaded again once it grew by this factor
 
+    /*!
+     * \brief setup KdTree
+     * \details rebuilds the KdTree from the current vertex buffer if point positions changed since the last build
+     */
     void setupKdTree();
 
+    /*!
+     * \brief color by tree order
+     * \details colors points by their position in the tree, which makes the tree cells visible
+     * \param tree
+     * \param vertices points of the tree
+     */
+    static void colorByTreeOrder(const KdTree& tree, std::vector<Vertex>& vertices);
+
+    /*!
+     * \brief load geometry
+     * \details body of the loading thread: loads the file or its tree file, sorts the points, builds and optionally
+     * saves the tree and hands the result over in LoadingState::geometry. Parsed points are appended to
+     * LoadingState::preview on the way, which is freed with the result. A file that can not be read or holds no points
+     * sets LoadingState::isFailed instead, no tree file is written for it. Cancellation is checked between all stages,
+     * a cancelled load returns without a result
+     * \param loading state of this load
+     * \param geometryFilePath
+     * \param useMortonOrder
+     * \param useTreeFile save the tree file, see SceneRenderer::setUseTreeFile
+     * \param window receives update requests whenever there is something new to show, not used once cancelled
+     */
+    static void loadGeometry(LoadingState& loading, const QString& geometryFilePath, bool useMortonOrder, bool useTreeFile,
+                             QQuickWindow* window);
+
+    /*!
+     * \brief cancel loading
+     * \details tells a running load to stop and returns right away. The loading thread is kept in m_cancelledLoads
+     * until it has finished its current stage, threads that are done by now are joined
+     */
+    void cancelLoading();
+
+    /*!
+     * \brief load geometry file
+     * \details loads the points of a file of any format VertexFileLoader::loadVerticesFromFile reads. The only cache
+     * of loaded files is the tree file, see SceneRenderer::setUseTreeFile, PointCloudFile is an import and export format
+     * \param geometryFilePath
+     * \param vertices
+     * \param append keep the current vertices and append the loaded ones
+     * \param schema receives the attributes of the file
+     * \param batchLoaded see VertexFileLoader::loadVerticesFromFile
+     * \return false if the file could not be read or loading was stopped
+     */
+    static bool loadGeometryFile(const QString& geometryFilePath, std::vector<Vertex>& vertices, bool append, VertexFileLoader::Schema& schema,
+                                 const VertexFileLoader::BatchLoaded& batchLoaded = VertexFileLoader::BatchLoaded());
+
+    /*!
+     * \brief setup HashGrid
+     * \details rebuilds the HashGrid from the current vertex buffer if point positions or the cell size changed
+     * since the last build
+     * \param cellSize
+     */
+    void setupHashGrid(float cellSize);
+
+    /*!
+     * \brief setup spatial index
+     * \details selects the index for queries of the given radius according to m_spatialIndexType and makes sure it
+     * is up to date. Automatic selection builds the HashGrid with radius as cell size, which takes linear time, and
+     * keeps it if its cells hold at most MAX_GRID_OCCUPANCY points on average - a sphere query tests all points of
+     * up to 27 cells, which for dense cells costs more than traversing the KdTree
+     * \param radius
+     * \return KdTree or HashGrid
+     */
+    const SpatialIndex& setupSpatialIndex(float radius);
+
+    /*!
+     * \brief setup neighborhoods
+     * \details makes sure m_neighborhoods holds the neighbors within radius of all points, cached neighborhoods
+     * are reused as long as point positions did not change and their radius is not smaller
+     * \param radius
+     */
+    void setupNeighborhoods(float radius);
+
+    /*!
+     * \brief smooth vertices
+     * \details writes the distance weighted mean position of the neighbors of every vertex in the ping buffer
+     * to the pong buffer, visiting the neighbors directly without collecting them first
+     * \param index KdTree or HashGrid, built from the ping buffer
+     * \param radius
+     */
+    template<typename Index>
+    void smoothVertices(const Index& index, const float radius);
+
+    /*!
+     * \brief invalidate positions
+     * \details must be called whenever point positions of the current vertex buffer change,
+     * forces a rebuild of KdTree, HashGrid and neighborhoods on next use
+     */
+    void invalidatePositions();
+
+    /*!
+     * \brief unproject
+     * \details maps a screen position and a depth in normalized device coordinates back to world space
+     * \param x screen X coordinate
+     * \param y screen Y coordinate
+     * \param depth -1 on the near plane, 1 on the far plane
+     * \return world space position
+     */
+    QVector3D unproject(float x, float y, float depth) const;
+
+    /*!
+     * \brief frame geometry
+     * \details centers the view on the given points and scales them to fit, takes effect with SceneRenderer::setupModelView
+     * \param vertices
+     */
+    void frameGeometry(const std::vector<Vertex>& vertices);
+
     void setupModelView();
     void setupProjection();
 
     float m_zDistance = 0.0;
     float m_pointSize = 2.0f;
 
+    bool m_useMortonOrder = true;
+    bool m_useTreeFile = false;
     bool m_useSpecular = true;
     bool m_useDiffuse = true;
 };
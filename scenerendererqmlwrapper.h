@@ -16,8 +16,11 @@ class SceneRendererQMLWrapper : public QQuickItem
     Q_PROPERTY(QString geometryFilePath READ geometryFilePath WRITE setGeometryFilePath)
     Q_PROPERTY(float zDistance READ zDistance WRITE setZDistance)
     Q_PROPERTY(float pointSize READ pointSize WRITE setPointSize)
+    Q_PROPERTY(int spatialIndexType READ spatialIndexType WRITE setSpatialIndexType)
 
     Q_PROPERTY(bool usePerVertexColor READ usePerVertexColor WRITE setUsePerVertexColor)
+    Q_PROPERTY(bool useMortonOrder READ useMortonOrder WRITE setUseMortonOrder)
+    Q_PROPERTY(bool useTreeFile READ useTreeFile WRITE setUseTreeFile)
 
 public:
     SceneRendererQMLWrapper()
@@ -35,6 +38,16 @@ public:
         if( !m_sceneRenderer ) return;
         m_sceneRenderer->setGeometryFilePath(geometryFilePath);
     }
+    Q_INVOKABLE void appendGeometryFilePath(const QString& geometryFilePath)
+    {
+        if( !m_sceneRenderer ) return;
+        m_sceneRenderer->appendGeometryFilePath(geometryFilePath);
+    }
+    Q_INVOKABLE bool saveGeometryFile(const QString& geometryFilePath)
+    {
+        if( !m_sceneRenderer ) return false;
+        return m_sceneRenderer->saveGeometryFile(geometryFilePath);
+    }
 
     const float zDistance()
     {
@@ -58,6 +71,17 @@ public:
         m_sceneRenderer->setPointSize(pointSize);
     }
 
+    const int spatialIndexType()
+    {
+        if( !m_sceneRenderer ) return SceneRenderer::AutoIndex;
+        return m_sceneRenderer->spatialIndexType();
+    }
+    void setSpatialIndexType(const int type)
+    {
+        if( !m_sceneRenderer ) return;
+        m_sceneRenderer->setSpatialIndexType( (SceneRenderer::SpatialIndexType) type );
+    }
+
     const bool usePerVertexColor()
     {
         if( !m_sceneRenderer ) return true;
@@ -69,6 +93,28 @@ public:
         m_sceneRenderer->setVertexColor(enabled ? QVector4D() : QVector4D(1, 171.0f / 255, 51.0f / 255, 1));
     }
 
+    const bool useMortonOrder()
+    {
+        if( !m_sceneRenderer ) return true;
+        return m_sceneRenderer->useMortonOrder();
+    }
+    void setUseMortonOrder(const bool enabled)
+    {
+        if( !m_sceneRenderer ) return;
+        m_sceneRenderer->setUseMortonOrder(enabled);
+    }
+
+    const bool useTreeFile()
+    {
+        if( !m_sceneRenderer ) return false;
+        return m_sceneRenderer->useTreeFile();
+    }
+    void setUseTreeFile(const bool enabled)
+    {
+        if( !m_sceneRenderer ) return;
+        m_sceneRenderer->setUseTreeFile(enabled);
+    }
+
     Q_INVOKABLE const bool useSpecular()
     {
         if( !m_sceneRenderer ) return true;
@@ -97,6 +143,18 @@ public:
         m_sceneRenderer->rotate(x1, y1, x2, y2);
     }
 
+    Q_INVOKABLE void pickPoint(float x, float y)
+    {
+        if(!m_sceneRenderer) return;
+        m_sceneRenderer->pickPoint(x, y);
+    }
+
+    Q_INVOKABLE void selectRectangle(float x1, float y1, float x2, float y2)
+    {
+        if(!m_sceneRenderer) return;
+        m_sceneRenderer->selectRectangle(x1, y1, x2, y2);
+    }
+
     Q_INVOKABLE void smoothMesh(float radius)
     {
         if(!m_sceneRenderer) return;
@@ -121,6 +179,12 @@ public:
         m_sceneRenderer->thinning(radius);
     }
 
+    Q_INVOKABLE void selectSimilarPoints(float radius)
+    {
+        if(!m_sceneRenderer) return;
+        m_sceneRenderer->selectSimilarPoints(radius);
+    }
+
     Q_INVOKABLE void fitPlane()
     {
         if(!m_sceneRenderer) return;
@@ -166,6 +230,7 @@ public slots:
 
         m_sceneRenderer->setViewportSize(win->size());
         m_sceneRenderer->setWindow(win);
+        m_sceneRenderer->synchronize();
     }
 
 private:
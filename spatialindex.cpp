@@ -0,0 +1,59 @@
+#include "spatialindex.h"
+#include <QDebug>
+#include <algorithm>
+#include <omp.h>
+
+const int SpatialIndex::QUERY_CHUNK_SIZE;
+
+void SpatialIndex::pointsInSpheres(const std::vector<QVector3D>& centers, const std::vector<float>& distances,
+                                   std::vector<PointIndex>& offsets, std::vector<PointIndex>& indices) const
+{
+    if(distances.size() != centers.size())
+    {
+        qWarning() << "SpatialIndex::pointsInSpheres(): number of centers and radii differs";
+        return;
+    }
+    pointsInSpheres(centers, [&](PointIndex i) { return distances[i]; }, offsets, indices);
+}
+
+void SpatialIndex::pointsInSpheres(const std::vector<QVector3D>& centers, const float distance,
+                                   std::vector<PointIndex>& offsets, std::vector<PointIndex>& indices) const
+{
+    pointsInSpheres(centers, [=](PointIndex) { return distance; }, offsets, indices);
+}
+
+template<typename Radius>
+void SpatialIndex::pointsInSpheres(const std::vector<QVector3D>& centers, Radius distance, std::vector<PointIndex>& offsets, std::vector<PointIndex>& indices) const
+{
+    const PointIndex numQueries = centers.size();
+
+    offsets.assign(numQueries + 1, 0);
+    indices.clear();
+
+    // every chunk of queries collects its results separately, they are concatenated in query order afterwards
+    const PointIndex numChunks = (numQueries + QUERY_CHUNK_SIZE - 1) / QUERY_CHUNK_SIZE;
+    std::vector< std::vector<PointIndex> > chunkIndices(numChunks);
+    PointIndex* counts = offsets.data() + 1;
+
+    #pragma omp parallel for schedule(dynamic)
+    for(PointIndex chunk = 0; chunk < numChunks; ++chunk)
+    {
+        const PointIndex last = std::min(numQueries, (chunk + 1) * QUERY_CHUNK_SIZE);
+        for(PointIndex i = chunk * QUERY_CHUNK_SIZE; i < last; ++i)
+        {
+            PointIndex count = chunkIndices[chunk].size();
+            appendPointsInSphere(centers[i], distance(i), chunkIndices[chunk]);
+            counts[i] = chunkIndices[chunk].size() - count;
+        }
+    }
+
+    for(PointIndex i = 0; i < numQueries; ++i) offsets[i + 1] += offsets[i];
+
+    indices.resize(offsets[numQueries]);
+    PointIndex* result = indices.data();
+    #pragma omp parallel for
+    for(PointIndex chunk = 0; chunk < numChunks; ++chunk)
+    {
+        std::copy(chunkIndices[chunk].begin(), chunkIndices[chunk].end(), result + offsets[chunk * QUERY_CHUNK_SIZE]);
+    }
+}
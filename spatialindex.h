@@ -0,0 +1,115 @@
+#ifndef SPATIALINDEX_H
+#define SPATIALINDEX_H
+
+#include <QVector3D>
+#include <vector>
+
+#include "vertex.h"
+
+/*!
+ * \brief utility function for searching points in a cuboid area
+ * \param point
+ * \param min minimum xyz coordinates
+ * \param max maximum xyz coordinates
+ * \return true if point is inside or on the cuboid defined by min and max
+ */
+inline bool inRange(const QVector3D& point, const QVector3D& min, const QVector3D& max)
+{
+    return point.x() >= min.x() && point.x() <= max.x() &&
+           point.y() >= min.y() && point.y() <= max.y() &&
+           point.z() >= min.z() && point.z() <= max.z();
+}
+
+/*!
+ * \brief The SpatialIndex class
+ * \details common interface of the spatial search structures, KdTree and HashGrid. An index is built from a vertex
+ * array and answers queries with offsets of points in that array, so filters can use either one.
+ * All const member functions of an implementation must be thread-safe.
+ */
+class SpatialIndex
+{
+public:
+    virtual ~SpatialIndex() {}
+
+    /*!
+     * \brief build index
+     * \details deletes the current index and builds a new one from the given vertices
+     * \param vertices point cloud, query results are offsets in this array
+     * \param parallel build on all OpenMP threads
+     */
+    virtual void build(std::vector<Vertex>& vertices, bool parallel = false) = 0;
+
+    /*!
+     * \brief find all points in a box
+     * \details finds all points within a cuboid defined by two points
+     * \param min minimum xyz boundaries for search box
+     * \param max maximum xyz boundaries for search box
+     * \param indices offsets of points that have been found inside the box
+     */
+    virtual void pointsInBox(const QVector3D& min, const QVector3D& max, std::vector<PointIndex>& indices) const = 0;
+
+    /*!
+     * \brief find all points in a sphere
+     * \details finds all points within a sphere defined by center point and radius
+     * \param center center of the sphere
+     * \param distance radius of the sphere
+     * \param indices offsets of points that have been found inside the sphere
+     */
+    virtual void pointsInSphere(const QVector3D& center, const float distance, std::vector<PointIndex>& indices) const = 0;
+
+    /*!
+     * \brief nearestPoint
+     * \param point
+     * \return nearest neighbor of point, 0 if the index is empty
+     */
+    virtual Vertex* nearestPoint(const QVector3D& point) const = 0;
+
+    /*!
+     * \brief find all points in many spheres
+     * \details runs sphere queries for all centers in parallel and returns the results in compressed
+     * sparse row layout: the points found for centers[i] are indices[offsets[i]] to indices[offsets[i+1] - 1]
+     * \param centers centers of the spheres
+     * \param distances radius of each sphere, must have the same length as centers
+     * \param offsets start of the result of each sphere in indices, has one more element than centers
+     * \param indices offsets of points that have been found inside the spheres
+     */
+    void pointsInSpheres(const std::vector<QVector3D>& centers, const std::vector<float>& distances,
+                         std::vector<PointIndex>& offsets, std::vector<PointIndex>& indices) const;
+
+    /*!
+     * \brief find all points in many spheres of the same radius
+     * \details same as SpatialIndex::pointsInSpheres with one radius for all spheres
+     * \param centers centers of the spheres
+     * \param distance radius of all spheres
+     * \param offsets start of the result of each sphere in indices, has one more element than centers
+     * \param indices offsets of points that have been found inside the spheres
+     */
+    void pointsInSpheres(const std::vector<QVector3D>& centers, const float distance,
+                         std::vector<PointIndex>& offsets, std::vector<PointIndex>& indices) const;
+
+protected:
+    /*!
+     * \brief sphere query
+     * \details appends all points within a sphere to indices without clearing it first
+     * \param center
+     * \param distance
+     * \param indices
+     */
+    virtual void appendPointsInSphere(const QVector3D& center, const float distance, std::vector<PointIndex>& indices) const = 0;
+
+    static const int QUERY_CHUNK_SIZE = 1024; //!< number of queries a thread processes at once in batched queries
+
+private:
+    /*!
+     * \brief batched sphere query
+     * \details common implementation of both SpatialIndex::pointsInSpheres variants
+     * \param centers
+     * \param distance returns radius of the i-th sphere
+     * \param offsets
+     * \param indices
+     */
+    template<typename Radius>
+    void pointsInSpheres(const std::vector<QVector3D>& centers, Radius distance, std::vector<PointIndex>& offsets, std::vector<PointIndex>& indices) const;
+};
+
+#endif // SPATIALINDEX_H
@@ -1,7 +1,7 @@
 #ifndef TRETRAEHEDRONSPHERE_H
 #define TRETRAEHEDRONSPHERE_H
 
-#include <QVector>
+#include <vector>
 #include <QVector3D>
 #include "vertex.h"
 #include "vertexarrayobject.h"
@@ -19,7 +19,7 @@ public:
         delete m_vertexBuffer;
     }
 
-    const QVector<Vertex>&vertices() { return *m_vertexBuffer; }
+    const std::vector<Vertex>&vertices() { return *m_vertexBuffer; }
 
     void setRadius(float radius)
     {
@@ -41,7 +41,7 @@ public:
     void setupBuffer(int subdivision, float radius)
     {
         delete m_vertexBuffer;
-        m_vertexBuffer = new QVector<Vertex>(12);
+        m_vertexBuffer = new std::vector<Vertex>(12);
 
         QVector3D v1(-1.0f, 0.0f, -1.0f / SQRT2());
         QVector3D v2( 1.0f, 0.0f, -1.0f / SQRT2());
@@ -53,21 +53,21 @@ public:
         v3 *= radius;
         v4 *= radius;
 
-        m_vertexBuffer->append( v1 );
-        m_vertexBuffer->append( v2 );
-        m_vertexBuffer->append( v3 );
+        m_vertexBuffer->push_back( v1 );
+        m_vertexBuffer->push_back( v2 );
+        m_vertexBuffer->push_back( v3 );
 
-        m_vertexBuffer->append( v1 );
-        m_vertexBuffer->append( v4 );
-        m_vertexBuffer->append( v2 );
+        m_vertexBuffer->push_back( v1 );
+        m_vertexBuffer->push_back( v4 );
+        m_vertexBuffer->push_back( v2 );
 
-        m_vertexBuffer->append( v2 );
-        m_vertexBuffer->append( v4 );
-        m_vertexBuffer->append( v3 );
+        m_vertexBuffer->push_back( v2 );
+        m_vertexBuffer->push_back( v4 );
+        m_vertexBuffer->push_back( v3 );
 
-        m_vertexBuffer->append( v3 );
-        m_vertexBuffer->append( v4 );
-        m_vertexBuffer->append( v1 );
+        m_vertexBuffer->push_back( v3 );
+        m_vertexBuffer->push_back( v4 );
+        m_vertexBuffer->push_back( v1 );
 
         subdivide(subdivision);
     }
@@ -82,9 +82,9 @@ private:
 
     void subdivideOnce()
     {
-        QVector<Vertex>* newVertexBuffer = new QVector<Vertex>();
+        std::vector<Vertex>* newVertexBuffer = new std::vector<Vertex>();
 
-        for(int i= 0; i< m_vertexBuffer->length(); i += 3)
+        for(size_t i= 0; i< m_vertexBuffer->size(); i += 3)
         {
             QVector3D v1 = m_vertexBuffer->at(i).position;
             QVector3D v2 = m_vertexBuffer->at(i+1).position;
@@ -108,28 +108,28 @@ private:
             v5 *= r;
             v6 *= r;
 
-            newVertexBuffer->append(v1);
-            newVertexBuffer->append(v4);
-            newVertexBuffer->append(v6);
+            newVertexBuffer->push_back(v1);
+            newVertexBuffer->push_back(v4);
+            newVertexBuffer->push_back(v6);
 
-            newVertexBuffer->append(v4);
-            newVertexBuffer->append(v2);
-            newVertexBuffer->append(v5);
+            newVertexBuffer->push_back(v4);
+            newVertexBuffer->push_back(v2);
+            newVertexBuffer->push_back(v5);
 
-            newVertexBuffer->append(v6);
-            newVertexBuffer->append(v5);
-            newVertexBuffer->append(v3);
+            newVertexBuffer->push_back(v6);
+            newVertexBuffer->push_back(v5);
+            newVertexBuffer->push_back(v3);
 
-            newVertexBuffer->append(v4);
-            newVertexBuffer->append(v5);
-            newVertexBuffer->append(v6);
+            newVertexBuffer->push_back(v4);
+            newVertexBuffer->push_back(v5);
+            newVertexBuffer->push_back(v6);
         }
 
         delete m_vertexBuffer;
         m_vertexBuffer = newVertexBuffer;
     }
 
-    QVector<Vertex>* m_vertexBuffer;
+    std::vector<Vertex>* m_vertexBuffer;
 };
 
 #endif // TRETRAEHEDRONSPHERE_H
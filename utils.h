@@ -2,6 +2,8 @@
 #define I3DSCANNING_UTILS_H
 
 #include <QVector>
+#include <vector>
+#include <numeric>
 #include <iostream>
 #include "vertex.h"
 #include "SVD.h"
@@ -11,7 +13,7 @@
      * \param vertices a list of points
      * \return average position of all points
      */
-QVector3D centerOfGravity(const QVector<Vertex>& vertices)
+QVector3D centerOfGravity(const std::vector<Vertex>& vertices)
 {
     QVector3D cog;
     for(auto vertex : vertices) cog += vertex.position;
@@ -20,12 +22,11 @@ QVector3D centerOfGravity(const QVector<Vertex>& vertices)
     return cog;
 }
 
-void generatePointIndices(const QVector<Vertex>& vertices,
-                          QVector<int>& indices)
+void generatePointIndices(const std::vector<Vertex>& vertices,
+                          std::vector<PointIndex>& indices)
 {
-    indices.clear();
-    int index = 0;
-    for(auto vertex : vertices) indices.push_back( index++ );
+    indices.resize( vertices.size() );
+    std::iota(indices.begin(), indices.end(), 0);
 }
 
 Matrix inverse3x3(Matrix& in)
@@ -40,7 +41,7 @@ Matrix inverse3x3(Matrix& in)
  * \param min minimum XYZ coordinates
  * \param max maximum XYZ coordinates
  */
-void pointCloudBounds(QVector<Vertex>& vertices, QVector3D& min, QVector3D& max)
+void pointCloudBounds(const std::vector<Vertex>& vertices, QVector3D& min, QVector3D& max)
 {
     if(vertices.empty()) return;
 
@@ -158,7 +159,7 @@ QVector3D fittedPlaneNormal(const QVector<const Vertex*> vertices)
     return normal.normalized();
 }
 
-void computeCovarianceMatrix3x3(const QVector<Vertex>& vertices, Matrix& M)
+void computeCovarianceMatrix3x3(const std::vector<Vertex>& vertices, Matrix& M)
 {
   M.resize(3, 3);
   const ptrdiff_t N(vertices.size());
@@ -201,7 +202,7 @@ double distancePt2Plane(const QVector3D& point, const QVector3D& pointOnPlane, c
 /** @brief computes best-fit approximations.
     @param points vector of points
 */
-void computeBestFitPlane(QVector<Vertex>& vertices, QVector<QVector3D>& corners, bool colorCodeDistance = false)
+void computeBestFitPlane(std::vector<Vertex>& vertices, QVector<QVector3D>& corners, bool colorCodeDistance = false)
 {
   Matrix M(3, 3);
 
@@ -263,7 +264,7 @@ void computeBestFitPlane(QVector<Vertex>& vertices, QVector<QVector3D>& corners,
   corners.push_back(corner4);
 }
 
-void computeBestFitSphere(const QVector<Vertex>& points, QVector3D& center, double& radius)
+void computeBestFitSphere(const std::vector<Vertex>& points, QVector3D& center, double& radius)
 {
   //compute initial guess
 
@@ -277,7 +278,7 @@ void computeBestFitSphere(const QVector<Vertex>& points, QVector3D& center, doub
   {
     center += points[i].position;
   }
-  center *= (1.0 / points.length());
+  center *= (1.0 / points.size());
 
   //compute the initial radius
   for (size_t i = 0; i < points.size(); ++i)
@@ -285,7 +286,7 @@ void computeBestFitSphere(const QVector<Vertex>& points, QVector3D& center, doub
     double d = points[i].position.distanceToPoint(center);
     radius += d;
   }
-  radius *= (1.0 / points.length());
+  radius *= (1.0 / points.size());
 
   Matrix J(points.size(), 4);
   std::vector<double> D(points.size()), X(4);
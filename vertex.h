@@ -2,6 +2,13 @@
 #define VERTEX_H
 
 #include <QVector3D>
+#include <QtGlobal>
+
+/*!
+ * \brief point index type
+ * \details offset of a point in a vertex buffer - 64 bit wide, so point clouds may hold more than 2^31 points
+ */
+typedef qint64 PointIndex;
 
 /*!
  * \brief The Vertex struct
@@ -9,6 +16,7 @@
  */
 struct Vertex {
 	operator QVector3D&() { return position; }
+	operator const QVector3D&() const { return position; }
 
     // NaN in color Z component is used as flag for a generic markings of a vertex
     void flag()
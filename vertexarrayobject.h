@@ -2,28 +2,40 @@
 #define VERTEXARRAYOBJECT_H
 
 #include <QOpenGLFunctions_4_3_Core>
-#include <QVector>
 #include <QDebug>
+#include <vector>
+#include <algorithm>
 
 #include "vertex.h"
 
+/*!
+ * \brief The VertexArrayObject class
+ * \details uploads vertices and indices to the GPU and draws them. OpenGL indices are at most 32 bit wide and
+ * buffer sizes are limited as well, hence vertices are split into chunks of at most MAX_CHUNK_VERTICES vertices,
+ * each with its own buffers and indices relative to the first vertex of the chunk.
+ */
 class VertexArrayObject : protected QOpenGLFunctions_4_3_Core
 {
 public:
     void draw(uint primitiveType)
     {
-        // bind VAO and IBO
-        glBindVertexArray(m_vao);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
+        for(const Chunk& chunk : m_chunks)
+        {
+            if(chunk.indexCount == 0) continue;
+
+            // bind VAO and IBO
+            glBindVertexArray(chunk.vao);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, chunk.ibo);
 
-        glDrawElements(primitiveType, m_indexCount, GL_UNSIGNED_INT, 0);
+            glDrawElements(primitiveType, chunk.indexCount, GL_UNSIGNED_INT, 0);
+        }
 
         // unbind
         glBindVertexArray(0);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     }
 
-    void init(const QVector<Vertex>& vertices, const QVector<int>& indices)
+    void init(const std::vector<Vertex>& vertices, const std::vector<PointIndex>& indices)
     {
         if(!m_glFunctionInitialized)
         {
@@ -31,9 +43,13 @@ public:
             m_glFunctionInitialized = true;
         }
 
-        glDeleteBuffers(1, &m_vbo);
-        glDeleteBuffers(1, &m_ibo);
-        glDeleteVertexArrays(1, &m_vao);
+        for(Chunk& chunk : m_chunks)
+        {
+            glDeleteBuffers(1, &chunk.vbo);
+            glDeleteBuffers(1, &chunk.ibo);
+            glDeleteVertexArrays(1, &chunk.vao);
+        }
+        m_chunks.clear();
 
         if(vertices.empty() || indices.empty())
         {
@@ -41,45 +57,78 @@ public:
             return;
         }
 
-        m_vertexCount = vertices.length();
-        m_indexCount = indices.length();
+        m_vertexCount = vertices.size();
+        m_indexCount = indices.size();
 
-        // create vertex buffer object
-        glGenBuffers(1, &m_vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-        glBufferData(GL_ARRAY_BUFFER, m_vertexCount * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        // sort indices into chunks, keeping their order within each chunk
+        const PointIndex numChunks = (m_vertexCount + MAX_CHUNK_VERTICES - 1) / MAX_CHUNK_VERTICES;
+        std::vector< std::vector<GLuint> > chunkIndices(numChunks);
+        for(PointIndex index : indices)
+        {
+            chunkIndices[index / MAX_CHUNK_VERTICES].push_back( index % MAX_CHUNK_VERTICES );
+        }
 
-        // create index buffer object
-        glGenBuffers(1, &m_ibo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_indexCount * sizeof(int), indices.data(), GL_STATIC_DRAW);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        m_chunks.resize(numChunks);
+        for(PointIndex c = 0; c < numChunks; ++c)
+        {
+            Chunk& chunk = m_chunks[c];
+            const PointIndex firstVertex = c * MAX_CHUNK_VERTICES;
+            const PointIndex chunkVertexCount = std::min(m_vertexCount, firstVertex + MAX_CHUNK_VERTICES) - firstVertex;
+            chunk.indexCount = chunkIndices[c].size();
+
+            // create vertex buffer object
+            glGenBuffers(1, &chunk.vbo);
+            glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+            glBufferData(GL_ARRAY_BUFFER, chunkVertexCount * sizeof(Vertex), vertices.data() + firstVertex, GL_STATIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-        // create vertex array object
-        glGenVertexArrays(1, &m_vao);
-        glBindVertexArray(m_vao);
+            // create index buffer object
+            glGenBuffers(1, &chunk.ibo);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, chunk.ibo);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, chunk.indexCount * sizeof(GLuint), chunkIndices[c].data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-            glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (char*)0);
-            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (char*)12);
-            glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (char*)24);
-            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            // create vertex array object
+            glGenVertexArrays(1, &chunk.vao);
+            glBindVertexArray(chunk.vao);
 
-            glEnableVertexAttribArray(0);
-            glEnableVertexAttribArray(1);
-            glEnableVertexAttribArray(2);
+                glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+                glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (char*)0);
+                glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (char*)12);
+                glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (char*)24);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-        glBindVertexArray(0);
+                glEnableVertexAttribArray(0);
+                glEnableVertexAttribArray(1);
+                glEnableVertexAttribArray(2);
+
+            glBindVertexArray(0);
+
+            // release memory of uploaded indices early, they may add up to several GB
+            std::vector<GLuint>().swap(chunkIndices[c]);
+        }
     }
 
+    static const PointIndex MAX_CHUNK_VERTICES = 1 << 22; //!< maximum number of vertices per buffer
+
 private:
-    uint m_vao = 0;
-    uint m_ibo = 0;
-    uint m_vbo = 0;
+    /*!
+     * \brief The Chunk struct
+     * \details buffers of a contiguous range of vertices
+     */
+    struct Chunk
+    {
+        uint vao = 0;
+        uint ibo = 0;
+        uint vbo = 0;
+
+        GLsizei indexCount = 0; //!< number of indices of this chunk
+    };
+
+    std::vector<Chunk> m_chunks;
 
-    uint m_vertexCount = 0;
-    uint m_indexCount = 0;
+    PointIndex m_vertexCount = 0;
+    PointIndex m_indexCount = 0;
 
     bool m_glFunctionInitialized = false;
 };
@@ -0,0 +1,806 @@
+#include "vertexfileloader.h"
+#include <QDebug>
+#include <QFile>
+#include <QtEndian>
+#include <sstream>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <omp.h>
+
+#include "pointcloudfile.h"
+
+const qint64 VertexFileLoader::CHUNK_SIZE;
+const int VertexFileLoader::MAX_COLUMNS;
+const int VertexFileLoader::SCHEMA_SAMPLE_LINES;
+const int VertexFileLoader::PLY_WRITE_BLOCK_SIZE;
+const PointIndex VertexFileLoader::RECORD_BLOCK_SIZE;
+
+bool VertexFileLoader::loadVerticesFromFile(const char* filename, std::vector<Vertex>& vertices, bool append, Schema* schema,
+                                            const BatchLoaded& batchLoaded)
+{
+    // clear buffer if append flag is not set
+    if(!append) vertices.clear();
+
+    QFile file(filename);
+    if( !file.open(QIODevice::ReadOnly) )
+    {
+        qWarning() << "could not open file " << filename;
+        return false;
+    }
+
+    Schema detectedSchema;
+    if( !schema ) schema = &detectedSchema;
+
+    const qint64 fileSize = file.size();
+    if(fileSize == 0) return true;
+
+    // parsers stop once a batch is refused, which is noted here so that the load is not taken for a complete one
+    bool isStopped = false;
+    BatchLoaded batch;
+    if(batchLoaded)
+    {
+        batch = [&](const Vertex* batchVertices, PointIndex numVertices)
+        {
+            isStopped = !batchLoaded(batchVertices, numVertices);
+            return !isStopped;
+        };
+    }
+
+    bool success = true;
+    auto parse = [&](const char* begin, const char* end)
+    {
+        const bool isPLY = end - begin >= 4 && std::memcmp(begin, "ply", 3) == 0 && (begin[3] == '\n' || begin[3] == '\r');
+        if(isPLY)
+        {
+            success = parsePLY(begin, end, vertices, *schema, batch);
+            if( !success ) qWarning() << "could not read PLY file " << filename;
+            return;
+        }
+        if(end - begin >= 4 && std::memcmp(begin, "LASF", 4) == 0)
+        {
+            success = parseLAS(begin, end, vertices, *schema, batch);
+            if( !success ) qWarning() << "could not read LAS file " << filename;
+            return;
+        }
+        if( PointCloudFile::isPointCloudFile(begin, end) )
+        {
+            // the file is mapped once more by PointCloudFile, which is only a matter of page table entries
+            PointCloudFile cloud;
+            success = cloud.load(filename);
+            if(success)
+            {
+                const PointIndex first = vertices.size();
+                cloud.toVertices(vertices, true);
+                if(batch) batch(vertices.data() + first, vertices.size() - first);
+            }
+
+            *schema = Schema();
+            schema->columns = {PositionX, PositionY, PositionZ};
+            if(cloud.attributes() & PointCloudFile::Normals) schema->columns.insert(schema->columns.end(), {NormalX, NormalY, NormalZ});
+            if(cloud.attributes() & PointCloudFile::Colors) schema->columns.insert(schema->columns.end(), {Red, Green, Blue});
+            return;
+        }
+
+        if( schema->columns.empty() ) *schema = detectSchema(begin, end);
+        parseXYZ(begin, end, *schema, vertices, batch);
+    };
+
+    // pages are read by the threads that parse them, the mapping is released with the file
+    const uchar* memory = file.map(0, fileSize);
+    if(memory)
+    {
+        const char* text = (const char*) memory;
+        parse(text, text + fileSize);
+    }
+    else
+    {
+        const QByteArray text = file.readAll();
+        parse(text.constData(), text.constData() + text.size());
+    }
+    return success && !isStopped;
+}
+
+bool VertexFileLoader::saveVerticesToPLY(const char* filename, const std::vector<Vertex>& vertices, bool bigEndian)
+{
+    QFile file(filename);
+    if( !file.open(QIODevice::WriteOnly) )
+    {
+        qWarning() << "could not open file " << filename;
+        return false;
+    }
+
+    const PointIndex numVertices = vertices.size();
+    const std::string header = std::string("ply\n") +
+                               "format " + (bigEndian ? "binary_big_endian" : "binary_little_endian") + " 1.0\n" +
+                               "element vertex " + std::to_string(numVertices) + "\n" +
+                               "property float x\nproperty float y\nproperty float z\n" +
+                               "property float nx\nproperty float ny\nproperty float nz\n" +
+                               "property uchar red\nproperty uchar green\nproperty uchar blue\n" +
+                               "end_header\n";
+    if( file.write(header.data(), header.size()) != (qint64) header.size() ) return false;
+
+    // float values are written through their bit pattern, which is swapped as a whole
+    const bool swapBytes = bigEndian != (Q_BYTE_ORDER == Q_BIG_ENDIAN);
+    auto writeFloat = [swapBytes](char* data, float value)
+    {
+        quint32 bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        if(swapBytes) bits = qbswap(bits);
+        std::memcpy(data, &bits, sizeof(bits));
+    };
+
+    const int recordSize = 6 * sizeof(float) + 3;
+    std::vector<char> buffer(PLY_WRITE_BLOCK_SIZE * recordSize);
+    for(PointIndex first = 0; first < numVertices; first += PLY_WRITE_BLOCK_SIZE)
+    {
+        const PointIndex blockSize = std::min<PointIndex>(PLY_WRITE_BLOCK_SIZE, numVertices - first);
+
+        #pragma omp parallel for
+        for(PointIndex i = 0; i < blockSize; ++i)
+        {
+            const Vertex& vertex = vertices[first + i];
+            char* record = buffer.data() + i * recordSize;
+            for(int axis = 0; axis < 3; ++axis)
+            {
+                writeFloat(record + axis * sizeof(float), vertex.position[axis]);
+                writeFloat(record + (3 + axis) * sizeof(float), vertex.normal[axis]);
+
+                // flagged vertices have a NaN color component, which ends up as 0
+                const float color = std::max(0.0f, std::min(vertex.color[axis], 1.0f));
+                record[6 * sizeof(float) + axis] = (char) (quint8) std::lround(255 * color);
+            }
+        }
+
+        if( file.write(buffer.data(), blockSize * recordSize) != blockSize * recordSize )
+        {
+            qWarning() << "could not write file " << filename;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VertexFileLoader::parsePLY(const char* begin, const char* end, std::vector<Vertex>& vertices, Schema& schema,
+                                const BatchLoaded& batchLoaded)
+{
+    struct Element
+    {
+        std::string name;
+        PointIndex count = 0;
+        int recordSize = 0; //!< -1 if the element has list properties
+        std::vector<std::pair<std::string, PLYType>> properties;
+    };
+
+    // the header is text up to the end_header line
+    enum { ASCII, BinaryLittleEndian, BinaryBigEndian } format = ASCII;
+    bool hasFormat = false;
+    std::vector<Element> elements;
+    const char* p = begin;
+    for(bool isHeader = true; isHeader; )
+    {
+        if(p == end) return false;
+        const char* lineBreak = (const char*) std::memchr(p, '\n', end - p);
+        const char* lineEnd = lineBreak ? lineBreak : end;
+        if(lineEnd != p && lineEnd[-1] == '\r') --lineEnd;
+        std::istringstream line( std::string(p, lineEnd) );
+        p = lineBreak ? lineBreak + 1 : end;
+
+        std::string keyword;
+        line >> keyword;
+        if(keyword == "format")
+        {
+            std::string name;
+            line >> name;
+            if(name == "ascii") format = ASCII;
+            else if(name == "binary_little_endian") format = BinaryLittleEndian;
+            else if(name == "binary_big_endian") format = BinaryBigEndian;
+            else return false;
+            hasFormat = true;
+        }
+        else if(keyword == "element")
+        {
+            elements.emplace_back();
+            line >> elements.back().name >> elements.back().count;
+            if(line.fail() || elements.back().count < 0) return false;
+        }
+        else if(keyword == "property")
+        {
+            if(elements.empty()) return false;
+            Element& element = elements.back();
+
+            std::string type, name;
+            line >> type;
+            if(type == "list")
+            {
+                std::string countType, itemType;
+                line >> countType >> itemType >> name;
+                element.recordSize = -1;
+                continue;
+            }
+
+            line >> name;
+            const PLYType plyValueType = plyType(type);
+            if(plyValueType == PLYInvalid) return false;
+
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            element.properties.push_back( {name, plyValueType} );
+            if(element.recordSize >= 0) element.recordSize += plyTypeSize(plyValueType);
+        }
+        else if(keyword == "end_header") isHeader = false;
+    }
+    if( !hasFormat ) return false;
+
+    // elements in front of the vertices have to be skipped, which needs fixed size records in binary files
+    size_t vertexElement = 0;
+    qint64 skippedBytes = 0;
+    PointIndex skippedLines = 0;
+    for(; vertexElement < elements.size() && elements[vertexElement].name != "vertex"; ++vertexElement)
+    {
+        if(elements[vertexElement].recordSize < 0 && format != ASCII) return false;
+        skippedBytes += elements[vertexElement].count * elements[vertexElement].recordSize;
+        skippedLines += elements[vertexElement].count;
+    }
+    if(vertexElement == elements.size()) return false;
+    const Element& vertexRecord = elements[vertexElement];
+
+    // schema columns follow the vertex properties, unknown properties are ignored
+    auto column = [](const std::string& name)
+    {
+        if(name == "x") return PositionX;
+        if(name == "y") return PositionY;
+        if(name == "z") return PositionZ;
+        if(name == "nx" || name == "normal_x") return NormalX;
+        if(name == "ny" || name == "normal_y") return NormalY;
+        if(name == "nz" || name == "normal_z") return NormalZ;
+        if(name == "red" || name == "diffuse_red" || name == "r") return Red;
+        if(name == "green" || name == "diffuse_green" || name == "g") return Green;
+        if(name == "blue" || name == "diffuse_blue" || name == "b") return Blue;
+        if(name == "intensity" || name == "scalar_intensity" || name == "reflectance") return Intensity;
+        return Ignore;
+    };
+    auto typeScale = [](PLYType type)
+    {
+        return type == PLYUInt8 ? 1.0f / 255 : type == PLYUInt16 ? 1.0f / 65535 : type == PLYInt16 ? 1.0f / 32767 : 1.0f;
+    };
+
+    schema = Schema();
+    std::vector<PLYProperty> properties;
+    int offset = 0;
+    for(const auto& property : vertexRecord.properties)
+    {
+        const Column propertyColumn = column(property.first);
+        if(propertyColumn == Red) schema.colorScale = typeScale(property.second);
+        if(propertyColumn == Intensity) schema.intensityScale = typeScale(property.second);
+
+        // ASCII values are read by position, binary ones by offset, so only the latter can drop ignored properties
+        if(format == ASCII) schema.columns.push_back(propertyColumn);
+        else if(propertyColumn != Ignore)
+        {
+            schema.columns.push_back(propertyColumn);
+            properties.push_back( {property.second, offset} );
+        }
+        offset += plyTypeSize(property.second);
+    }
+
+    if(format == ASCII)
+    {
+        for(PointIndex line = 0; line < skippedLines && p != end; ++line)
+        {
+            const char* lineBreak = (const char*) std::memchr(p, '\n', end - p);
+            p = lineBreak ? lineBreak + 1 : end;
+        }
+        const char* vertexEnd = p;
+        for(PointIndex line = 0; line < vertexRecord.count && vertexEnd != end; ++line)
+        {
+            const char* lineBreak = (const char*) std::memchr(vertexEnd, '\n', end - vertexEnd);
+            vertexEnd = lineBreak ? lineBreak + 1 : end;
+        }
+
+        while( !schema.columns.empty() && schema.columns.back() == Ignore ) schema.columns.pop_back();
+        parseXYZ(p, vertexEnd, schema, vertices, batchLoaded);
+        return true;
+    }
+
+    if(vertexRecord.recordSize < 0 || vertexRecord.recordSize == 0 || (int) properties.size() > MAX_COLUMNS) return false;
+
+    const char* data = p + skippedBytes;
+    if(data > end) return false;
+    const PointIndex numVertices = std::min<PointIndex>( vertexRecord.count, (end - data) / vertexRecord.recordSize );
+    if(numVertices < vertexRecord.count) qWarning() << "PLY file holds" << numVertices << "of" << vertexRecord.count << "vertices";
+
+    const bool swapBytes = (format == BinaryBigEndian) != (Q_BYTE_ORDER == Q_BIG_ENDIAN);
+    const PointIndex first = vertices.size();
+    vertices.resize(first + numVertices);
+    for(PointIndex blockBegin = 0; blockBegin < numVertices; blockBegin += RECORD_BLOCK_SIZE)
+    {
+        const PointIndex blockEnd = std::min(blockBegin + RECORD_BLOCK_SIZE, numVertices);
+
+        #pragma omp parallel for
+        for(PointIndex i = blockBegin; i < blockEnd; ++i)
+        {
+            const char* record = data + i * vertexRecord.recordSize;
+            float values[MAX_COLUMNS];
+            for(size_t c = 0; c < properties.size(); ++c) values[c] = readPLYValue(record + properties[c].offset, properties[c].type, swapBytes);
+            setAttributes(values, schema, vertices[first + i]);
+        }
+
+        if( batchLoaded && !batchLoaded(vertices.data() + first + blockBegin, blockEnd - blockBegin) )
+        {
+            vertices.resize(first + blockEnd);
+            break;
+        }
+    }
+    return true;
+}
+
+VertexFileLoader::PLYType VertexFileLoader::plyType(const std::string& name)
+{
+    if(name == "char" || name == "int8") return PLYInt8;
+    if(name == "uchar" || name == "uint8") return PLYUInt8;
+    if(name == "short" || name == "int16") return PLYInt16;
+    if(name == "ushort" || name == "uint16") return PLYUInt16;
+    if(name == "int" || name == "int32") return PLYInt32;
+    if(name == "uint" || name == "uint32") return PLYUInt32;
+    if(name == "float" || name == "float32") return PLYFloat32;
+    if(name == "double" || name == "float64") return PLYFloat64;
+    return PLYInvalid;
+}
+
+int VertexFileLoader::plyTypeSize(PLYType type)
+{
+    switch(type)
+    {
+    case PLYInt8: case PLYUInt8: return 1;
+    case PLYInt16: case PLYUInt16: return 2;
+    case PLYInt32: case PLYUInt32: case PLYFloat32: return 4;
+    case PLYFloat64: return 8;
+    default: return 0;
+    }
+}
+
+/*!
+ * \brief load value in file byte order
+ * \return value of type T stored at data, byte swapped if requested
+ */
+template<typename T>
+static T loadValue(const char* data, bool swapBytes)
+{
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return swapBytes ? qbswap(value) : value;
+}
+
+float VertexFileLoader::readPLYValue(const char* data, PLYType type, bool swapBytes)
+{
+    switch(type)
+    {
+    case PLYInt8: return (qint8) data[0];
+    case PLYUInt8: return (quint8) data[0];
+    case PLYInt16: return (qint16) loadValue<quint16>(data, swapBytes);
+    case PLYUInt16: return loadValue<quint16>(data, swapBytes);
+    case PLYInt32: return (qint32) loadValue<quint32>(data, swapBytes);
+    case PLYUInt32: return loadValue<quint32>(data, swapBytes);
+    case PLYFloat32:
+    {
+        const quint32 bits = loadValue<quint32>(data, swapBytes);
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    case PLYFloat64:
+    {
+        const quint64 bits = loadValue<quint64>(data, swapBytes);
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    default: return 0;
+    }
+}
+
+bool VertexFileLoader::parseLAS(const char* begin, const char* end, std::vector<Vertex>& vertices, Schema& schema,
+                                const BatchLoaded& batchLoaded)
+{
+    // all values are little endian, offsets are those of the public header block
+    const bool swapBytes = Q_BYTE_ORDER == Q_BIG_ENDIAN;
+    auto readDouble = [swapBytes](const char* data)
+    {
+        const quint64 bits = loadValue<quint64>(data, swapBytes);
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    };
+
+    const qint64 fileSize = end - begin;
+    if(fileSize < 227) return false;
+    const int versionMajor = begin[24];
+    const int versionMinor = begin[25];
+    const qint64 pointDataOffset = loadValue<quint32>(begin + 96, swapBytes);
+    const int pointFormat = (quint8) begin[104];
+    const qint64 recordSize = loadValue<quint16>(begin + 105, swapBytes);
+    PointIndex numPoints = loadValue<quint32>(begin + 107, swapBytes);
+    if(versionMajor != 1 || versionMinor > 4) return false;
+
+    // LAS 1.4 has a 64 bit point count for formats the 32 bit legacy count can not represent
+    if(versionMinor == 4 && fileSize >= 255) numPoints = loadValue<quint64>(begin + 247, swapBytes);
+
+    // format 0 to 5 records start with x, y, z, intensity, return bits, classification, scan angle, user data and
+    // point source id (20 bytes), formats 6 to 10 have 30 bytes including the GPS time, RGB follows the GPS time
+    int minRecordSize = 0;
+    int rgbOffset = -1;
+    switch(pointFormat)
+    {
+    case 0: minRecordSize = 20; break;
+    case 1: minRecordSize = 28; break;
+    case 2: minRecordSize = 26; rgbOffset = 20; break;
+    case 3: minRecordSize = 34; rgbOffset = 28; break;
+    case 6: minRecordSize = 30; break;
+    case 7: minRecordSize = 36; rgbOffset = 30; break;
+    case 8: minRecordSize = 38; rgbOffset = 30; break;
+    default:
+        qWarning() << "LAS point format" << pointFormat << "is not supported";
+        return false;
+    }
+    if(recordSize < minRecordSize || pointDataOffset > fileSize) return false;
+
+    const double scale[3] = {readDouble(begin + 131), readDouble(begin + 139), readDouble(begin + 147)};
+    const double offset[3] = {readDouble(begin + 155), readDouble(begin + 163), readDouble(begin + 171)};
+
+    const char* data = begin + pointDataOffset;
+    const PointIndex numRecords = std::min<PointIndex>( numPoints, (end - data) / recordSize );
+    if(numRecords < numPoints) qWarning() << "LAS file holds" << numRecords << "of" << numPoints << "points";
+
+    // a sample spread over the file tells whether intensity and RGB use 8 or 16 bits
+    quint16 maxIntensity = 0, maxColor = 0;
+    const PointIndex sampleStep = std::max<PointIndex>(1, numRecords / SCHEMA_SAMPLE_LINES);
+    for(PointIndex i = 0; i < numRecords; i += sampleStep)
+    {
+        const char* record = data + i * recordSize;
+        maxIntensity = std::max( maxIntensity, loadValue<quint16>(record + 12, swapBytes) );
+        for(int c = 0; rgbOffset >= 0 && c < 3; ++c) maxColor = std::max( maxColor, loadValue<quint16>(record + rgbOffset + 2 * c, swapBytes) );
+    }
+
+    schema = Schema();
+    schema.columns = {PositionX, PositionY, PositionZ, Intensity};
+    schema.intensityScale = maxIntensity <= 255 ? 1.0f / 255 : 1.0f / 65535;
+    if(rgbOffset >= 0)
+    {
+        schema.columns.insert(schema.columns.end(), {Red, Green, Blue});
+        schema.colorScale = maxColor <= 255 ? 1.0f / 255 : 1.0f / 65535;
+    }
+
+    const PointIndex first = vertices.size();
+    vertices.resize(first + numRecords);
+    for(PointIndex blockBegin = 0; blockBegin < numRecords; blockBegin += RECORD_BLOCK_SIZE)
+    {
+        const PointIndex blockEnd = std::min(blockBegin + RECORD_BLOCK_SIZE, numRecords);
+
+        #pragma omp parallel for
+        for(PointIndex i = blockBegin; i < blockEnd; ++i)
+        {
+            const char* record = data + i * recordSize;
+            float values[7];
+            for(int axis = 0; axis < 3; ++axis) values[axis] = (qint32) loadValue<quint32>(record + 4 * axis, swapBytes) * scale[axis] + offset[axis];
+            values[3] = loadValue<quint16>(record + 12, swapBytes);
+            for(int c = 0; rgbOffset >= 0 && c < 3; ++c) values[4 + c] = loadValue<quint16>(record + rgbOffset + 2 * c, swapBytes);
+            setAttributes(values, schema, vertices[first + i]);
+        }
+
+        if( batchLoaded && !batchLoaded(vertices.data() + first + blockBegin, blockEnd - blockBegin) )
+        {
+            vertices.resize(first + blockEnd);
+            break;
+        }
+    }
+    return true;
+}
+
+VertexFileLoader::Schema VertexFileLoader::detectSchema(const char* begin, const char* end)
+{
+    Schema schema;
+    schema.columns = {PositionX, PositionY, PositionZ};
+
+    // lines with fewer than three numbers are headers, the most frequent column count among the others decides
+    std::vector<std::vector<float>> samples;
+    std::vector<int> lineCount(MAX_COLUMNS + 1, 0);
+    for(const char* p = begin; p < end && (int) samples.size() < SCHEMA_SAMPLE_LINES; )
+    {
+        std::vector<float> values(MAX_COLUMNS);
+        values.resize( parseNumbers(p, end, values.data(), MAX_COLUMNS) );
+        if(values.size() < 3) continue;
+
+        ++lineCount[values.size()];
+        samples.push_back(values);
+    }
+    const int numColumns = std::max_element(lineCount.begin(), lineCount.end()) - lineCount.begin();
+    samples.erase( std::remove_if(samples.begin(), samples.end(),
+                                  [&](const std::vector<float>& values) { return (int) values.size() != numColumns; }),
+                   samples.end() );
+    if(numColumns <= 3) return schema;
+
+    auto columnRange = [&](int first, int count, float& min, float& max, bool& isInteger)
+    {
+        min = std::numeric_limits<float>::max();
+        max = -min;
+        isInteger = true;
+        for(const auto& values : samples)
+        {
+            for(int c = first; c < first + count; ++c)
+            {
+                min = std::min(min, values[c]);
+                max = std::max(max, values[c]);
+                isInteger = isInteger && values[c] == std::floor(values[c]);
+            }
+        }
+    };
+    auto isNormal = [&](int first)
+    {
+        if(first + 3 > numColumns) return false;
+        bool hasUnitLength = false;
+        for(const auto& values : samples)
+        {
+            // unoriented points are sometimes written with a zero normal, but zero triples alone are not normals
+            const float length = QVector3D(values[first], values[first + 1], values[first + 2]).length();
+            if(length == 0) continue;
+            if(std::abs(length - 1) > 0.01f) return false;
+            hasUnitLength = true;
+        }
+        return hasUnitLength;
+    };
+    auto isColor = [&](int first)
+    {
+        if(first + 3 > numColumns) return false;
+        float min, max;
+        bool isInteger;
+        columnRange(first, 3, min, max, isInteger);
+        return min >= 0 && (max <= 1 || (isInteger && max <= 65535));
+    };
+    auto rangeScale = [](float max) { return max <= 1 ? 1.0f : max <= 255 ? 1.0f / 255 : max <= 65535 ? 1.0f / 65535 : 1 / max; };
+
+    schema.columns.resize(numColumns, Ignore);
+    bool hasNormals = false, hasColors = false, hasIntensity = false;
+    for(int c = 3; c < numColumns; )
+    {
+        if( !hasNormals && isNormal(c) )
+        {
+            for(int i = 0; i < 3; ++i) schema.columns[c + i] = (Column) (NormalX + i);
+            hasNormals = true;
+            c += 3;
+        }
+        else if( !hasColors && !hasIntensity && (numColumns - c) % 3 == 1 && isColor(c + 1) )
+        {
+            schema.columns[c] = Intensity;
+            hasIntensity = true;
+            c += 1;
+        }
+        else if( !hasColors && isColor(c) )
+        {
+            for(int i = 0; i < 3; ++i) schema.columns[c + i] = (Column) (Red + i);
+            hasColors = true;
+            c += 3;
+        }
+        else
+        {
+            if( !hasIntensity ) schema.columns[c] = Intensity;
+            hasIntensity = true;
+            c += 1;
+        }
+    }
+
+    for(int c = 0; c < numColumns; ++c)
+    {
+        float min, max;
+        bool isInteger;
+        if(schema.columns[c] == Red)
+        {
+            columnRange(c, 3, min, max, isInteger);
+            schema.colorScale = rangeScale(max);
+        }
+        else if(schema.columns[c] == Intensity)
+        {
+            // signed intensities are 12 bit values centered at zero, as in PTS files
+            columnRange(c, 1, min, max, isInteger);
+            schema.intensityOffset = min < 0 ? 2048 : 0;
+            schema.intensityScale = min < 0 ? 1.0f / 4095 : rangeScale(max);
+        }
+    }
+
+    // trailing ignored columns do not have to be present in a line
+    while(schema.columns.back() == Ignore) schema.columns.pop_back();
+    return schema;
+}
+
+void VertexFileLoader::parseXYZ(const char* begin, const char* end, const Schema& schema, std::vector<Vertex>& vertices,
+                                const BatchLoaded& batchLoaded)
+{
+    // chunks end behind a line break, so every line belongs to exactly one chunk
+    const int numChunks = std::max<qint64>( 1, (end - begin + CHUNK_SIZE - 1) / CHUNK_SIZE );
+    std::vector<const char*> chunks(numChunks + 1);
+    chunks[0] = begin;
+    chunks[numChunks] = end;
+    for(int c = 1; c < numChunks; ++c)
+    {
+        const char* p = std::max(begin + c * CHUNK_SIZE, chunks[c - 1]);
+        const char* lineBreak = (const char*) std::memchr(p, '\n', end - p);
+        chunks[c] = lineBreak ? lineBreak + 1 : end;
+    }
+
+    // a few chunks per thread make a batch, which keeps all threads busy and hands out points early
+    const int batchChunks = 4 * omp_get_max_threads();
+    std::vector<PointIndex> offsets(batchChunks + 1);
+    std::vector<PointIndex> numPoints(batchChunks);
+    for(int batchBegin = 0; batchBegin < numChunks; batchBegin += batchChunks)
+    {
+        const int batchSize = std::min(batchChunks, numChunks - batchBegin);
+        const char* const* batch = chunks.data() + batchBegin;
+
+        // the line count of each chunk bounds its number of points, which sizes the buffer once per batch
+        offsets[0] = 0;
+        #pragma omp parallel for schedule(dynamic)
+        for(int c = 0; c < batchSize; ++c)
+        {
+            PointIndex numLines = 0;
+            for(const char* p = batch[c]; p < batch[c + 1]; ++numLines)
+            {
+                const char* lineBreak = (const char*) std::memchr(p, '\n', batch[c + 1] - p);
+                p = lineBreak ? lineBreak + 1 : batch[c + 1];
+            }
+            offsets[c + 1] = numLines;
+        }
+        for(int c = 0; c < batchSize; ++c) offsets[c + 1] += offsets[c];
+
+        const PointIndex first = vertices.size();
+        vertices.resize(first + offsets[batchSize]);
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int c = 0; c < batchSize; ++c)
+        {
+            Vertex* chunkVertices = vertices.data() + first + offsets[c];
+            PointIndex n = 0;
+            for(const char* p = batch[c]; p < batch[c + 1]; )
+            {
+                Vertex vertex;
+                if( parseLine(p, batch[c + 1], schema, vertex) ) chunkVertices[n++] = vertex;
+            }
+            numPoints[c] = n;
+        }
+
+        // close the gaps left by lines without a point
+        PointIndex size = first;
+        for(int c = 0; c < batchSize; ++c)
+        {
+            const auto chunkBegin = vertices.begin() + first + offsets[c];
+            if(first + offsets[c] != size) std::copy(chunkBegin, chunkBegin + numPoints[c], vertices.begin() + size);
+            size += numPoints[c];
+        }
+        vertices.resize(size);
+
+        if( batchLoaded && size > first && !batchLoaded(vertices.data() + first, size - first) ) return;
+    }
+}
+
+int VertexFileLoader::parseNumbers(const char*& p, const char* end, float* values, int maxValues)
+{
+    auto isSeparator = [](char c) { return c == ' ' || c == '\t' || c == ',' || c == ';' || c == '\r'; };
+
+    int numValues = 0;
+    for(; numValues < maxValues; ++numValues)
+    {
+        while(p != end && isSeparator(*p)) ++p;
+
+        // a number has to be followed by a separator or the end of the line
+        if( !parseFloat(p, end, values[numValues]) || (p != end && !isSeparator(*p) && *p != '\n') ) break;
+    }
+
+    const char* lineBreak = (const char*) std::memchr(p, '\n', end - p);
+    p = lineBreak ? lineBreak + 1 : end;
+    return numValues;
+}
+
+bool VertexFileLoader::parseLine(const char*& p, const char* end, const Schema& schema, Vertex& vertex)
+{
+    const int numColumns = std::min<int>(schema.columns.size(), MAX_COLUMNS);
+    float values[MAX_COLUMNS];
+    if(parseNumbers(p, end, values, numColumns) < numColumns) return false;
+
+    setAttributes(values, schema, vertex);
+    return true;
+}
+
+void VertexFileLoader::setAttributes(const float* values, const Schema& schema, Vertex& vertex)
+{
+    const int numColumns = std::min<int>(schema.columns.size(), MAX_COLUMNS);
+
+    // samples of the first lines may not cover the full value range, hence colors are clamped
+    auto unitRange = [](float value) { return std::max(0.0f, std::min(value, 1.0f)); };
+
+    bool hasRGB = false;
+    float intensity = -1;
+    for(int c = 0; c < numColumns; ++c)
+    {
+        switch(schema.columns[c])
+        {
+        case PositionX: vertex.position.setX(values[c]); break;
+        case PositionY: vertex.position.setY(values[c]); break;
+        case PositionZ: vertex.position.setZ(values[c]); break;
+        case NormalX: vertex.normal.setX(values[c]); break;
+        case NormalY: vertex.normal.setY(values[c]); break;
+        case NormalZ: vertex.normal.setZ(values[c]); break;
+        case Red: vertex.color.setX( unitRange(values[c] * schema.colorScale) ); hasRGB = true; break;
+        case Green: vertex.color.setY( unitRange(values[c] * schema.colorScale) ); hasRGB = true; break;
+        case Blue: vertex.color.setZ( unitRange(values[c] * schema.colorScale) ); hasRGB = true; break;
+        case Intensity: intensity = unitRange( (values[c] + schema.intensityOffset) * schema.intensityScale ); break;
+        case Ignore: break;
+        }
+    }
+    if( !hasRGB && intensity >= 0 ) vertex.color = QVector3D(intensity, intensity, intensity);
+}
+
+bool VertexFileLoader::parseFloat(const char*& p, const char* end, float& value)
+{
+    static const double powersOfTen[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                         1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    auto isDigit = [](char c) { return c >= '0' && c <= '9'; };
+
+    const char* s = p;
+    const bool isNegative = s != end && *s == '-';
+    if(s != end && (*s == '-' || *s == '+')) ++s;
+
+    // digits beyond the 19th significant one can not change a float and only shift the decimal point
+    quint64 mantissa = 0;
+    int numDigits = 0;
+    int exponent = 0;
+    bool hasDigits = false;
+    for(; s != end && isDigit(*s); ++s)
+    {
+        hasDigits = true;
+        if(numDigits < 19)
+        {
+            mantissa = 10 * mantissa + (*s - '0');
+            if(mantissa != 0) ++numDigits;
+        }
+        else ++exponent;
+    }
+    if(s != end && *s == '.')
+    {
+        for(++s; s != end && isDigit(*s); ++s)
+        {
+            hasDigits = true;
+            if(numDigits < 19)
+            {
+                mantissa = 10 * mantissa + (*s - '0');
+                if(mantissa != 0) ++numDigits;
+                --exponent;
+            }
+        }
+    }
+    if( !hasDigits ) return false;
+
+    // an exponent without digits is not part of the number
+    if(s != end && (*s == 'e' || *s == 'E'))
+    {
+        const char* e = s + 1;
+        const bool isNegativeExponent = e != end && *e == '-';
+        if(e != end && (*e == '-' || *e == '+')) ++e;
+        if(e != end && isDigit(*e))
+        {
+            int decimalExponent = 0;
+            for(; e != end && isDigit(*e); ++e) decimalExponent = std::min(10 * decimalExponent + (*e - '0'), 100000);
+            exponent += isNegativeExponent ? -decimalExponent : decimalExponent;
+            s = e;
+        }
+    }
+
+    // mantissa and powers up to 10^22 are exact doubles, so the common case is a single correctly rounded operation
+    double result = mantissa;
+    exponent = std::max(-400, std::min(exponent, 400));
+    for(; exponent > 22; exponent -= 22) result *= powersOfTen[22];
+    for(; exponent < -22; exponent += 22) result /= powersOfTen[22];
+    result = exponent >= 0 ? result * powersOfTen[exponent] : result / powersOfTen[-exponent];
+
+    value = (float) (isNegative ? -result : result);
+    p = s;
+    return true;
+}
@@ -2,42 +2,98 @@
 #define VERTEXFILELOADER_H
 
 #include <QVector3D>
-#include <QVector>
-#include <QDebug>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
 
-#include <iostream>
-#include <fstream>
 #include "vertex.h"
 
 class VertexFileLoader
 {
 public:
-    static void loadVerticesFromFile(const char* filename, QVector<Vertex>& vertices, bool append = false)
+    /*!
+     * \brief The Column enum
+     * \details meaning of a column of an XYZ file
+     */
+    enum Column
     {
-        // clear buffer if append flag is not set
-        if(!append) vertices.clear();
+        Ignore,
+        PositionX, PositionY, PositionZ,
+        NormalX, NormalY, NormalZ,
+        Red, Green, Blue,
+        Intensity   //!< stored as grey value in Vertex::color if the file has no RGB columns
+    };
 
-        std::ifstream file(filename, std::ios::in);
-        if( file.is_open() )
-        {
-            Vertex v;
-            while(!file.eof())
-            {
-                // read vertex coordinates
-                file >> v.position[0]
-                     >> v.position[1]
-                     >> v.position[2];
-                vertices.append( v );
-            }
-            file.close();
-        }
-        else qWarning() << "could not open file " << filename;
+    /*!
+     * \brief The Schema struct
+     * \details column layout of an XYZ file and the scaling of its attribute values to Vertex::color
+     */
+    struct Schema
+    {
+        std::vector<Column> columns; //!< meaning of the leading columns, further columns are ignored
+        float colorScale = 1.0f / 255; //!< factor from RGB column values to the range [0, 1]
+        float intensityOffset = 0; //!< added to intensity values before scaling
+        float intensityScale = 1.0f / 255; //!< factor from offset intensity values to the range [0, 1]
 
-        file.close();
-    }
+        bool has(Column column) const { return std::find(columns.begin(), columns.end(), column) != columns.end(); }
+        bool hasNormals() const { return has(NormalX) && has(NormalY) && has(NormalZ); }
+        bool hasColors() const { return has(Red) || has(Green) || has(Blue) || has(Intensity); }
+    };
+
+    /*!
+     * \brief batch callback
+     * \details receives the vertices of a batch once they are final, in file order. The pointer is only valid during the
+     * call. Returning false stops loading
+     */
+    typedef std::function<bool(const Vertex* vertices, PointIndex numVertices)> BatchLoaded;
+
+    /*!
+     * \brief load XYZ, PLY, LAS or native point cloud file
+     * \details XYZ files hold one point per line, given by columns separated by whitespace, commas or semicolons. Lines
+     * that do not start with as many numbers as the schema has columns are skipped, e.g. headers. The file is memory
+     * mapped and cut into chunks at line breaks, which are parsed in parallel straight into the vertex buffer.
+     * Files starting with a PLY header are read with VertexFileLoader::parsePLY, LAS files with
+     * VertexFileLoader::parseLAS and files written by PointCloudFile::save are mapped with PointCloudFile::load instead
+     * \param filename
+     * \param vertices
+     * \param append keep the current vertices and append the loaded ones
+     * \param schema column layout of an XYZ file. If it is 0 or has no columns, the layout is detected with
+     * VertexFileLoader::detectSchema and the detected schema is returned here. For PLY files the vertex properties
+     * that have been read are returned, for LAS files position, intensity and RGB if the point format has it and for
+     * native files the attributes they hold
+     * \param batchLoaded called from the calling thread whenever a batch of vertices is complete, e.g. to display them
+     * while the rest of the file is read
+     * \return false if the file could not be read or loading was stopped by batchLoaded
+     */
+    static bool loadVerticesFromFile(const char* filename, std::vector<Vertex>& vertices, bool append = false, Schema* schema = 0,
+                                     const BatchLoaded& batchLoaded = BatchLoaded());
+
+    /*!
+     * \brief save PLY file
+     * \details writes position, normal and color of all vertices as binary PLY, positions and normals as float,
+     * colors as uchar
+     * \param filename
+     * \param vertices
+     * \param bigEndian write big endian instead of little endian values
+     * \return false if the file could not be written
+     */
+    static bool saveVerticesToPLY(const char* filename, const std::vector<Vertex>& vertices, bool bigEndian = false);
+
+    /*!
+     * \brief detect column layout
+     * \details samples the first lines of XYZ text. The first three columns are the position, the remaining ones are
+     * assigned greedily: a triple of unit length in all samples are normals, a triple of values in [0, 1] or integers
+     * in [0, 65535] is RGB and a single column is intensity. An intensity column directly followed by RGB is preferred
+     * over RGB followed by intensity, as in PTS files. Color and intensity scales follow from the sampled value ranges
+     * \param begin
+     * \param end
+     * \return detected schema, x, y and z only if the samples have no further columns
+     */
+    static Schema detectSchema(const char* begin, const char* end);
 
     // default point cloud without file loading (quick to load)
-    static void cubePointCloudVertices(int pointRes, float size, QVector<Vertex>& vertices, bool append = false)
+    static void cubePointCloudVertices(int pointRes, float size, std::vector<Vertex>& vertices, bool append = false)
     {
         // clear buffer if append flag is not set
         if(!append) vertices.clear();
@@ -69,6 +125,142 @@ public:
             }
         }
     }
+
+private:
+    /*!
+     * \brief The PLYType enum
+     * \details scalar types of PLY properties
+     */
+    enum PLYType
+    {
+        PLYInvalid,
+        PLYInt8, PLYUInt8,
+        PLYInt16, PLYUInt16,
+        PLYInt32, PLYUInt32,
+        PLYFloat32, PLYFloat64
+    };
+
+    /*!
+     * \brief The PLYProperty struct
+     * \details scalar property of a binary PLY vertex record
+     */
+    struct PLYProperty
+    {
+        PLYType type; //!< value type
+        int offset; //!< byte offset in the record
+    };
+
+    /*!
+     * \brief parse PLY file
+     * \details reads the vertex element of ASCII and binary PLY files. Properties x, y, z, nx, ny, nz, red, green, blue
+     * and intensity are read, all others are skipped. Binary records have a fixed size, so they are decoded in
+     * parallel right from the mapped file in blocks of RECORD_BLOCK_SIZE, ASCII vertex lines are handed to
+     * VertexFileLoader::parseXYZ
+     * \param begin
+     * \param end
+     * \param vertices
+     * \param schema receives the vertex properties that are read
+     * \param batchLoaded
+     * \return false if the header is invalid or the vertex element can not be located
+     */
+    static bool parsePLY(const char* begin, const char* end, std::vector<Vertex>& vertices, Schema& schema, const BatchLoaded& batchLoaded);
+
+    /*!
+     * \brief parse LAS file
+     * \details reads LAS 1.0 to 1.4 files with point data record formats 0 to 3 and 6 to 8, compressed files are not
+     * supported. Integer coordinates are scaled and offset as given by the header. Intensity and RGB are 16 bit values
+     * in the standard, but often hold 8 bit values, hence they are scaled by 1/255 if a sample of the records has no
+     * larger values. Records are decoded in parallel in blocks of RECORD_BLOCK_SIZE, so the mapped file is read front to back
+     * \param begin
+     * \param end
+     * \param vertices
+     * \param schema receives the attributes that are read
+     * \param batchLoaded
+     * \return false if the header is invalid or the point format is not supported
+     */
+    static bool parseLAS(const char* begin, const char* end, std::vector<Vertex>& vertices, Schema& schema, const BatchLoaded& batchLoaded);
+
+    /*!
+     * \brief PLY type from name
+     * \param name type name, e.g. float or float32
+     * \return type, PLYInvalid for unknown names
+     */
+    static PLYType plyType(const std::string& name);
+
+    /*!
+     * \brief size of a PLY type
+     * \param type
+     * \return size in bytes
+     */
+    static int plyTypeSize(PLYType type);
+
+    /*!
+     * \brief read a binary PLY value
+     * \param data
+     * \param type
+     * \param swapBytes value is stored in the byte order opposite to the host
+     * \return value converted to float
+     */
+    static float readPLYValue(const char* data, PLYType type, bool swapBytes);
+
+    /*!
+     * \brief set vertex attributes
+     * \details assigns one value per schema column to the vertex, scales colors and intensity to [0, 1]
+     * \param values
+     * \param schema
+     * \param vertex attributes not in schema are left unchanged
+     */
+    static void setAttributes(const float* values, const Schema& schema, Vertex& vertex);
+
+    /*!
+     * \brief parse XYZ text
+     * \details parses the lines of [begin, end) in parallel and appends the points to vertices. The text is parsed in
+     * batches of a few chunks per thread, each batch is complete before the next one is read
+     * \param begin
+     * \param end
+     * \param schema
+     * \param vertices
+     * \param batchLoaded
+     */
+    static void parseXYZ(const char* begin, const char* end, const Schema& schema, std::vector<Vertex>& vertices,
+                         const BatchLoaded& batchLoaded);
+
+    /*!
+     * \brief parse numbers of a line
+     * \param p start of the line, moved behind its line break
+     * \param end end of the text
+     * \param values receives the leading numbers of the line
+     * \param maxValues capacity of values
+     * \return number of leading numbers, at most maxValues
+     */
+    static int parseNumbers(const char*& p, const char* end, float* values, int maxValues);
+
+    /*!
+     * \brief parse a line
+     * \param p start of the line, moved behind its line break
+     * \param end end of the text
+     * \param schema
+     * \param vertex receives the attributes of the line, attributes not in schema are left unchanged
+     * \return true if the line starts with a number for every column of schema
+     */
+    static bool parseLine(const char*& p, const char* end, const Schema& schema, Vertex& vertex);
+
+    /*!
+     * \brief parse a number
+     * \details locale independent decimal parser in the spirit of std::from_chars: up to 19 significant digits are
+     * collected in an integer and scaled by a power of ten once, which is exact for all numbers of typical scan files
+     * \param p first character of the number, moved behind it on success
+     * \param end end of the text
+     * \param value receives the number
+     * \return false if p does not point to a number
+     */
+    static bool parseFloat(const char*& p, const char* end, float& value);
+
+    static const qint64 CHUNK_SIZE = 1 << 22; //!< size of the chunks the file is parsed in
+    static const int MAX_COLUMNS = 32; //!< columns beyond are ignored
+    static const int SCHEMA_SAMPLE_LINES = 256; //!< number of lines VertexFileLoader::detectSchema looks at
+    static const int PLY_WRITE_BLOCK_SIZE = 1 << 16; //!< number of vertex records encoded at once when writing PLY
+    static const PointIndex RECORD_BLOCK_SIZE = 1 << 20; //!< number of binary PLY or LAS records decoded at once
 };
 
 #endif // VERTEXFILELOADER_H